@@ -8,12 +8,53 @@
     Optionally creates a non-interleaved planar format file (.bpf) for specific development needs.
     The output files will be named based on the input file name, with .bpl, .pal, .chk, and .bpf extensions.
 
-    Usage: iff2bpl [-o output_name] [-c] [-cd] [-ni] <input.iff>
+    Usage: iff2bpl [-o output_name] [-c] [-cd] [-ni] [-m] [-s] [-q|-v] [--stats] [--cache dir] [-pf ocs|aga|rgb32] [-ps colours] [--hex] [--info] [-rect x,y,w,h] [-tiles WxH] [-spr] [-sprpos x,y] [-p|-pa pack_file] [-j threads] [-l list_file] <input.iff> [more.iff ...]
+           iff2bpl --serve [options] [-j threads]
     Options:
-      -o output_name  Specify custom base name for output files
+      -o output_name  Specify custom base name for output files (single input only). "-o -" writes the
+                      bitplane data to stdout (no .pal, messages go to stderr, not with -c/-cd/-ni)
       -c              Also create chunky format output (.chk file)
       -cd             Also create chunky format with bit doubling (.chk file)
       -ni             Also create non-interleaved planar format (.bpf file)
+      -m              Also write the mask plane of images with one (BMHD masking 1) to a .msk file. The
+                      mask plane is never part of the .bpl/.chk/.bpf data (not with -p)
+      -spr            Also write the image as hardware sprites to a .spr file: one sprite per 16 pixel
+                      strip, attached pairs for 3 or 4 planes (see below; not with -p)
+      -sprpos x,y     Hardware position (HSTART, VSTART) stored in the sprite control words, default 0,0.
+                      Implies -spr
+      -s              Stream the input: read and decode the BODY band by band, so memory use
+                      does not depend on the image size (works with pipes)
+      -q              Quiet: print only errors and warnings (and the --stats lines)
+      -v              Verbose: print every detail of the conversion (chunks, BMHD, palette, files)
+                      instead of the default one line per file
+      --stats         Print one JSON line per file with the time and bytes of every stage
+                      (parse, read, decode, c2p, deinterleave, sprite, write_bpl/chk/bpf/pal/msk/spr,
+                      cache, delta)
+      --cache dir     Keep copies of the outputs in a conversion cache in dir, keyed by a hash of the input
+                      and of -c/-cd/-ni. Unchanged inputs are then restored from the cache without
+                      decoding. Not used with -s or -p.
+      -pf format      Palette format of the .pal file: ocs (default, 0RGB words with 4 bits per gun),
+                      aga (8 bits per gun: a word of the high nibbles and a word of the low nibbles per
+                      colour, as loaded with BPLCON3 LOCT) or rgb32 (a LoadRGB32() table)
+      -ps colours     Palette set mode: every input is a raw table of 8-bit R, G, B palettes with this
+                      many colours each (fade or colour cycling tables); all palettes are converted in
+                      one call and written back to back to <output_name>.pal
+      --hex           Print the palette words in hex while converting
+      --info          Only print the chunks, BMHD and CMAP of each file (one line per file, the chunk
+                      list with -v). Only the chunk headers and the BMHD and CMAP are read; the chunk
+                      data in between is skipped with seeks, so the BODY is never read.
+      -rect x,y,w,h   Convert only the region of w x h pixels at x,y (any x, not only multiples of 8 or 16)
+      -tiles WxH      Cut the image, or the -rect region, into tiles of WxH pixels, left to right and top to
+                      bottom, written as <output_name>_0000.bpl, _0001.bpl, ... (and .chk/.bpf; one .pal).
+                      Columns and rows that do not fill a whole tile are left out. Only the rows needed are
+                      read or decoded, in one pass for all tiles (not with ANIM files, -tiles not with -p).
+      -p pack_file    Write the products of all input files into one pack file with a table of contents
+                      instead of separate .bpl/.pal/.chk/.bpf files (see libiffbpl.h for the format)
+      -pa pack_file   As -p, but append the images to an existing pack file
+      -j threads      Number of worker threads used in batch and server mode (default: number of CPU cores).
+                      A single large input with a BIDX row index (bpl2iff -ri) is decoded by -j threads.
+      --serve         Server mode: convert the requests read from stdin, see below
+      -l list_file    Read input file names from list_file (one per line, # starts a comment), "-" = stdin
 
     Examples: 
       iff2bpl myimage.iff                Creates myimage.bpl and myimage.pal
@@ -22,17 +63,58 @@
       iff2bpl -cd myimage.iff            Creates myimage.bpl, myimage.pal and myimage.chk (bit doubled)
       iff2bpl -ni myimage.iff            Creates myimage.bpl, myimage.pal and myimage.bpf
       iff2bpl -c -ni -o sprite myimage.iff Creates sprite.bpl, sprite.pal, sprite.chk and sprite.bpf
+      iff2bpl -c a.iff b.iff c.iff       Converts all three files in one process (batch mode)
+      iff2bpl -j 4 -l assets.txt         Converts every file listed in assets.txt using 4 threads
+      iff2bpl -pf aga -ps 256 fades.rgb  Converts all 256 colour palettes in fades.rgb to fades.pal (AGA)
+      iff2bpl -tiles 16x16 sheet.iff     Creates sheet_0000.bpl, sheet_0001.bpl, ... and sheet.pal
+      bpl2iff ... -o - - | iff2bpl -s -o - - > out.bpl   Converts a pipe without temporary files
 
     Output: 
       .bpl file - Raw bitplane data (interleaved format for Amiga hardware - default)
       .pal file - Palette data (16-bit words in Amiga color register format)
-      .chk file - Chunky pixel data (8-bit per pixel, optional with -c or -cd flags)
+      .chk file - Chunky pixel data (8-bit per pixel, optional with -c or -cd flags; deep images with more
+                  than 8 planes get packed RGB (24 planes) or RGBA (32 planes) pixels, see below)
       .bpf file - Non-interleaved planar data (all rows of plane 0, then plane 1, etc., optional with -ni flag)
+      .msk file - The mask plane (one bitplane, rows padded like the .bpl rows, optional with -m flag)
+      .spr file - Hardware sprites (optional with -spr flag)
+
+    Sprites: an image of up to 4 planes is cut into strips of 16 pixels, left to right. A strip of 1 or 2
+    planes is one sprite, of 3 or 4 planes an attached pair (planes 0/1 in the even sprite, 2/3 in the odd
+    one, which has the attach bit set). Every sprite is stored as SPRxPOS, SPRxCTL, a DATA/DATB word pair
+    per row and two 0 words, ready for the sprite DMA; the sprites follow each other in strip order. The
+    sprite data is made from the decoded bitplanes of each band while it is converted, for all strips in
+    the same pass, so no .bpl file has to be read back. With -tiles every tile gets its own .spr file.
+
+    Deep ILBMs (24 or 32 planes: 8 each for red, green, blue and alpha) have no CMAP. Their .chk pixels
+    are numPlanes / 8 bytes, byte k holding planes 8k .. 8k + 7, so 24 planes give R, G, B and 32 planes
+    R, G, B, A bytes. An image with a mask plane (BMHD masking 1) has one more scanline per row in its
+    BODY; it is left out of the .bpl, .chk and .bpf data and written to the .msk file with -m.
 
     The -cd option creates chunky data where each bit of the 4 least significant bits is doubled.
     For example: 00000001 becomes 00000011, 00000010 becomes 00001100, 00001101 becomes 11110011.
 
-    Compiles with: gcc iff2bpl.c -o iff2bpl.exe
+    ANIM files: every frame of a FORM ANIM is written as <output_name>_0000.bpl, <output_name>_0001.bpl, ...
+    (and .chk/.bpf), with one .pal from the first frame. Later frames are built by applying their DLTA
+    chunks (operations 5, 7 and 8) to the previous frames in place, not decoded from scratch.
+
+    Batch mode: when more than one input file is given (on the command line and/or with -l) the files
+    are converted by a pool of worker threads. Each file gets its own buffers and its messages are
+    collected and printed in input order once all files are done, so the output is deterministic.
+
+    Server mode (--serve): a client such as an editor starts iff2bpl once and writes one request per
+    line to its stdin, "<id> [options] [-o output_name] <input.iff>" with the options of a single
+    conversion (-c, -cd, -ni, -s, --stats, --cache, -pf, -ps, --hex, --info, -rect, -tiles; those of the
+    command line are the defaults). "<id> [options] -o output_name -data <size>" is followed by <size>
+    bytes of inline input. Up to -j requests are converted at once. Each answer is written to stdout in
+    one piece when its request is done: the messages, one "<id> <message>" line each ("<id> ! <message>"
+    for errors and warnings), then "<id> done <result>" (0 = success). Answers can come out of request
+    order. A request line longer than 4095 characters fails (its inline input is skipped), a -data size
+    that is not a number ends the session. The server exits at the end of stdin.
+
+    Compiles with: gcc iff2bpl.c libiffbpl.c convcache.c -o iff2bpl.exe
+    (on Linux/macOS add -pthread: gcc iff2bpl.c libiffbpl.c convcache.c -pthread -o iff2bpl)
+    The ILBM, PackBits and bitplane conversion code lives in libiffbpl.c/.h, which can also be linked
+    into other programs to convert images in memory.
     You can also use VS Code with the included configuration files to build this project.
 
     Copyright (c) 2025 Kane/Suspect, provided under the GNU GPLv3 License. 
@@ -41,101 +123,415 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdarg.h>
 #include <string.h>
 #include <sys/stat.h>
 
-#pragma pack(push, 1)
+#include "libiffbpl.h"
+#include "convcache.h"
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#else
+#include <io.h>
+#include <fcntl.h>
+#ifndef S_ISREG
+#define S_ISREG(m) (((m) & S_IFMT) == S_IFREG)
+#endif
+#endif
+
+// Conversion options shared (read-only) by all conversions of a run
+typedef struct {
+    int create_chunky;
+    int create_chunky_doubled;
+    int create_noninterleaved;
+    int write_mask; // -m: write the mask plane of images with masking 1 to a .msk file
+    int sprites; // -spr: write the image as hardware sprites to a .spr file
+    int sprite_x, sprite_y; // -sprpos: hardware position stored in the sprite control words
+    int streaming;
+    int stats;
+    const char* cache_dir; // --cache: conversion cache directory
+    const char* pack_filename; // -p / -pa: products go into this pack file
+    int pack_append; // -pa: add to an existing pack
+    int palette_format; // -pf: PAL_OCS, PAL_AGA or PAL_RGB32
+    int palette_set_colours; // -ps: the inputs are raw 8-bit RGB palette tables of this many colours each
+    int hex_dump; // --hex: print the palette
+    int info; // --info: print the chunks and metadata only, the BODY is not read
+    int rect_x, rect_y, rect_w, rect_h; // -rect: convert only this region of the image (rect_w 0 = all of it)
+    int tile_w, tile_h; // -tiles: cut the image (or the -rect region) into tiles of this size (0 = no tiles)
+    int decode_threads; // threads decoding one BODY that has a BIDX row index (0 or 1 = decode on this thread)
+} ConvertOptions;
+
+// Stages timed for --stats
+enum { STAGE_PARSE, STAGE_READ, STAGE_DECODE, STAGE_C2P, STAGE_DEINTERLEAVE, STAGE_SPRITE,
+       STAGE_WRITE_BPL, STAGE_WRITE_CHK, STAGE_WRITE_BPF, STAGE_WRITE_PAL, STAGE_WRITE_MSK, STAGE_WRITE_SPR,
+       STAGE_CACHE, STAGE_DELTA, NUM_STAGES };
+static const char* const stage_names[NUM_STAGES] = {
+    "parse", "read", "decode", "c2p", "deinterleave", "sprite", "write_bpl", "write_chk", "write_bpf", "write_pal",
+    "write_msk", "write_spr", "cache", "delta"
+};
+
+// Products of a conversion: the pack sections, and the .msk mask plane (-m) and .spr sprites (-spr), which
+// have no pack section
+enum { PRODUCT_MSK = PACK_SECTIONS, PRODUCT_SPR, NUM_PRODUCTS };
+
+// Growable text buffer used to collect messages of one conversion
+typedef struct {
+    char* text;
+    size_t len;
+    size_t cap;
+} TextBuffer;
+
+// Message sink of one conversion. When 'buffered' is 0 messages go straight to stdout/stderr,
+// otherwise they are kept in 'out'/'err' until flush_log() is called.
 typedef struct {
-    uint16_t width;
-    uint16_t height;
-    uint16_t x;
-    uint16_t y;
-    uint8_t numPlanes;
-    uint8_t masking;
-    uint8_t compression;
-    uint8_t pad1;
-    uint16_t transparentColor;
-    uint8_t xAspect;
-    uint8_t yAspect;
-    uint16_t pageWidth;
-    uint16_t pageHeight;
-} BMHD;
-#pragma pack(pop)
-
-void print_hex(const uint8_t* data, size_t len) {
+    int buffered;
+    TextBuffer out;
+    TextBuffer err;
+} ConvertLog;
+
+static void text_vappend(TextBuffer* tb, const char* fmt, va_list ap) {
+    va_list ap2;
+    va_copy(ap2, ap);
+    int n = vsnprintf(NULL, 0, fmt, ap2);
+    va_end(ap2);
+    if (n <= 0) return;
+    if (tb->len + (size_t)n + 1 > tb->cap) {
+        size_t cap = tb->cap ? tb->cap : 256;
+        while (tb->len + (size_t)n + 1 > cap) cap *= 2;
+        char* tmp = (char*)realloc(tb->text, cap);
+        if (!tmp) return;
+        tb->text = tmp;
+        tb->cap = cap;
+    }
+    vsnprintf(tb->text + tb->len, tb->cap - tb->len, fmt, ap);
+    tb->len += (size_t)n;
+}
+
+// Append raw bytes, returns 0 on success
+static int text_append(TextBuffer* tb, const char* text, size_t len) {
+    if (tb->len + len + 1 > tb->cap) {
+        size_t cap = tb->cap ? tb->cap : 256;
+        while (tb->len + len + 1 > cap) cap *= 2;
+        char* tmp = (char*)realloc(tb->text, cap);
+        if (!tmp) return 1;
+        tb->text = tmp;
+        tb->cap = cap;
+    }
+    memcpy(tb->text + tb->len, text, len);
+    tb->len += len;
+    tb->text[tb->len] = '\0';
+    return 0;
+}
+
+// Message levels: -q shows only errors and warnings (and --stats), the default one line per file, -v
+// every detail of the conversion
+enum { LOG_QUIET, LOG_NORMAL, LOG_VERBOSE };
+
+// Stream for informational messages: stdout, or stderr when stdout carries the image data (-o -), and
+// the message level. Set once by main() before any conversion starts.
+static FILE* info_stream;
+static int log_level = LOG_NORMAL;
+
+// printf-style message to the conversion log (stdout), shown from message level 'level' up. Messages
+// above the current level are not even formatted.
+void log_at(ConvertLog* log, int level, const char* fmt, ...) {
+    if (level > log_level) return;
+    va_list ap;
+    va_start(ap, fmt);
+    if (log && log->buffered) text_vappend(&log->out, fmt, ap);
+    else vfprintf(info_stream, fmt, ap);
+    va_end(ap);
+}
+
+// printf-style detail message to the conversion log (stdout), shown with -v
+void log_info(ConvertLog* log, const char* fmt, ...) {
+    if (log_level < LOG_VERBOSE) return;
+    va_list ap;
+    va_start(ap, fmt);
+    if (log && log->buffered) text_vappend(&log->out, fmt, ap);
+    else vfprintf(info_stream, fmt, ap);
+    va_end(ap);
+}
+
+// printf-style message to the conversion log (stderr)
+void log_error(ConvertLog* log, const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    if (log && log->buffered) text_vappend(&log->err, fmt, ap);
+    else vfprintf(stderr, fmt, ap);
+    va_end(ap);
+}
+
+// Print collected messages and release the buffers
+void flush_log(ConvertLog* log) {
+    if (log->out.len) fwrite(log->out.text, 1, log->out.len, info_stream);
+    if (log->err.len) fwrite(log->err.text, 1, log->err.len, stderr);
+    free(log->out.text);
+    free(log->err.text);
+    memset(&log->out, 0, sizeof(log->out));
+    memset(&log->err, 0, sizeof(log->err));
+}
+
+// Hex dump (--hex), shown at the default message level
+void print_hex(ConvertLog* log, const uint8_t* data, size_t len) {
     for (size_t i = 0; i < len; ++i) {
-        printf("%02X ", data[i]);
-        if ((i + 1) % 16 == 0) printf("\n");
+        log_at(log, LOG_NORMAL, "%02X ", data[i]);
+        if ((i + 1) % 16 == 0) log_at(log, LOG_NORMAL, "\n");
     }
-    if (len % 16 != 0) printf("\n");
+    if (len % 16 != 0) log_at(log, LOG_NORMAL, "\n");
 }
 
-long get_file_size(FILE* f) {
-    long cur = ftell(f);
-    fseek(f, 0, SEEK_END);
-    long size = ftell(f);
-    fseek(f, cur, SEEK_SET);
-    return size;
+// The --stats line, shown at every message level
+static void log_stats(ConvertLog* log, const StageStats* st, const char* filename) {
+    char json[2048];
+    stats_format_json(st, "iff2bpl", filename, json, sizeof(json));
+    log_at(log, LOG_QUIET, "%s\n", json);
 }
 
-void write_bin(const char* filename, const uint8_t* data, size_t len) {
+// Switch stdin/stdout to binary mode when they carry image data ("-" file names)
+static void set_binary_mode(FILE* f) {
+#ifdef _WIN32
+    _setmode(_fileno(f), _O_BINARY);
+#else
+    (void)f;
+#endif
+}
+
+// Returns 0 on success
+int write_bin(ConvertLog* log, const char* filename, const uint8_t* data, size_t len) {
     FILE* f = fopen(filename, "wb");
     if (!f) {
-        fprintf(stderr, "Failed to open %s for writing\n", filename);
-        return;
+        log_error(log, "Failed to open %s for writing\n", filename);
+        return 1;
     }
-    fwrite(data, 1, len, f);
-    fclose(f);
+    int failed = fwrite(data, 1, len, f) != len;
+    failed |= fclose(f) != 0;
+    return failed;
+}
+
+// Whole input file in memory: a read-only mapping of the file when possible, otherwise (pipes,
+// devices, filesystems without mapping support) a heap copy read with stdio.
+typedef struct {
+    const uint8_t* data;
+    size_t size;
+    int mapped;
+#ifdef _WIN32
+    HANDLE mapping;
+#endif
+} InputFile;
+
+// Read the whole stream into a heap buffer without relying on seeks
+static int read_input_stdio(FILE* f, InputFile* in) {
+    size_t cap = 64 * 1024, len = 0;
+    uint8_t* buf = (uint8_t*)malloc(cap);
+    if (!buf) return 1;
+    for (;;) {
+        if (len == cap) {
+            uint8_t* tmp = (uint8_t*)realloc(buf, cap * 2);
+            if (!tmp) { free(buf); return 1; }
+            buf = tmp;
+            cap *= 2;
+        }
+        size_t got = fread(buf + len, 1, cap - len, f);
+        len += got;
+        if (got == 0) break;
+    }
+    in->data = buf;
+    in->size = len;
+    in->mapped = 0;
+    return 0;
 }
 
-// Helper to read 4 bytes as big-endian uint32_t
-uint32_t read_be32(FILE* f) {
-    uint8_t b[4];
-    if (fread(b, 1, 4, f) != 4) return 0;
-    return ((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16) | ((uint32_t)b[2] << 8) | b[3];
+// Read a regular file of known size with one read of exactly that size (a file that shrank meanwhile
+// gives what is left)
+static int read_input_exact(FILE* f, size_t size, InputFile* in) {
+    uint8_t* buf = (uint8_t*)malloc(size);
+    if (!buf) return 1;
+    in->data = buf;
+    in->size = fread(buf, 1, size, f);
+    in->mapped = 0;
+    return 0;
 }
 
-// Helper to read 2 bytes as big-endian uint16_t
-uint16_t read_be16(FILE* f) {
-    uint8_t b[2];
-    if (fread(b, 1, 2, f) != 2) return 0;
-    return ((uint16_t)b[0] << 8) | b[1];
+// 1 if the stream is a regular file (it can seek and its size is known)
+static int is_regular(FILE* f, uint64_t* size) {
+    struct stat st;
+    if (fstat(fileno(f), &st) != 0 || !S_ISREG(st.st_mode)) return 0;
+    if (size) *size = (uint64_t)st.st_size;
+    return 1;
 }
 
-// Decompress ILBM RLE (PackBits) for a single scanline
-size_t decompress_packbits(const uint8_t* src, size_t src_len, uint8_t* dst, size_t dst_len) {
-    size_t si = 0, di = 0;
-    while (si < src_len && di < dst_len) {
-        int8_t n = (int8_t)src[si++];
-        if (n >= 0) {
-            // Copy next n+1 bytes literally
-            int count = n + 1;
-            if (si + count > src_len) count = src_len - si;
-            if (di + count > dst_len) count = dst_len - di;
-            memcpy(dst + di, src + si, count);
-            si += count;
-            di += count;
-        } else if (n != -128) {
-            // Repeat next byte (-n)+1 times
-            int count = (-n) + 1;
-            if (si >= src_len) break;
-            uint8_t val = src[si++];
-            if (di + count > dst_len) count = dst_len - di;
-            memset(dst + di, val, count);
-            di += count;
+// Open the input file and make its whole content available in in->data. Returns 0 on success.
+int open_input(const char* filename, InputFile* in) {
+    memset(in, 0, sizeof(*in));
+#ifdef _WIN32
+    HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file != INVALID_HANDLE_VALUE) {
+        LARGE_INTEGER fsize;
+        if (GetFileType(file) == FILE_TYPE_DISK && GetFileSizeEx(file, &fsize) && fsize.QuadPart > 0) {
+            HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+            const uint8_t* view = mapping ? (const uint8_t*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+            if (view) {
+                CloseHandle(file);
+                in->data = view;
+                in->size = (size_t)fsize.QuadPart;
+                in->mapped = 1;
+                in->mapping = mapping;
+                return 0;
+            }
+            if (mapping) CloseHandle(mapping);
+        }
+        CloseHandle(file);
+    }
+#else
+    int fd = open(filename, O_RDONLY);
+    if (fd >= 0) {
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            void* view = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (view != MAP_FAILED) {
+                close(fd);
+                in->data = (const uint8_t*)view;
+                in->size = (size_t)st.st_size;
+                in->mapped = 1;
+                return 0;
+            }
         }
-        // else n == -128: NOP
+        close(fd);
+    }
+#endif
+    // Fallback: stdio, one exact read for a regular file, growing reads for pipes and devices
+    FILE* f = fopen(filename, "rb");
+    if (!f) return 1;
+    uint64_t size;
+    int ret = is_regular(f, &size) && size > 0 && size <= SIZE_MAX ? read_input_exact(f, (size_t)size, in)
+                                                                   : read_input_stdio(f, in);
+    fclose(f);
+    return ret;
+}
+
+void close_input(InputFile* in) {
+    if (in->mapped) {
+#ifdef _WIN32
+        UnmapViewOfFile(in->data);
+        CloseHandle(in->mapping);
+#else
+        munmap((void*)in->data, in->size);
+#endif
+    } else {
+        free((void*)in->data);
+    }
+    memset(in, 0, sizeof(*in));
+}
+
+// Read and discard len bytes of a stream without seeking, so it also works on pipes
+static void skip_stream(FILE* f, size_t len) {
+    uint8_t buf[4096];
+    while (len > 0) {
+        size_t n = len < sizeof(buf) ? len : sizeof(buf);
+        if (fread(buf, 1, n, f) != n) break;
+        len -= n;
+    }
+}
+
+// BODY bytes for the output stage. Either the whole BODY is in memory (data/len), or it is read
+// incrementally from 'stream' into a window, so memory use does not depend on the image height.
+typedef struct {
+    const uint8_t* data;
+    size_t len; // valid bytes in data
+    size_t pos; // next unread byte in data
+    FILE* stream; // NULL if the whole BODY is in memory
+    size_t remaining; // BODY bytes not read from stream yet
+    uint8_t* window;
+    size_t cap;
+    int window_fixed; // window is arena memory sized for the largest request, never grown
+    size_t size; // BODY bytes
+    const uint8_t* index; // BIDX row index checked against the image, or NULL
+    int decoded; // data holds the bitplanes of a compressed BODY decoded up front, not the BODY itself
+} BodySource;
+
+// Offset in the BODY of the next unread byte
+static size_t body_offset(const BodySource* bs) {
+    return bs->stream ? bs->size - bs->remaining - (bs->len - bs->pos) : bs->pos;
+}
+
+// Make at least 'want' unread BODY bytes available at data + pos (fewer at the end of the BODY).
+// Returns the number of unread bytes available.
+static size_t body_fill(BodySource* bs, size_t want) {
+    size_t avail = bs->len - bs->pos;
+    if (!bs->stream || avail >= want || bs->remaining == 0) return avail;
+    if (want > bs->cap && bs->window_fixed) want = bs->cap;
+    if (want > bs->cap) {
+        uint8_t* tmp = (uint8_t*)realloc(bs->window, want);
+        if (!tmp) return avail;
+        bs->window = tmp;
+        bs->data = tmp;
+        bs->cap = want;
     }
-    return di;
+    memmove(bs->window, bs->data + bs->pos, avail);
+    bs->data = bs->window;
+    bs->pos = 0;
+    bs->len = avail;
+    size_t n = bs->cap - avail;
+    if (n > bs->remaining) n = bs->remaining;
+    size_t got = fread(bs->window + avail, 1, n, bs->stream);
+    bs->len += got;
+    bs->remaining = got < n ? 0 : bs->remaining - got; // a short read means the file is truncated
+    return bs->len - bs->pos;
+}
+
+// body_fill() with the time spent reading the stream (and the bytes read) added to the read stage
+static size_t body_fill_timed(BodySource* bs, size_t want, StageStats* st) {
+    double t0 = time_seconds();
+    size_t remaining = bs->remaining;
+    size_t avail = body_fill(bs, want);
+    stats_add(st, STAGE_READ, t0, remaining - bs->remaining);
+    return avail;
+}
+
+// Drop n BODY bytes without using them: from memory or the window, then with a seek on a streamed file
+// (read and discarded on a pipe)
+static void body_skip(BodySource* bs, size_t n) {
+    size_t avail = bs->len - bs->pos;
+    size_t k = n < avail ? n : avail;
+    bs->pos += k;
+    n -= k;
+    if (!bs->stream || n == 0) return;
+    if (n > bs->remaining) n = bs->remaining;
+    if (n > 0x7FFFFFFF || fseek(bs->stream, (long)n, SEEK_CUR) != 0) skip_stream(bs->stream, n);
+    bs->remaining -= n;
 }
 
 void print_usage(const char* program_name) {
-    printf("Usage: %s [-o output_name] [-c] [-cd] [-ni] <.iff file>\n", program_name);
-    printf("  -o output_name  Specify custom base name for output files\n");
+    printf("Usage: %s [-o output_name] [-c] [-cd] [-ni] [-m] [-s] [-q|-v] [--stats] [--cache dir] [-pf ocs|aga|rgb32] [-ps colours] [--hex] [--info] [-rect x,y,w,h] [-tiles WxH] [-spr] [-sprpos x,y] [-p|-pa pack_file] [-j threads] [-l list_file] <.iff file> [more .iff files]\n", program_name);
+    printf("  -o output_name  Specify custom base name for output files (single input only), - = stdout\n");
     printf("  -c              Also create chunky format output (.chk file)\n");
     printf("  -cd             Also create chunky format with doubled bits (.chk file)\n");
     printf("  -ni             Also create non-interleaved planar format (.bpf file)\n");
-    printf("  <.iff file>     Input IFF/ILBM file to convert\n");
+    printf("  -m              Also write the mask plane of masked images (BMHD masking 1) to a .msk file\n");
+    printf("  -spr            Also write hardware sprites (16 pixel strips, attached pairs for 4 planes) to a .spr file\n");
+    printf("  -sprpos x,y     Hardware position in the sprite control words (default 0,0), implies -spr\n");
+    printf("  -s              Stream the input: decode BODY band by band with bounded memory\n");
+    printf("  -q              Quiet: print only errors and warnings\n");
+    printf("  -v              Verbose: print every detail instead of one line per file\n");
+    printf("  --stats         Print per-stage timings and byte counts as one JSON line per file\n");
+    printf("  --cache dir     Reuse the outputs of earlier identical conversions kept in dir\n");
+    printf("  -pf format      Palette format of the .pal file: ocs (default), aga or rgb32\n");
+    printf("  -ps colours     Palette set mode: inputs are raw 8-bit RGB palette tables, colours per palette\n");
+    printf("  --hex           Print the palette words in hex\n");
+    printf("  --info          Only print the chunks and the BMHD/CMAP metadata, the BODY is not read\n");
+    printf("  -rect x,y,w,h   Convert only this region of the image\n");
+    printf("  -tiles WxH      Cut the image (or the -rect region) into WxH tiles, written as <name>_0000.bpl, ...\n");
+    printf("  -p pack_file    Write all products of all inputs into one indexed pack file\n");
+    printf("  -pa pack_file   As -p, but append to an existing pack file\n");
+    printf("  -j threads      Number of worker threads in batch/server mode, or decoding one large indexed BODY\n");
+    printf("                  (default: number of CPU cores)\n");
+    printf("  --serve         Convert requests read from stdin until its end, answers on stdout\n");
+    printf("  -l list_file    Read input file names from list_file (one per line), - = stdin\n");
+    printf("  <.iff file>     Input IFF/ILBM or ANIM file(s) to convert, - reads stdin (needs -o)\n");
     printf("\n");
     printf("Examples:\n");
     printf("  %s image.iff              Creates image.bpl and image.pal\n", program_name);
@@ -144,347 +540,2213 @@ void print_usage(const char* program_name) {
     printf("  %s -cd image.iff          Creates image.bpl, image.pal and image.chk (doubled)\n", program_name);
     printf("  %s -ni image.iff          Creates image.bpl, image.pal and image.bpf\n", program_name);
     printf("  %s -c -ni -o sprite image.iff Creates sprite.bpl, sprite.pal, sprite.chk and sprite.bpf\n", program_name);
+    printf("  %s -j 4 -l assets.txt     Converts all files listed in assets.txt using 4 threads\n", program_name);
 }
 
-// Convert planar bitplane data to chunky format
-void convert_to_chunky(const uint8_t* planar_data, uint8_t* chunky_data, 
-                      uint16_t width, uint16_t height, uint8_t num_planes, int double_bits) {
-    size_t row_bytes = ((width + 15) / 16) * 2; // bytes per row per plane
-    
-    for (uint16_t y = 0; y < height; y++) {
-        for (uint16_t x = 0; x < width; x++) {
-            uint8_t pixel_value = 0;
-            
-            // Extract bit from each plane to build pixel value
-            for (uint8_t plane = 0; plane < num_planes; plane++) {
-                size_t plane_offset = (y * num_planes + plane) * row_bytes;
-                size_t byte_offset = x / 8;
-                uint8_t bit_offset = 7 - (x % 8);
-                
-                if (plane_offset + byte_offset < (size_t)(height * num_planes * row_bytes)) {
-                    uint8_t byte_val = planar_data[plane_offset + byte_offset];
-                    uint8_t bit_val = (byte_val >> bit_offset) & 1;
-                    pixel_value |= (bit_val << plane);
-                }
-            }
-            
-            if (double_bits) {
-                // Double each bit of the 4 least significant bits
-                uint8_t doubled_value = 0;
-                for (int bit = 0; bit < 4; bit++) {
-                    if (pixel_value & (1 << bit)) {
-                        doubled_value |= (3 << (bit * 2)); // Set two consecutive bits
-                    }
-                }
-                chunky_data[y * width + x] = doubled_value;
-            } else {
-                chunky_data[y * width + x] = pixel_value;
-            }
-        }
+#define BAND_BYTES (64 * 1024) // target size of one band of decoded rows in the fused output stage
+
+// Destination of one output product: a file, or a memory buffer when the products of a conversion are
+// collected for a pack file (-p)
+typedef struct {
+    FILE* f;
+    uint8_t* mem;
+    size_t pos; // write position in mem
+    size_t len; // bytes in mem
+    size_t cap;
+    int failed; // out of memory, or a write to the file failed
+} Output;
+
+// Products of one conversion kept in memory for a pack file, indexed by PACK_BPL, PACK_PAL, ...
+typedef struct {
+    Output out[PACK_SECTIONS];
+    PackEntry entry; // name, geometry and flags; the section offsets are assigned by write_pack()
+} ConvertProducts;
+
+// Make room for 'size' bytes of a memory output (the final size is usually known up front)
+static void out_reserve(Output* o, size_t size) {
+    if (o->f || size <= o->cap) return;
+    uint8_t* tmp = (uint8_t*)realloc(o->mem, size);
+    if (!tmp) {
+        o->failed = 1;
+        return;
     }
+    memset(tmp + o->cap, 0, size - o->cap);
+    o->mem = tmp;
+    o->cap = size;
 }
 
-// Convert interleaved planar data to non-interleaved planar format
-void convert_to_noninterleaved(const uint8_t* interleaved_data, uint8_t* noninterleaved_data,
-                              uint16_t width, uint16_t height, uint8_t num_planes) {
-    size_t row_bytes = ((width + 15) / 16) * 2; // bytes per row per plane
-    size_t plane_size = row_bytes * height; // bytes per complete plane
-    
-    for (uint8_t plane = 0; plane < num_planes; plane++) {
-        for (uint16_t y = 0; y < height; y++) {
-            // Source: interleaved format - plane data is mixed row by row
-            size_t src_offset = (y * num_planes + plane) * row_bytes;
-            // Destination: non-interleaved format - all rows of one plane together
-            size_t dst_offset = (plane * plane_size) + (y * row_bytes);
-            
-            memcpy(noninterleaved_data + dst_offset, interleaved_data + src_offset, row_bytes);
-        }
+static void out_write(Output* o, const void* data, size_t n) {
+    if (o->f) {
+        if (fwrite(data, 1, n, o->f) != n) o->failed = 1;
+        return;
     }
+    if (o->pos + n > o->cap) out_reserve(o, o->cap * 2 > o->pos + n ? o->cap * 2 : o->pos + n);
+    if (o->pos + n > o->cap) return;
+    memcpy(o->mem + o->pos, data, n);
+    o->pos += n;
+    if (o->pos > o->len) o->len = o->pos;
 }
 
-int main(int argc, char* argv[]) {
-    printf("IFF to Amiga BPL converter (c) Kane/Sct 2025\n");
-    if (argc < 2) {
-        print_usage(argv[0]);
-        return 1;
+static void out_seek(Output* o, size_t pos) {
+    if (o->f) {
+        if (fseek(o->f, (long)pos, SEEK_SET) != 0) o->failed = 1;
+    } else {
+        o->pos = pos;
     }
+}
 
-    const char* input_filename = NULL;
-    const char* output_name = NULL;
-    int create_chunky = 0;
-    int create_chunky_doubled = 0;
-    int create_noninterleaved = 0;
-    
-    // Parse command line arguments
-    for (int i = 1; i < argc; i++) {
-        if (strcmp(argv[i], "-o") == 0) {
-            if (i + 1 < argc) {
-                output_name = argv[++i];
-            } else {
-                fprintf(stderr, "Error: -o option requires an output filename\n");
-                print_usage(argv[0]);
-                return 1;
-            }
-        } else if (strcmp(argv[i], "-c") == 0) {
-            create_chunky = 1;
-        } else if (strcmp(argv[i], "-cd") == 0) {
-            create_chunky_doubled = 1;
-        } else if (strcmp(argv[i], "-ni") == 0) {
-            create_noninterleaved = 1;
-        } else {
-            input_filename = argv[i];
-        }
-    }
-    
-    if (!input_filename) {
-        fprintf(stderr, "Error: No input file specified\n");
-        print_usage(argv[0]);
-        return 1;
+// Close the file of an output (stdout is flushed instead). Returns 0 on success; if a write failed the
+// error is logged and the partial file is removed. A memory output is left to the caller, which fails the
+// pack entry when it ran out of memory.
+static int close_output(ConvertLog* log, Output* o, const char* filename, int to_stdout) {
+    if (!o->f) return 0;
+    if ((to_stdout ? fflush(o->f) : fclose(o->f)) != 0) o->failed = 1;
+    o->f = NULL;
+    if (!o->failed) return 0;
+    log_error(log, "Failed to write %s\n", filename);
+    if (!to_stdout) remove(filename);
+    return 1;
+}
+
+static void free_products(ConvertProducts* prod) {
+    for (int i = 0; i < PACK_SECTIONS; i++) free(prod->out[i].mem);
+    memset(prod, 0, sizeof(*prod));
+}
+
+static FILE* open_output(ConvertLog* log, const char* filename) {
+    FILE* f = fopen(filename, "wb");
+    if (!f) log_error(log, "Failed to open %s for writing\n", filename);
+    return f;
+}
+
+// Rows per band of the fused output stage: about BAND_BYTES of BODY rows, at least one, at most the image
+static size_t band_rows_of(const BMHD* bmhd) {
+    size_t line_size = ilbm_row_bytes(bmhd->width) * ilbm_body_planes(bmhd);
+    size_t band_rows = line_size ? BAND_BYTES / line_size : 1;
+    if (band_rows < 1) band_rows = 1;
+    if (band_rows > bmhd->height && bmhd->height > 0) band_rows = bmhd->height;
+    return band_rows;
+}
+
+// Window for a streamed BODY: a band of PackBits rows takes at most 2 bytes per output byte
+static size_t stream_window_size(const BMHD* bmhd) {
+    size_t bytes = band_rows_of(bmhd) * ilbm_row_bytes(bmhd->width) * ilbm_body_planes(bmhd) * 2;
+    return bytes > BAND_BYTES ? bytes : BAND_BYTES;
+}
+
+// Part of the image converted with -rect and -tiles: the region, and the tiles it is cut into (one tile
+// of the size of the region without -tiles). Columns and rows that do not fill a whole tile are left out.
+typedef struct {
+    size_t x, y, width, height;
+    size_t tiles_x, tiles_y;
+    BMHD tile; // geometry of one tile, uncompressed
+} Region;
+
+// Returns 0 if the region lies inside the image and holds at least one tile
+static int region_of(const BMHD* bmhd, const ConvertOptions* opts, Region* r) {
+    r->x = opts->rect_w ? (size_t)opts->rect_x : 0;
+    r->y = opts->rect_w ? (size_t)opts->rect_y : 0;
+    r->width = opts->rect_w ? (size_t)opts->rect_w : bmhd->width;
+    r->height = opts->rect_w ? (size_t)opts->rect_h : bmhd->height;
+    r->tile = *bmhd;
+    r->tile.width = (uint16_t)(opts->tile_w ? (size_t)opts->tile_w : r->width);
+    r->tile.height = (uint16_t)(opts->tile_w ? (size_t)opts->tile_h : r->height);
+    r->tile.compression = 0;
+    r->tiles_x = r->tile.width ? r->width / r->tile.width : 0;
+    r->tiles_y = r->tile.height ? r->height / r->tile.height : 0;
+    return r->x + r->width > bmhd->width || r->y + r->height > bmhd->height || !r->tiles_x || !r->tiles_y;
+}
+
+// Arena bytes of the band buffers of write_body_outputs()
+static size_t band_buffers_size(const BMHD* bmhd, const ConvertOptions* opts) {
+    size_t row_bytes = ilbm_row_bytes(bmhd->width);
+    size_t line_size = row_bytes * bmhd->numPlanes;
+    size_t band_rows = band_rows_of(bmhd);
+    size_t size = ARENA_SIZE(band_rows * row_bytes * ilbm_body_planes(bmhd) + 1);
+    if (opts->create_chunky || opts->create_chunky_doubled) {
+        size += ARENA_SIZE(band_rows * bmhd->width * ilbm_chunky_pixel_bytes(bmhd->numPlanes) + 1);
     }
+    if (opts->create_noninterleaved) size += ARENA_SIZE(band_rows * line_size + 1);
+    if (bmhd->masking == MSK_HAS_MASK && opts->write_mask) size += ARENA_SIZE(band_rows * row_bytes + 1);
+    if (opts->sprites) size += ARENA_SIZE(band_rows * 4 * sprite_count(bmhd->width, bmhd->numPlanes) + 1);
+    return size;
+}
 
-    const char* filename = input_filename;
-    FILE* f = fopen(filename, "rb");
-    if (!f) {
-        fprintf(stderr, "Failed to open file: %s\n", filename);
-        return 1;
+// Arena bytes taken by the buffers of write_body_outputs() (or write_region_outputs()) and write_palette()
+// for one image
+static size_t conversion_arena_size(const BMHD* bmhd, size_t cmap_size, int streamed, const ConvertOptions* opts) {
+    size_t size = band_buffers_size(bmhd, opts);
+    Region r;
+    if ((opts->rect_w || opts->tile_w) && region_of(bmhd, opts, &r) == 0) {
+        // A row of tiles, and the band buffers of writing one tile
+        size += ARENA_SIZE(r.tiles_x * ilbm_body_planar_size(&r.tile) + 1) + band_buffers_size(&r.tile, opts);
     }
+    if (streamed) size += ARENA_SIZE(stream_window_size(bmhd)) + ARENA_SIZE(cmap_size);
+    return size + ARENA_SIZE(palette_format_size(opts->palette_format, cmap_size / 3) + 1);
+}
 
-    // Get file size
-    fseek(f, 0, SEEK_END);
-    long filesize = ftell(f);
-    fseek(f, 0, SEEK_SET);
+// Fused output stage for the BODY. The image is processed in bands of rows: each band is decoded
+// (compression 1) or taken straight from the BODY data (compression 0), written to the .bpl file,
+// converted to chunky for the .chk file and scattered into the plane regions of the .bpf file while it
+// is still in cache. Peak memory is one band per output instead of a full image per output; with a
+// streamed BODY source the compressed data is also only held one band at a time. The mask scanlines of
+// an image with a mask plane are taken out of each band first (and written to the .msk file with -m); with
+// -spr every band is also cut into the rows of all its sprites at once and written to the .spr file.
+// With to_stdout the .bpl data is written to stdout instead of a file, with 'prod' all products are
+// collected in memory for a pack file. Returns the products written, as bits 1 << PACK_BPL etc.; a product
+// whose file could not be written is removed and left out.
+static unsigned write_body_outputs(ConvertLog* log, const BMHD* bmhd, BodySource* body, size_t body_size,
+                               const char* output_base, int to_stdout, ConvertProducts* prod,
+                               const ConvertOptions* opts, StageStats* st, Arena* arena) {
+    size_t row_bytes = ilbm_row_bytes(bmhd->width); // bytes per row per plane
+    size_t line_size = row_bytes * bmhd->numPlanes; // bytes per row, all planes
+    size_t body_line = row_bytes * ilbm_body_planes(bmhd); // bytes per BODY row, with the mask scanline
+    size_t plane_size = row_bytes * bmhd->height; // bytes per complete plane in the .bpf file
+    size_t image_size = line_size * bmhd->height;
+    size_t pixel_bytes = ilbm_chunky_pixel_bytes(bmhd->numPlanes);
+    size_t chunky_size = (size_t)bmhd->width * bmhd->height * pixel_bytes;
+    size_t band_rows = band_rows_of(bmhd);
+    int want_chunky = opts->create_chunky || opts->create_chunky_doubled;
+    int want_bpf = opts->create_noninterleaved;
+    // The mask plane is never part of the .bpl/.chk/.bpf products; with -m it goes to its own .msk file
+    int masked = bmhd->masking == MSK_HAS_MASK;
+    int want_mask = masked && opts->write_mask && !prod;
+    // -spr: one sprite (or attached pair) per 16 pixel strip, all strips filled in the same pass over the rows
+    int want_spr = opts->sprites && !prod;
+    size_t num_sprites = sprite_count(bmhd->width, bmhd->numPlanes);
+    size_t spr_size = sprite_size(bmhd->height);
 
-    printf("Input file: %s\n", filename);
-    printf("File size: %ld bytes\n", filesize);
+    char bpl_filename[512], chk_filename[512], bpf_filename[512], msk_filename[512], spr_filename[512];
+    snprintf(bpl_filename, sizeof(bpl_filename), "%s.bpl", output_base);
+    snprintf(chk_filename, sizeof(chk_filename), "%s.chk", output_base);
+    snprintf(bpf_filename, sizeof(bpf_filename), "%s.bpf", output_base);
+    snprintf(msk_filename, sizeof(msk_filename), "%s.msk", output_base);
+    snprintf(spr_filename, sizeof(spr_filename), "%s.spr", output_base);
 
-    // Determine the base filename for output files
-    char base_filename[512];
-    if (output_name) {
-        // Use the specified output name
-        strncpy(base_filename, output_name, sizeof(base_filename) - 1);
-        base_filename[sizeof(base_filename) - 1] = '\0';
+    // The band buffers (and the window of a streamed BODY, which the caller keeps) come from the arena
+    ArenaMark mark = arena_mark(arena);
+    if (body->stream && !body->window) {
+        body->cap = stream_window_size(bmhd);
+        body->window = (uint8_t*)arena_alloc(arena, body->cap);
+        body->window_fixed = 1;
+        body->data = body->window;
+        if (!body->window) body->cap = 0;
+        mark = arena_mark(arena);
+    }
+    uint8_t* band = (uint8_t*)arena_alloc(arena, band_rows * body_line + 1);
+    uint8_t* chunky_band = want_chunky ? (uint8_t*)arena_alloc(arena, band_rows * bmhd->width * pixel_bytes + 1) : NULL;
+    uint8_t* planes_band = want_bpf ? (uint8_t*)arena_alloc(arena, band_rows * line_size + 1) : NULL;
+    uint8_t* mask_band = want_mask ? (uint8_t*)arena_alloc(arena, band_rows * row_bytes + 1) : NULL;
+    uint8_t* sprite_band = want_spr ? (uint8_t*)arena_alloc(arena, band_rows * 4 * num_sprites + 1) : NULL;
+    if (!band || (want_chunky && !chunky_band) || (want_bpf && !planes_band) || (want_mask && !mask_band) ||
+        (want_spr && !sprite_band) || (body->stream && !body->window)) {
+        log_error(log, "Failed to allocate memory for output buffers\n");
+        arena_rewind(arena, mark);
+        return 0;
+    }
+
+    Output files[5];
+    memset(files, 0, sizeof(files));
+    Output *bpl, *chk = NULL, *bpf = NULL, *msk = NULL, *spr = NULL;
+    if (prod) {
+        // Pack entry: the sizes are known, except for an uncompressed BODY with trailing bytes
+        snprintf(bpl_filename, sizeof(bpl_filename), "pack entry %s", prod->entry.name);
+        snprintf(chk_filename, sizeof(chk_filename), "pack entry %s", prod->entry.name);
+        snprintf(bpf_filename, sizeof(bpf_filename), "pack entry %s", prod->entry.name);
+        bpl = &prod->out[PACK_BPL];
+        out_reserve(bpl, bmhd->compression == 0 && !masked ? body_size : image_size);
+        if (want_chunky) {
+            chk = &prod->out[PACK_CHK];
+            out_reserve(chk, chunky_size);
+        }
+        if (want_bpf) {
+            bpf = &prod->out[PACK_BPF];
+            out_reserve(bpf, image_size);
+        }
     } else {
-        // Strip extension from input filename if present
-        strncpy(base_filename, filename, sizeof(base_filename) - 1);
-        base_filename[sizeof(base_filename) - 1] = '\0';
-        char* dot = strrchr(base_filename, '.');
-        if (dot && dot != base_filename) {
-            *dot = '\0';
+        // With "-o -" the bitplane data goes to stdout
+        if (to_stdout) snprintf(bpl_filename, sizeof(bpl_filename), "<stdout>");
+        files[0].f = to_stdout ? stdout : open_output(log, bpl_filename);
+        files[1].f = want_chunky ? open_output(log, chk_filename) : NULL;
+        files[2].f = want_bpf ? open_output(log, bpf_filename) : NULL;
+        files[3].f = want_mask ? open_output(log, msk_filename) : NULL;
+        files[4].f = want_spr ? open_output(log, spr_filename) : NULL;
+        bpl = files[0].f ? &files[0] : NULL;
+        chk = files[1].f ? &files[1] : NULL;
+        bpf = files[2].f ? &files[2] : NULL;
+        msk = files[3].f ? &files[3] : NULL;
+        spr = files[4].f ? &files[4] : NULL;
+    }
+    if (spr) {
+        // The control words and end words of every sprite, its rows are filled in band by band
+        static const uint8_t end_words[4] = {0};
+        for (size_t s = 0; s < num_sprites; s++) {
+            uint8_t control[4];
+            int attached = bmhd->numPlanes > 2 && (s & 1);
+            size_t strip = bmhd->numPlanes > 2 ? s / 2 : s;
+            sprite_store_control((uint16_t)(opts->sprite_x + strip * SPRITE_WIDTH), (uint16_t)opts->sprite_y,
+                                 bmhd->height, attached, control);
+            out_seek(spr, s * spr_size);
+            out_write(spr, control, sizeof(control));
+            out_seek(spr, s * spr_size + spr_size - 4);
+            out_write(spr, end_words, sizeof(end_words));
         }
     }
-    const char* output_base = base_filename;
 
-    char chunk_id[5] = {0};
-    uint32_t chunk_size;
-    int found_bmhd = 0, found_cmap = 0, found_body = 0;
-    BMHD bmhd;
-    uint8_t* cmap_data = NULL;
-    uint32_t cmap_size = 0;
-    uint8_t* body_data = NULL;
-    uint32_t body_size = 0;
+    for (size_t y0 = 0; y0 < bmhd->height; y0 += band_rows) {
+        size_t rows = bmhd->height - y0 < band_rows ? bmhd->height - y0 : band_rows;
+        size_t bytes = rows * body_line;
+        size_t written; // bytes of the band for the .bpl file
+        const uint8_t* src;
+        double t0;
+        if (bmhd->compression == 1 && body->decoded) {
+            src = body->data + body->pos;
+            body->pos += bytes;
+            written = bytes;
+        } else if (bmhd->compression == 1) {
+            // A PackBits scanline without NOPs never takes more than 2 bytes per output byte
+            size_t avail = body_fill_timed(body, bytes * 2, st);
+            size_t short_rows = 0;
+            t0 = time_seconds();
+            body->pos += decompress_body(body->data + body->pos, avail, band, row_bytes, rows * ilbm_body_planes(bmhd),
+                                         &short_rows);
+            stats_add(st, STAGE_DECODE, t0, bytes);
+            if (short_rows) {
+                log_error(log, "Warning: %zu scanlines of rows %zu-%zu decompressed short (expected %zu bytes), zero padded\n",
+                          short_rows, y0, y0 + rows - 1, row_bytes);
+            }
+            src = band;
+            written = bytes;
+        } else {
+            // Uncompressed BODY is used in place, only a short last band is padded with zeros
+            size_t avail = body_fill_timed(body, bytes, st);
+            if (avail >= bytes) {
+                src = body->data + body->pos;
+            } else {
+                if (avail) memcpy(band, body->data + body->pos, avail);
+                memset(band + avail, 0, bytes - avail);
+                src = band;
+            }
+            written = avail < bytes ? avail : bytes;
+            body->pos += written;
+        }
+        if (masked) {
+            // The planes are packed into 'band' without the mask scanlines, which go to the .msk file
+            t0 = time_seconds();
+            ilbm_split_mask(src, rows, bmhd->width, bmhd->numPlanes, band, mask_band);
+            stats_add(st, STAGE_DEINTERLEAVE, t0, bytes);
+            src = band;
+            bytes = rows * line_size;
+            written = bytes;
+            if (msk) {
+                t0 = time_seconds();
+                out_write(msk, mask_band, rows * row_bytes);
+                stats_add(st, STAGE_WRITE_MSK, t0, rows * row_bytes);
+            }
+        }
+        t0 = time_seconds();
+        if (bpl) out_write(bpl, src, written);
+        stats_add(st, STAGE_WRITE_BPL, t0, bpl ? written : 0);
+        if (chk) {
+            t0 = time_seconds();
+            int c2p_result = convert_to_chunky(src, bytes, chunky_band, bmhd->width, (uint16_t)rows, bmhd->numPlanes,
+                                               opts->create_chunky_doubled);
+            stats_add(st, STAGE_C2P, t0, bytes);
+            if (c2p_result != IFFBPL_OK) {
+                // The chunky product is dropped (a pack entry fails), the others are still written
+                log_error(log, "Failed to allocate memory for the chunky conversion, %s not written\n", chk_filename);
+                if (chk->f) {
+                    fclose(chk->f);
+                    remove(chk_filename);
+                }
+                chk->failed = 1;
+                chk = NULL;
+            } else {
+                t0 = time_seconds();
+                out_write(chk, chunky_band, rows * bmhd->width * pixel_bytes);
+                stats_add(st, STAGE_WRITE_CHK, t0, rows * bmhd->width * pixel_bytes);
+            }
+        }
+        if (bpf) {
+            // Rows y0.. of each plane are contiguous in the .bpf file
+            t0 = time_seconds();
+            convert_to_noninterleaved(src, planes_band, bmhd->width, (uint16_t)rows, bmhd->numPlanes);
+            stats_add(st, STAGE_DEINTERLEAVE, t0, bytes);
+            t0 = time_seconds();
+            for (uint8_t p = 0; p < bmhd->numPlanes; p++) {
+                out_seek(bpf, p * plane_size + y0 * row_bytes);
+                out_write(bpf, planes_band + p * rows * row_bytes, rows * row_bytes);
+            }
+            stats_add(st, STAGE_WRITE_BPF, t0, bytes);
+        }
+        if (spr) {
+            // Rows y0.. of each sprite follow its control words
+            t0 = time_seconds();
+            convert_to_sprites(src, bmhd->width, rows, bmhd->numPlanes, sprite_band);
+            stats_add(st, STAGE_SPRITE, t0, bytes);
+            t0 = time_seconds();
+            for (size_t s = 0; s < num_sprites; s++) {
+                out_seek(spr, s * spr_size + 4 + y0 * 4);
+                out_write(spr, sprite_band + s * rows * 4, rows * 4);
+            }
+            stats_add(st, STAGE_WRITE_SPR, t0, rows * 4 * num_sprites);
+        }
+    }
+    // Uncompressed BODY is written as is, including any bytes beyond the image (not when a mask is taken out)
+    if (bmhd->compression == 0 && !masked && bpl) {
+        size_t avail;
+        while ((avail = body_fill_timed(body, BAND_BYTES, st)) > 0) {
+            double t0 = time_seconds();
+            out_write(bpl, body->data + body->pos, avail);
+            stats_add(st, STAGE_WRITE_BPL, t0, avail);
+            body->pos += avail;
+        }
+    }
 
-    // Skip FORM header - assumes it's always present and in the same position at the start of the file
-    fread(chunk_id, 1, 4, f); // "FORM"
-    uint32_t form_size = read_be32(f); // FORM size (big-endian)
-    fread(chunk_id, 1, 4, f); // "ILBM"
-
-    while (ftell(f) < filesize) {
-        if (fread(chunk_id, 1, 4, f) != 4) break;
-        uint32_t chunk_size = read_be32(f); // chunk size (big-endian)
-        uint32_t size = ((chunk_size + 1) & ~1); // even size
-        //printf("Chunk ID: %.4s, Size: %u bytes\n", chunk_id, size);
-
-        if (strncmp(chunk_id, "BMHD", 4) == 0) {
-            // Read BMHD fields as big-endian
-            bmhd.width = read_be16(f);
-            bmhd.height = read_be16(f);
-            bmhd.x = read_be16(f);
-            bmhd.y = read_be16(f);
-            fread(&bmhd.numPlanes, 1, 1, f);
-            fread(&bmhd.masking, 1, 1, f);
-            fread(&bmhd.compression, 1, 1, f);
-            fread(&bmhd.pad1, 1, 1, f);
-            bmhd.transparentColor = read_be16(f);
-            fread(&bmhd.xAspect, 1, 1, f);
-            fread(&bmhd.yAspect, 1, 1, f);
-            bmhd.pageWidth = read_be16(f);
-            bmhd.pageHeight = read_be16(f);
-            found_bmhd = 1;
-            fseek(f, size - sizeof(BMHD), SEEK_CUR);
-        } else if (strncmp(chunk_id, "CMAP", 4) == 0) {
-            cmap_data = (uint8_t*)malloc(size);
-            cmap_size = size;
-            fread(cmap_data, 1, size, f);
-            found_cmap = 1;
-        } else if (strncmp(chunk_id, "BODY", 4) == 0) {
-            body_data = (uint8_t*)malloc(size);
-            body_size = size;
-            fread(body_data, 1, size, f);
-            found_body = 1;
+    // A product whose file could not be written completely is dropped, the others are kept
+    if (bpl) {
+        double t0 = time_seconds();
+        int failed = close_output(log, bpl, bpl_filename, to_stdout);
+        stats_add(st, STAGE_WRITE_BPL, t0, 0);
+        if (failed) {
+            bpl = NULL;
+        } else if (bmhd->compression == 0 && !masked) {
+            log_info(log, "BODY (uncompressed), size %zu bytes, written to: %s\n", body_size, bpl_filename);
+        } else {
+            log_info(log, "BODY (decompressed), size %zu bytes, written to: %s\n", image_size, bpl_filename);
+        }
+    }
+    if (chk) {
+        double t0 = time_seconds();
+        int failed = close_output(log, chk, chk_filename, 0);
+        stats_add(st, STAGE_WRITE_CHK, t0, 0);
+        if (failed) {
+            chk = NULL;
+        } else if (opts->create_chunky_doubled) {
+            log_info(log, "Chunky format (doubled bits) written to: %s (%zu bytes)\n", chk_filename, chunky_size);
+        } else if (pixel_bytes > 1) {
+            log_info(log, "Chunky format (%zu bytes per pixel%s) written to: %s (%zu bytes)\n", pixel_bytes,
+                     bmhd->numPlanes == 24 ? ", RGB" : bmhd->numPlanes == 32 ? ", RGBA" : "", chk_filename, chunky_size);
+        } else {
+            log_info(log, "Chunky format written to: %s (%zu bytes)\n", chk_filename, chunky_size);
+        }
+    }
+    if (bpf) {
+        double t0 = time_seconds();
+        int failed = close_output(log, bpf, bpf_filename, 0);
+        stats_add(st, STAGE_WRITE_BPF, t0, 0);
+        if (failed) {
+            bpf = NULL;
+        } else {
+            log_info(log, "Non-interleaved planar format written to: %s (%zu bytes)\n", bpf_filename, image_size);
+        }
+    }
+    if (msk) {
+        double t0 = time_seconds();
+        int failed = close_output(log, msk, msk_filename, 0);
+        stats_add(st, STAGE_WRITE_MSK, t0, 0);
+        if (failed) {
+            msk = NULL;
+        } else {
+            log_info(log, "Mask plane written to: %s (%zu bytes)\n", msk_filename, plane_size);
+        }
+    }
+    if (spr) {
+        double t0 = time_seconds();
+        int failed = close_output(log, spr, spr_filename, 0);
+        stats_add(st, STAGE_WRITE_SPR, t0, 0);
+        if (failed) {
+            spr = NULL;
         } else {
-            fseek(f, size, SEEK_CUR);
+            log_info(log, "%zu %ssprites written to: %s (%zu bytes)\n", num_sprites,
+                     bmhd->numPlanes > 2 ? "attached " : "", spr_filename, num_sprites * spr_size);
         }
     }
+    arena_rewind(arena, mark);
+    return (bpl ? 1u << PACK_BPL : 0) | (chk ? 1u << PACK_CHK : 0) | (bpf ? 1u << PACK_BPF : 0) |
+           (msk ? 1u << PRODUCT_MSK : 0) | (spr ? 1u << PRODUCT_SPR : 0);
+}
 
-    if (found_bmhd) {
-        printf("+BMHD:\n");
-        printf("  width: %u (%u bytes)\n", bmhd.width, (bmhd.width/8));
-        printf("  height: %u\n", bmhd.height);
-        printf("  numPlanes: %u\n", bmhd.numPlanes);
-        printf("  compression: %u\n", bmhd.compression);
-    } else {
-        printf("BMHD chunk not found.\n");
+// Output stage of -rect and -tiles. Only the rows of the region are taken from the BODY: uncompressed rows
+// above it are skipped without being read (seeked over when streamed), compressed ones as well if the BODY
+// has a BIDX row index, otherwise by reading their PackBits packet headers only, and nothing below the last
+// row of tiles is decoded. Each band of rows is
+// cropped to the columns of every tile into one row of tiles, whose tiles are then written by
+// write_body_outputs(), so all tiles come from a single pass over the BODY. With -tiles tile n (left to
+// right, top to bottom) goes to <output_base>_<nnnn>.bpl (and .chk/.bpf), or all tiles back to back to
+// stdout; a -rect region alone goes to <output_base>.bpl. The region must be valid (region_of()).
+// *num_tiles receives the number of tiles written. Returns the products written for every tile, as
+// write_body_outputs().
+static unsigned write_region_outputs(ConvertLog* log, const BMHD* bmhd, BodySource* body, const char* output_base,
+                                     int to_stdout, ConvertProducts* prod, const ConvertOptions* opts,
+                                     StageStats* st, Arena* arena, int* num_tiles) {
+    size_t row_bytes = ilbm_row_bytes(bmhd->width);
+    size_t planes = ilbm_body_planes(bmhd); // BODY scanlines per row, the tiles keep the mask scanline
+    size_t line_size = row_bytes * planes;
+    size_t band_rows = band_rows_of(bmhd);
+    Region r;
+    *num_tiles = 0;
+    if (region_of(bmhd, opts, &r) != 0) return 0; // checked by the caller
+    if (r.width % r.tile.width || r.height % r.tile.height) {
+        log_info(log, "Tiles: %zu columns at the right and %zu rows at the bottom do not fill a tile, left out\n",
+                 r.width % r.tile.width, r.height % r.tile.height);
     }
+    size_t tile_row_bytes = ilbm_row_bytes(r.tile.width);
+    size_t tile_size = ilbm_body_planar_size(&r.tile);
 
-    if (found_cmap) {
-        char pal_filename[512];
-        // Each palette entry is 3 bytes (R, G, B)
-        size_t num_entries = cmap_size / 3;
-        uint16_t* pal_words = (uint16_t*)malloc(num_entries * sizeof(uint16_t));
-        if (!pal_words) {
-            fprintf(stderr, "Failed to allocate memory for palette words\n");
-        } else {
-            for (size_t i = 0; i < num_entries; ++i) {
-                // rescale the colours from 8 bits to 4 bits
-                uint8_t r = (cmap_data[i * 3 + 0]*16/256);
-                uint8_t g = (cmap_data[i * 3 + 1]*16/256);
-                uint8_t b = (cmap_data[i * 3 + 2]*16/256);
-                // Take lower 4 bits of each and place as described
-                uint16_t word = 0;
-                word |= ((r & 0x0F) << 8); // bits 12-9
-                word |= ((g & 0x0F) << 4); // bits 8-5
-                word |= ((b & 0x0F)); // bits 4-1
-                word = (word >> 8) | (word << 8);
-                pal_words[i] = word;
-            }
-            printf("+CMAP Pallette (%u colours):\n", num_entries);
-            print_hex((uint8_t*)pal_words, num_entries * sizeof(uint16_t));
+    ArenaMark mark = arena_mark(arena);
+    if (body->stream && !body->window) {
+        body->cap = stream_window_size(bmhd);
+        body->window = (uint8_t*)arena_alloc(arena, body->cap);
+        body->window_fixed = 1;
+        body->data = body->window;
+        if (!body->window) body->cap = 0;
+        mark = arena_mark(arena);
+    }
+    uint8_t* band = (uint8_t*)arena_alloc(arena, band_rows * line_size + 1);
+    uint8_t* tiles = (uint8_t*)arena_alloc(arena, r.tiles_x * tile_size + 1);
+    if (!band || !tiles || (body->stream && !body->window)) {
+        log_error(log, "Failed to allocate memory for output buffers\n");
+        arena_rewind(arena, mark);
+        return 0;
+    }
 
-            snprintf(pal_filename, sizeof(pal_filename), "%s.pal", output_base);
-            write_bin(pal_filename, (uint8_t*)pal_words, num_entries * sizeof(uint16_t));
-            printf("Pallette written to: %s\n", pal_filename);
-            free(pal_words);
+    // Rows above the region
+    size_t y = 0; // next BODY row
+    double t0;
+    if (bmhd->compression == 1 && body->index) {
+        // The BIDX row index gives the offset of the first row directly
+        size_t target = body_index_offset(body->index, r.y * planes);
+        size_t at = body_offset(body);
+        if (target > at) body_skip(body, target - at);
+        y = r.y;
+    } else if (bmhd->compression == 1) {
+        while (y < r.y) {
+            size_t rows = r.y - y < band_rows ? r.y - y : band_rows;
+            size_t avail = body_fill_timed(body, rows * line_size * 2, st);
+            t0 = time_seconds();
+            body->pos += skip_packbits_rows(body->data + body->pos, avail, row_bytes, rows * planes);
+            stats_add(st, STAGE_DECODE, t0, 0);
+            y += rows;
         }
-        free(cmap_data);
     } else {
-        printf("CMAP chunk not found.\n");
+        body_skip(body, r.y * line_size);
+        y = r.y;
     }
 
-    if (found_body) {
-        printf("+BODY (%u bytes):\n", body_size);
-        char bpl_filename[512];
-        snprintf(bpl_filename, sizeof(bpl_filename), "%s.bpl", output_base);
-
-        uint8_t* final_planar_data = NULL;
-        size_t final_planar_size = 0;
-
-        if (bmhd.compression == 0) {
-            // No compression, write as is
-            write_bin(bpl_filename, body_data, body_size);
-            printf("BODY (uncompressed), size %u bytes, written to: %s\n", body_size, bpl_filename);
-            final_planar_data = body_data;
-            final_planar_size = body_size;
-        } else if (bmhd.compression == 1) {
-            // RLE compression
-            size_t row_bytes = ((bmhd.width + 15) / 16) * 2; // bytes per row per plane
-            size_t total_rows = bmhd.height * bmhd.numPlanes;
-            size_t out_size = row_bytes * bmhd.height * bmhd.numPlanes;
-            uint8_t* out = (uint8_t*)malloc(out_size);
-            if (!out) {
-                fprintf(stderr, "Failed to allocate memory for decompressed BODY\n");
-            } else {
-                size_t src_offset = 0, dst_offset = 0;
-                for (size_t row = 0; row < total_rows; ++row) {
-                    size_t written = decompress_packbits(
-                        body_data + src_offset,
-                        body_size - src_offset,
-                        out + dst_offset,
-                        row_bytes
-                    );
-                    if (written != row_bytes) {
-                        fprintf(stderr, "Warning: decompressed row %zu has %zu bytes, expected %zu\n", row, written, row_bytes);
-                    }
-                    // Find out how many bytes were consumed from src
-                    // We have to scan the packbits stream for this row
-                    size_t consumed = 0, produced = 0;
-                    while (produced < row_bytes && (src_offset + consumed) < body_size) {
-                        int8_t n = (int8_t)body_data[src_offset + consumed++];
-                        if (n >= 0) {
-                            int count = n + 1;
-                            consumed += count;
-                            produced += count;
-                        } else if (n != -128) {
-                            int count = (-n) + 1;
-                            consumed += 1;
-                            produced += count;
-                        }
-                        // else n == -128: NOP
-                    }
-                    src_offset += consumed;
-                    dst_offset += row_bytes;
-                }
-                write_bin(bpl_filename, out, out_size);
-                if (dst_offset != out_size) {
-                    fprintf(stderr, "Warning: expected %zu bytes in output, got %zu\n", out_size, dst_offset);
-                }
-                if (out_size != (bmhd.height * row_bytes * bmhd.numPlanes)) {
-                    fprintf(stderr, "Warning: output size does not match expected size (%zu != %zu)\n", out_size, bmhd.height * row_bytes * bmhd.numPlanes);
+    unsigned produced = ~0u;
+    for (size_t ty = 0; ty < r.tiles_y; ty++) {
+        // Take the rows of one row of tiles band by band, cropping every band into all its tiles
+        size_t tiles_y0 = y;
+        while (y < tiles_y0 + r.tile.height) {
+            size_t rows = tiles_y0 + r.tile.height - y < band_rows ? tiles_y0 + r.tile.height - y : band_rows;
+            size_t bytes = rows * line_size;
+            const uint8_t* src;
+            if (bmhd->compression == 1) {
+                size_t avail = body_fill_timed(body, bytes * 2, st);
+                size_t short_rows = 0;
+                t0 = time_seconds();
+                body->pos += decompress_body(body->data + body->pos, avail, band, row_bytes, rows * planes, &short_rows);
+                stats_add(st, STAGE_DECODE, t0, bytes);
+                if (short_rows) {
+                    log_error(log, "Warning: %zu scanlines of rows %zu-%zu decompressed short (expected %zu bytes), zero padded\n",
+                              short_rows, y, y + rows - 1, row_bytes);
                 }
-                printf("BODY (decompressed), size %u bytes, written to: %s\n", out_size, bpl_filename);
-                final_planar_data = out;
-                final_planar_size = out_size;
-            }
-        } else {
-            printf("Unknown compression type: %u\n", bmhd.compression);
-        }
-
-        // Create chunky format if requested
-        if ((create_chunky || create_chunky_doubled) && final_planar_data && found_bmhd) {
-            char chk_filename[512];
-            snprintf(chk_filename, sizeof(chk_filename), "%s.chk", output_base);
-            
-            size_t chunky_size = bmhd.width * bmhd.height;
-            uint8_t* chunky_data = (uint8_t*)malloc(chunky_size);
-            if (!chunky_data) {
-                fprintf(stderr, "Failed to allocate memory for chunky data\n");
+                src = band;
             } else {
-                convert_to_chunky(final_planar_data, chunky_data, bmhd.width, bmhd.height, bmhd.numPlanes, create_chunky_doubled);
-                if (create_chunky_doubled) {
-                    printf("Chunky format (doubled bits) written to: %s (%zu bytes)\n", chk_filename, chunky_size);
+                size_t avail = body_fill_timed(body, bytes, st);
+                if (avail >= bytes) {
+                    src = body->data + body->pos;
                 } else {
-                    printf("Chunky format written to: %s (%zu bytes)\n", chk_filename, chunky_size);
+                    if (avail) memcpy(band, body->data + body->pos, avail);
+                    memset(band + avail, 0, bytes - avail);
+                    src = band;
                 }
-                write_bin(chk_filename, chunky_data, chunky_size);
-                free(chunky_data);
+                body->pos += avail < bytes ? avail : bytes;
             }
+            t0 = time_seconds();
+            size_t scanline = (y - tiles_y0) * planes; // first scanline of the band in each tile
+            for (size_t tx = 0; tx < r.tiles_x; tx++) {
+                crop_planar(src, row_bytes, rows * planes, r.x + tx * r.tile.width, r.tile.width,
+                            tiles + tx * tile_size + scanline * tile_row_bytes);
+            }
+            stats_add(st, STAGE_DECODE, t0, 0);
+            y += rows;
+        }
+        for (size_t tx = 0; tx < r.tiles_x; tx++) {
+            char tile_base[540];
+            if (opts->tile_w) snprintf(tile_base, sizeof(tile_base), "%s_%04d", output_base, *num_tiles);
+            else snprintf(tile_base, sizeof(tile_base), "%s", output_base);
+            BodySource tile;
+            memset(&tile, 0, sizeof(tile));
+            tile.data = tiles + tx * tile_size;
+            tile.len = tile_size;
+            produced &= write_body_outputs(log, &r.tile, &tile, tile_size, tile_base, to_stdout, prod, opts, st, arena);
+            (*num_tiles)++;
         }
+    }
+    arena_rewind(arena, mark);
+    return *num_tiles ? produced : 0;
+}
+
+static void log_bmhd(ConvertLog* log, const BMHD* bmhd) {
+    log_info(log, "+BMHD:\n");
+    log_info(log, "  width: %u (%u bytes)\n", bmhd->width, (bmhd->width/8));
+    log_info(log, "  height: %u\n", bmhd->height);
+    log_info(log, "  numPlanes: %u\n", bmhd->numPlanes);
+    log_info(log, "  masking: %u%s\n", bmhd->masking, bmhd->masking == MSK_HAS_MASK ? " (mask plane)" : "");
+    log_info(log, "  compression: %u\n", bmhd->compression);
+}
+
+// Write the CMAP in the -pf palette format to <output_base>.pal, or into the pack entry with 'prod'.
+// Returns the products written (1 << PACK_PAL or 0).
+static unsigned write_palette(ConvertLog* log, const uint8_t* cmap_data, uint32_t cmap_size, const char* output_base,
+                              ConvertProducts* prod, const ConvertOptions* opts, StageStats* st, Arena* arena) {
+    char pal_filename[512];
+    unsigned produced = 0;
+    // Each palette entry is 3 bytes (R, G, B)
+    size_t num_entries = cmap_size / 3;
+    size_t pal_size = palette_format_size(opts->palette_format, num_entries);
+    ArenaMark mark = arena_mark(arena);
+    uint8_t* pal_words = (uint8_t*)arena_alloc(arena, pal_size + 1);
+    if (!pal_words) {
+        log_error(log, "Failed to allocate memory for palette words\n");
+        return 0;
+    }
+    // rescale the colours from 8 bits to 4 bits, big-endian 0RGB words (or 8 bits per gun for AGA)
+    cmap_to_palette_set(cmap_data, 1, num_entries, opts->palette_format, pal_words);
+    log_at(log, opts->hex_dump ? LOG_NORMAL : LOG_VERBOSE, "+CMAP Pallette (%zu colours)%s\n", num_entries,
+           opts->hex_dump ? ":" : "");
+    if (opts->hex_dump) print_hex(log, pal_words, pal_size);
+
+    double t0 = time_seconds();
+    if (prod) {
+        snprintf(pal_filename, sizeof(pal_filename), "pack entry %s", prod->entry.name);
+        out_write(&prod->out[PACK_PAL], pal_words, pal_size);
+        prod->entry.num_colours = (uint16_t)num_entries;
+        produced = 1u << PACK_PAL;
+    } else {
+        snprintf(pal_filename, sizeof(pal_filename), "%s.pal", output_base);
+        if (write_bin(log, pal_filename, pal_words, pal_size) == 0) produced = 1u << PACK_PAL;
+    }
+    stats_add(st, STAGE_WRITE_PAL, t0, pal_size);
+    log_info(log, "Pallette written to: %s\n", pal_filename);
+    arena_rewind(arena, mark);
+    return produced;
+}
+
+// Products the options ask for from an image, as bits 1 << PACK_BPL etc.: the .pal file only with a CMAP
+// (and not with the bitplanes going to stdout), the .msk and .spr files not for a pack entry
+static unsigned wanted_products(const BMHD* bmhd, int has_cmap, int to_stdout, int in_pack,
+                                const ConvertOptions* opts) {
+    unsigned wanted = 1u << PACK_BPL;
+    if (has_cmap && !to_stdout) wanted |= 1u << PACK_PAL;
+    if (opts->create_chunky || opts->create_chunky_doubled) wanted |= 1u << PACK_CHK;
+    if (opts->create_noninterleaved) wanted |= 1u << PACK_BPF;
+    if (bmhd->masking == MSK_HAS_MASK && opts->write_mask && !in_pack) wanted |= 1u << PRODUCT_MSK;
+    if (opts->sprites && !in_pack) wanted |= 1u << PRODUCT_SPR;
+    return wanted;
+}
+
+// One ANIM frame handed to the writer thread
+typedef struct {
+    ConvertLog* log;
+    BMHD bmhd; // of the decoded frame (uncompressed)
+    const uint8_t* planes;
+    size_t size;
+    char output_base[540];
+    int to_stdout;
+    const ConvertOptions* opts;
+    StageStats st; // merged into the stats of the conversion once the thread is joined
+    Arena* arena; // of the conversion, which does not allocate while a frame is being written
+    unsigned produced; // products written, as write_body_outputs()
+} FrameWriter;
+
+static THREAD_FUNC frame_writer(void* arg) {
+    FrameWriter* fw = (FrameWriter*)arg;
+    BodySource body;
+    memset(&body, 0, sizeof(body));
+    body.data = fw->planes;
+    body.len = fw->size;
+    fw->produced = write_body_outputs(fw->log, &fw->bmhd, &body, fw->size, fw->output_base, fw->to_stdout, NULL,
+                                      fw->opts, &fw->st, fw->arena);
+    return 0;
+}
+
+// Convert a FORM ANIM held in memory. The first frame is decoded from its BODY; every later frame is made by
+// applying its DLTA in place to the frame one or two before it (ANHD interleave), kept in two buffers, so
+// no frame is decoded from scratch. Frame n is written to <output_base>_<nnnn>.bpl (and .chk/.bpf), or all
+// frames back to back to stdout, by a second thread while the delta of frame n + 1 is applied. Only the
+// palette of the first frame is written, to <output_base>.pal. Returns 0 if every frame was written with all
+// its products, 1 otherwise.
+static int convert_anim(ConvertLog* log, const char* filename, const InputFile* in, const char* output_base,
+                         int to_stdout, const ConvertOptions* opts, StageStats* st, Arena* arena) {
+    AnimIter it;
+    AnimFrame frame;
+    double t0 = time_seconds();
+    anim_begin(in->data, in->size, &it);
+    int found = anim_next(&it, &frame);
+    stats_add(st, STAGE_PARSE, t0, in->size);
+    log_info(log, "File size: %zu bytes (ANIM)\n", in->size);
+    if (!found || !frame.ilbm.found_bmhd || !frame.ilbm.body) {
+        log_error(log, "First ANIM frame has no BMHD and BODY\n");
+        return 1;
+    }
+    BMHD bmhd = frame.ilbm.bmhd;
+    int frame0_cmap = frame.ilbm.cmap != NULL;
+    log_bmhd(log, &bmhd);
+    if (bmhd.masking == MSK_HAS_MASK || bmhd.numPlanes > 8) {
+        // The DLTA operations change up to 8 planes and know no mask scanlines
+        log_error(log, "ANIM frames with a mask plane or more than 8 planes are not supported: %s\n", filename);
+        return 1;
+    }
+    st->width = bmhd.width;
+    st->height = bmhd.height;
+    st->planes = bmhd.numPlanes;
+    st->compression = bmhd.compression;
+    size_t size = ilbm_planar_size(&bmhd);
+    arena_reserve(arena, ARENA_SIZE(size * 2 + 1) + conversion_arena_size(&bmhd, frame.ilbm.cmap_size, 0, opts));
+    // The palette is a product of the first frame only
+    unsigned frame_wanted = wanted_products(&bmhd, 0, to_stdout, 0, opts);
+    int failed = 0;
+    if (frame.ilbm.cmap && to_stdout) {
+        log_info(log, "CMAP found, .pal not written (bitplane data goes to stdout)\n");
+    } else if (frame.ilbm.cmap) {
+        failed |= !write_palette(log, frame.ilbm.cmap, (uint32_t)frame.ilbm.cmap_size, output_base, NULL, opts, st,
+                                 arena);
+    }
+
+    uint8_t* bufs[2];
+    bufs[0] = (uint8_t*)arena_alloc(arena, size * 2 + 1);
+    if (!bufs[0]) {
+        log_error(log, "Failed to allocate memory for the ANIM frame buffers\n");
+        return 1;
+    }
+    bufs[1] = bufs[0] + size;
+    size_t short_rows = 0;
+    t0 = time_seconds();
+    int rc = ilbm_decode_body(&frame.ilbm, bufs[0], &short_rows);
+    stats_add(st, STAGE_DECODE, t0, size);
+    if (rc != IFFBPL_OK) {
+        log_error(log, "Unknown compression type: %u\n", bmhd.compression);
+        return 1;
+    }
+    if (short_rows) log_error(log, "Warning: %zu scanlines of the first frame decompressed short, zero padded\n", short_rows);
+    // With double buffering the first delta is applied to a copy of the first frame
+    memcpy(bufs[1], bufs[0], size);
 
-        // Create non-interleaved planar format if requested
-        if (create_noninterleaved && final_planar_data && found_bmhd) {
-            char bpf_filename[512];
-            snprintf(bpf_filename, sizeof(bpf_filename), "%s.bpf", output_base);
-            
-            size_t noninterleaved_size = final_planar_size;
-            uint8_t* noninterleaved_data = (uint8_t*)malloc(noninterleaved_size);
-            if (!noninterleaved_data) {
-                fprintf(stderr, "Failed to allocate memory for non-interleaved data\n");
+    FrameWriter writers[2];
+    int num_frames = 0;
+    int palette_warned = 0;
+    int incomplete_frames = 0; // frames with a product missing
+    for (;;) {
+        // Start writing frame num_frames from its buffer
+        FrameWriter* fw = &writers[num_frames & 1];
+        memset(fw, 0, sizeof(*fw));
+        fw->log = log;
+        fw->bmhd = bmhd;
+        fw->bmhd.compression = 0;
+        fw->planes = bufs[num_frames & 1];
+        fw->size = size;
+        snprintf(fw->output_base, sizeof(fw->output_base), "%s_%04d", output_base, num_frames);
+        fw->to_stdout = to_stdout;
+        fw->opts = opts;
+        fw->arena = arena;
+        stats_init(&fw->st, stage_names, NUM_STAGES);
+        thread_t writer;
+        int threaded = thread_start(&writer, frame_writer, fw) == 0;
+        if (!threaded) frame_writer(fw);
+
+        // Meanwhile build the next frame in the other buffer, which holds the frame before the one being
+        // written. Messages wait until the writer is done, so the log stays in frame order.
+        t0 = time_seconds();
+        found = anim_next(&it, &frame);
+        stats_add(st, STAGE_PARSE, t0, 0);
+        const uint8_t* prev = bufs[num_frames & 1];
+        uint8_t* dst = bufs[(num_frames + 1) & 1];
+        if (found) {
+            t0 = time_seconds();
+            if (frame.found_anhd && frame.dlta) {
+                if (frame.anhd.interleave == 1) memcpy(dst, prev, size);
+                rc = anim_apply_delta(&bmhd, &frame.anhd, frame.dlta, frame.dlta_size, dst);
+                if (rc == IFFBPL_ERR_COMPRESSION) memcpy(dst, prev, size);
+            } else if (frame.ilbm.body) {
+                // A complete image (operation 0), decoded with the geometry of the first frame
+                IlbmImage img = frame.ilbm;
+                uint8_t compression = img.found_bmhd ? img.bmhd.compression : bmhd.compression;
+                img.bmhd = bmhd;
+                img.bmhd.compression = compression;
+                img.found_bmhd = 1;
+                rc = ilbm_decode_body(&img, dst, NULL);
             } else {
-                convert_to_noninterleaved(final_planar_data, noninterleaved_data, bmhd.width, bmhd.height, bmhd.numPlanes);
-                write_bin(bpf_filename, noninterleaved_data, noninterleaved_size);
-                printf("Non-interleaved planar format written to: %s (%zu bytes)\n", bpf_filename, noninterleaved_size);
-                free(noninterleaved_data);
+                memcpy(dst, prev, size);
+                rc = IFFBPL_ERR_NO_BODY;
             }
+            stats_add(st, STAGE_DELTA, t0, frame.dlta_size);
         }
+        if (threaded) thread_join(writer);
+        stats_merge(st, &fw->st);
+        if ((fw->produced & frame_wanted) != frame_wanted) incomplete_frames++;
+        if (!found) break;
 
-        // Free decompressed data if it was allocated
-        if (bmhd.compression == 1 && final_planar_data && final_planar_data != body_data) {
-            free(final_planar_data);
+        num_frames++;
+        if (rc == IFFBPL_ERR_COMPRESSION && frame.found_anhd && frame.dlta) {
+            log_error(log, "Warning: frame %d uses unsupported ANIM operation %u, previous frame repeated\n",
+                      num_frames, frame.anhd.operation);
+        } else if (rc == IFFBPL_ERR_FORMAT) {
+            log_error(log, "Warning: frame %d has a truncated DLTA chunk, frame partly updated\n", num_frames);
+        } else if (rc == IFFBPL_ERR_NO_BODY) {
+            log_error(log, "Warning: frame %d has neither DLTA nor BODY, previous frame repeated\n", num_frames);
+        } else if (rc != IFFBPL_OK) {
+            log_error(log, "Warning: frame %d could not be decoded\n", num_frames);
+        }
+        if (frame.ilbm.cmap && !palette_warned) {
+            log_error(log, "Warning: frame %d changes the palette, only the palette of the first frame is written\n",
+                      num_frames);
+            palette_warned = 1;
         }
-        free(body_data);
+    }
+    log_info(log, "ANIM: %d frames written\n", num_frames + 1);
+    if (incomplete_frames) {
+        log_at(log, LOG_NORMAL, "%s: %d of %d frames not completely written\n", filename, incomplete_frames,
+               num_frames + 1);
+        failed = 1;
+    } else if (to_stdout) {
+        log_at(log, LOG_NORMAL, "%s -> <stdout> (%d frames, %ux%u, %u planes)\n", filename, num_frames + 1,
+               bmhd.width, bmhd.height, bmhd.numPlanes);
     } else {
-        printf("BODY chunk not found.\n");
+        log_at(log, LOG_NORMAL, "%s -> %s_0000.bpl .. %s_%04d.bpl%s%s%s (%d frames, %ux%u, %u planes)\n", filename,
+               output_base, output_base, num_frames, frame0_cmap ? ", " : "", frame0_cmap ? output_base : "",
+               frame0_cmap ? ".pal" : "", num_frames + 1, bmhd.width, bmhd.height, bmhd.numPlanes);
     }
+    return failed;
+}
 
-    fclose(f);
+// Palette set mode (-ps): the input is a raw table of 8-bit R, G, B palettes of opts->palette_set_colours
+// colours each, such as fade or colour cycling tables. All palettes are converted in one call and written
+// back to back to <output_base>.pal (or stdout). Returns 0 on success.
+static int convert_palette_set(ConvertLog* log, const char* filename, const InputFile* in, const char* output_base,
+                               int to_stdout, const ConvertOptions* opts, StageStats* st, Arena* arena) {
+    size_t colours = (size_t)opts->palette_set_colours;
+    size_t num_palettes = in->size / (colours * 3);
+    if (in->size >= 4 && memcmp(in->data, "FORM", 4) == 0) {
+        log_error(log, "Warning: -ps expects raw RGB palette tables, not IFF files\n");
+    }
+    if (in->size % (colours * 3) != 0) {
+        log_error(log, "Warning: %zu bytes at the end are not a complete palette of %zu colours, ignored\n",
+                  in->size % (colours * 3), colours);
+    }
+    size_t pal_size = palette_format_size(opts->palette_format, colours) * num_palettes;
+    arena_reserve(arena, ARENA_SIZE(pal_size + 1));
+    uint8_t* pal = (uint8_t*)arena_alloc(arena, pal_size + 1);
+    if (!pal) {
+        log_error(log, "Failed to allocate memory for palette words\n");
+        return 1;
+    }
+    double t0 = time_seconds();
+    cmap_to_palette_set(in->data, num_palettes, colours, opts->palette_format, pal);
+    if (opts->hex_dump) print_hex(log, pal, pal_size);
+    char pal_filename[512];
+    int failed;
+    if (to_stdout) {
+        snprintf(pal_filename, sizeof(pal_filename), "<stdout>");
+        failed = fwrite(pal, 1, pal_size, stdout) != pal_size || fflush(stdout) != 0;
+        if (failed) log_error(log, "Failed to write %s\n", pal_filename);
+    } else {
+        int len = snprintf(pal_filename, sizeof(pal_filename), "%s.pal", output_base);
+        if (len < 0 || (size_t)len >= sizeof(pal_filename)) {
+            log_error(log, "Error: output name too long: %s.pal\n", output_base);
+            return 1;
+        }
+        failed = write_bin(log, pal_filename, pal, pal_size) != 0;
+    }
+    stats_add(st, STAGE_WRITE_PAL, t0, pal_size);
+    if (!failed) {
+        log_at(log, LOG_NORMAL, "%s -> %s (%zu palettes of %zu colours, %zu bytes)\n", filename, pal_filename,
+               num_palettes, colours, pal_size);
+    }
+    return failed;
+}
+
+// File name extensions of the products, indexed by PACK_BPL, PACK_PAL, ...
+#define OUTPUT_SUFFIX_MAX 16 // room left after the output base: "_NNNNNNNN" tile/frame number and ".ext"
+static const char* const product_ext[NUM_PRODUCTS] = { "bpl", "pal", "chk", "bpf", "msk", "spr" };
+
+// Restore the products of a cache entry as output files (or the bitplanes to stdout). Returns 0 on success,
+// 1 if a product could not be restored (also when its file name does not fit), so the input is converted.
+static int restore_from_cache(ConvertLog* log, const char* dir, const char* key, const CacheManifest* m,
+                              const char* output_base, int to_stdout, char* restored, size_t restored_size) {
+    restored[0] = '\0';
+    for (int i = 0; i < m->count; i++) {
+        char filename[512];
+        int is_bpl = strcmp(m->ext[i], "bpl") == 0;
+        if (to_stdout && !is_bpl) continue;
+        int name_len = snprintf(filename, sizeof(filename), "%s.%s", output_base, m->ext[i]);
+        if (name_len < 0 || (size_t)name_len >= sizeof(filename)) {
+            log_error(log, "Output name too long to restore from the cache: %s.%s\n", output_base, m->ext[i]);
+            return 1;
+        }
+        if (cache_fetch(dir, key, m->ext[i], to_stdout ? NULL : filename, stdout) != 0) {
+            log_error(log, "Failed to restore %s from the cache\n", to_stdout ? "<stdout>" : filename);
+            return 1;
+        }
+        log_info(log, "Restored from cache: %s (%llu bytes)\n", to_stdout ? "<stdout>" : filename,
+                 (unsigned long long)m->size[i]);
+        size_t len = strlen(restored);
+        snprintf(restored + len, restored_size - len, "%s%s", len ? " " : "", to_stdout ? "<stdout>" : filename);
+    }
+    return 0;
+}
+
+// The files written by a conversion, for the message of the default level: "a.bpl a.pal a.chk"
+static void list_products(char* out, size_t size, const char* output_base, unsigned produced) {
+    size_t len = 0;
+    out[0] = '\0';
+    for (int i = 0; i < NUM_PRODUCTS && len < size; i++) {
+        if (!(produced & (1u << i))) continue;
+        len += (size_t)snprintf(out + len, size - len, "%s%s.%s", len ? " " : "", output_base, product_ext[i]);
+    }
+}
+
+// ---------------------------------------------------------------------------------------------
+// --info: the chunks and metadata of a file, read without its BODY
+// ---------------------------------------------------------------------------------------------
+
+// Forward only reader: seeks over the chunk data on regular files, reads and discards it on pipes, or
+// reads from an input already in memory
+typedef struct {
+    FILE* f;
+    const uint8_t* data;
+    size_t size;
+    uint64_t pos;
+    int seekable;
+    uint64_t bytes_read;
+} InfoReader;
+
+static int info_goto(InfoReader* r, uint64_t offset) {
+    if (offset < r->pos) return 1;
+    uint64_t skip = offset - r->pos;
+    if (skip && !r->data) {
+        if (!r->seekable || skip > 0x7FFFFFFF || fseek(r->f, (long)skip, SEEK_CUR) != 0) {
+            skip_stream(r->f, (size_t)skip);
+            r->bytes_read += skip;
+        }
+    }
+    r->pos = offset;
     return 0;
-}
\ No newline at end of file
+}
+
+static size_t info_read(InfoReader* r, void* buf, size_t n) {
+    size_t got;
+    if (r->data) {
+        got = r->pos < r->size ? (r->size - r->pos < n ? (size_t)(r->size - r->pos) : n) : 0;
+        memcpy(buf, r->data + r->pos, got);
+    } else {
+        got = fread(buf, 1, n, r->f);
+    }
+    r->pos += got;
+    r->bytes_read += got;
+    return got;
+}
+
+#define INFO_CMAP_MAX (256 * 3)
+
+// What --info reports of a file
+typedef struct {
+    ChunkIndex form; // the top level FORM
+    ChunkIndex frame0; // FORM ANIM: the first frame
+    BMHD bmhd;
+    int found_bmhd;
+    uint8_t cmap[INFO_CMAP_MAX];
+    uint32_t cmap_size; // as stored, of which up to INFO_CMAP_MAX bytes are in cmap
+    int frames; // FORM ANIM: number of frames
+} FileInfo;
+
+// Index the FORM whose 12 byte header has just been read, reading only the chunk headers and the BMHD
+// and CMAP data. In a FORM ANIM the first frame, a nested FORM ILBM, is indexed the same way.
+static void info_scan(InfoReader* r, const uint8_t header[12], ChunkIndex* idx, FileInfo* info, int nested) {
+    if (chunk_index_begin(idx, header, r->pos - 12) != IFFBPL_OK) return;
+    while (!chunk_index_done(idx) && info_goto(r, idx->next) == 0) {
+        uint8_t ch[12];
+        if (info_read(r, ch, 8) != 8) break;
+        IffChunk c;
+        chunk_index_add(idx, ch, &c);
+        if (memcmp(c.id, "BMHD", 4) == 0 && !info->found_bmhd) {
+            uint8_t b[BMHD_SIZE];
+            if (c.size >= BMHD_SIZE && info_read(r, b, BMHD_SIZE) == BMHD_SIZE) {
+                parse_bmhd(b, &info->bmhd);
+                info->found_bmhd = 1;
+            }
+        } else if (memcmp(c.id, "CMAP", 4) == 0 && !info->cmap_size) {
+            size_t n = c.size < INFO_CMAP_MAX ? c.size : INFO_CMAP_MAX;
+            if (info_read(r, info->cmap, n) == n) info->cmap_size = c.size;
+        } else if (memcmp(c.id, "FORM", 4) == 0 && !nested && memcmp(idx->form_type, "ANIM", 4) == 0) {
+            if (info->frames++ == 0 && c.size >= 4 && info_read(r, ch + 8, 4) == 4) {
+                info_scan(r, ch, &info->frame0, info, 1);
+            }
+        }
+    }
+}
+
+static void log_chunks(ConvertLog* log, const ChunkIndex* idx, const char* indent) {
+    for (int i = 0; i < idx->count; i++) {
+        const IffChunk* c = &idx->chunks[i];
+        log_info(log, "%s%.4s %u bytes at %llu\n", indent, c->id, c->size, (unsigned long long)c->offset);
+    }
+    if (idx->total > idx->count) log_info(log, "%s... %d more chunks\n", indent, idx->total - idx->count);
+}
+
+// Print the chunk index, BMHD and CMAP of a file (or of 'preloaded', which is freed) without reading its
+// BODY. Returns 0 on success, 1 if it cannot be opened or is not an IFF FORM.
+static int info_input(const char* filename, InputFile* preloaded, const ConvertOptions* opts, ConvertLog* log) {
+    StageStats st;
+    stats_init(&st, stage_names, NUM_STAGES);
+    double t0 = time_seconds();
+    InfoReader r;
+    memset(&r, 0, sizeof(r));
+    if (preloaded) {
+        r.data = preloaded->data;
+        r.size = preloaded->size;
+    } else if (strcmp(filename, "-") == 0) {
+        set_binary_mode(stdin);
+        r.f = stdin;
+    } else {
+        r.f = fopen(filename, "rb");
+        if (!r.f) {
+            log_error(log, "Failed to open file: %s\n", filename);
+            return 1;
+        }
+    }
+    if (r.f) r.seekable = is_regular(r.f, NULL);
+
+    FileInfo* info = (FileInfo*)calloc(1, sizeof(FileInfo));
+    uint8_t header[12];
+    int is_form = info && info_read(&r, header, sizeof(header)) == sizeof(header) && memcmp(header, "FORM", 4) == 0;
+    if (is_form) info_scan(&r, header, &info->form, info, 0);
+    if (r.f && r.f != stdin) fclose(r.f);
+    if (preloaded) close_input(preloaded);
+    stats_add(&st, STAGE_PARSE, t0, r.bytes_read);
+    if (!is_form) {
+        if (info) log_error(log, "%s: not an IFF FORM\n", filename);
+        else log_error(log, "Out of memory\n");
+        free(info);
+        return 1;
+    }
+
+    const ChunkIndex* form = &info->form;
+    int anim = memcmp(form->form_type, "ANIM", 4) == 0;
+    log_info(log, "Input file: %s\n", filename);
+    log_info(log, "FORM %.4s, %llu bytes, %d chunks:\n", form->form_type, (unsigned long long)form->end, form->total);
+    log_chunks(log, form, "  ");
+    if (anim && info->frames) {
+        log_info(log, "First frame (FORM %.4s):\n", info->frame0.form_type);
+        log_chunks(log, &info->frame0, "  ");
+    }
+    if (info->found_bmhd) log_bmhd(log, &info->bmhd);
+    size_t colours = info->cmap_size / 3;
+    if (info->cmap_size && opts->hex_dump) {
+        size_t n = (info->cmap_size < INFO_CMAP_MAX ? info->cmap_size : INFO_CMAP_MAX) / 3;
+        uint8_t pal[4 + INFO_CMAP_MAX * 4 + 4];
+        cmap_to_palette_set(info->cmap, 1, n, opts->palette_format, pal);
+        log_at(log, LOG_NORMAL, "+CMAP Pallette (%zu colours):\n", colours);
+        print_hex(log, pal, palette_format_size(opts->palette_format, n));
+    }
+    log_info(log, "Read %llu of %llu bytes\n", (unsigned long long)r.bytes_read, (unsigned long long)form->end);
+
+    char what[64];
+    if (anim) snprintf(what, sizeof(what), "ANIM %d frames, ", info->frames);
+    else if (memcmp(form->form_type, "ILBM", 4) == 0) snprintf(what, sizeof(what), "ILBM ");
+    else snprintf(what, sizeof(what), "FORM %.4s, ", form->form_type);
+    const ChunkIndex* image = anim ? &info->frame0 : form;
+    const IffChunk* body = chunk_find(image, "BODY");
+    if (info->found_bmhd) {
+        const BMHD* b = &info->bmhd;
+        log_at(log, LOG_NORMAL, "%s: %s%ux%u, %u planes%s, compression %u, %zu colours, BODY %u bytes\n", filename,
+               what, b->width, b->height, b->numPlanes, b->masking == MSK_HAS_MASK ? " + mask" : "", b->compression,
+               colours, body ? body->size : 0);
+        st.width = b->width;
+        st.height = b->height;
+        st.planes = b->numPlanes;
+        st.compression = b->compression;
+    } else {
+        log_at(log, LOG_NORMAL, "%s: %s%d chunks, no BMHD\n", filename, what, form->total);
+    }
+    if (opts->stats) log_stats(log, &st, filename);
+    free(info);
+    return 0;
+}
+
+// Convert a single ILBM file. Reentrant: all state lives on the stack or in buffers owned by this call,
+// and all messages go to 'log'. If output_name is NULL the output base name is derived from the input.
+// With 'prod' the products are collected in memory for a pack file instead of being written to files.
+// With 'preloaded' the input is that buffer instead of the file (input_filename only names it in the
+// messages, not with -s); the conversion takes it over and frees it. The working buffers come from
+// 'arena', which is reset first and sized from the BMHD.
+// Returns 0 on success, 1 if the input file could not be opened, nothing was converted or not every product
+// the options ask for was written (or, with 'prod', on out of memory or an output base name too long for
+// the pack directory).
+static int convert_input(const char* input_filename, InputFile* preloaded, const char* output_name,
+                         const ConvertOptions* opts, ConvertLog* log, ConvertProducts* prod, Arena* arena) {
+    const char* filename = input_filename;
+    if (opts->info) return info_input(filename, preloaded, opts, log);
+    arena_reset(arena);
+    InputFile in;
+    memset(&in, 0, sizeof(in));
+    // Stage timings are always collected (a few clock reads per band) and reported with --stats
+    StageStats st;
+    stats_init(&st, stage_names, NUM_STAGES);
+    // In streaming mode (-s) the file is read sequentially with stdio, otherwise it is mapped.
+    // "-" reads stdin: streamed as well with -s, otherwise read into memory.
+    FILE* stream = NULL;
+    int from_stdin = strcmp(filename, "-") == 0;
+    double t0 = time_seconds();
+    int open_failed;
+    if (preloaded) {
+        in = *preloaded;
+        open_failed = 0;
+    } else if (from_stdin) {
+        set_binary_mode(stdin);
+        if (opts->streaming) stream = stdin;
+        open_failed = opts->streaming ? 0 : read_input_stdio(stdin, &in) != 0;
+    } else {
+        open_failed = opts->streaming ? (stream = fopen(filename, "rb")) == NULL : open_input(filename, &in) != 0;
+    }
+    if (open_failed) {
+        log_error(log, "Failed to open file: %s\n", filename);
+        return 1;
+    }
+    stats_add(&st, STAGE_READ, t0, in.size);
+
+    log_info(log, "Input file: %s\n", filename);
+
+    // Determine the base filename for output files
+    char base_filename[512];
+    if (output_name) {
+        // Use the specified output name
+        strncpy(base_filename, output_name, sizeof(base_filename) - 1);
+        base_filename[sizeof(base_filename) - 1] = '\0';
+    } else {
+        // Strip extension from input filename if present
+        strncpy(base_filename, filename, sizeof(base_filename) - 1);
+        base_filename[sizeof(base_filename) - 1] = '\0';
+        char* dot = strrchr(base_filename, '.');
+        if (dot && dot != base_filename) {
+            *dot = '\0';
+        }
+    }
+    // The product names (512 bytes, like base_filename) append a tile or frame number and the extension
+    if (strlen(output_name ? output_name : filename) >= sizeof(base_filename) - OUTPUT_SUFFIX_MAX) {
+        log_error(log, "Error: output name too long (at most %zu characters): %s\n",
+                  sizeof(base_filename) - OUTPUT_SUFFIX_MAX - 1, output_name ? output_name : filename);
+        if (stream) {
+            if (stream != stdin) fclose(stream);
+        } else {
+            close_input(&in);
+        }
+        return 1;
+    }
+    const char* output_base = base_filename;
+    int to_stdout = output_name && strcmp(output_name, "-") == 0;
+    if (prod) {
+        // Pack entries are named after the output base name without its directory
+        const char* name = output_base;
+        for (const char* c = output_base; *c; c++) {
+            if (*c == '/' || *c == '\\' || *c == ':') name = c + 1;
+        }
+        // A name cut to PACK_NAME_SIZE could clash with another entry, so a longer one is an error
+        size_t name_len = strlen(name);
+        if (name_len >= PACK_NAME_SIZE) {
+            log_error(log, "Error: pack entry name %s of %s is longer than %d characters\n", name, filename,
+                      PACK_NAME_SIZE - 1);
+            if (stream) {
+                if (stream != stdin) fclose(stream);
+            } else {
+                close_input(&in);
+            }
+            return 1;
+        }
+        memset(prod, 0, sizeof(*prod));
+        memcpy(prod->entry.name, name, name_len + 1);
+    }
+
+    if (opts->palette_set_colours) {
+        int result = convert_palette_set(log, filename, &in, output_base, to_stdout, opts, &st, arena);
+        close_input(&in);
+        if (opts->stats) log_stats(log, &st, filename);
+        return result;
+    }
+
+    // Conversion cache (--cache): the key is a hash of the whole input, so the cache is used when the
+    // input is held in memory (not with -s) and the products go to files or stdout (not to a pack, not as
+    // -tiles, which makes many products of each kind)
+    char key[CACHE_KEY_SIZE];
+    int use_cache = opts->cache_dir && !stream && !prod && !opts->tile_w;
+    if (use_cache) {
+        t0 = time_seconds();
+        char options[128];
+        int len = snprintf(options, sizeof(options), "iff2bpl c=%d cd=%d ni=%d pf=%d", opts->create_chunky,
+                           opts->create_chunky_doubled, opts->create_noninterleaved, opts->palette_format);
+        if (opts->write_mask) len += snprintf(options + len, sizeof(options) - len, " m=1");
+        if (opts->sprites) {
+            len += snprintf(options + len, sizeof(options) - len, " spr=%d,%d", opts->sprite_x, opts->sprite_y);
+        }
+        if (opts->rect_w) {
+            snprintf(options + len, sizeof(options) - len, " rect=%d,%d,%d,%d", opts->rect_x, opts->rect_y,
+                     opts->rect_w, opts->rect_h);
+        }
+        cache_key(options, in.data, in.size, key);
+        CacheManifest m;
+        char restored[2048];
+        int hit = cache_lookup(opts->cache_dir, key, &m) &&
+                  restore_from_cache(log, opts->cache_dir, key, &m, output_base, to_stdout, restored, sizeof(restored)) == 0;
+        stats_add(&st, STAGE_CACHE, t0, hit ? in.size : 0);
+        st.cache = hit;
+        if (hit) {
+            close_input(&in);
+            log_at(log, LOG_NORMAL, "%s -> %s (from cache)\n", filename, restored);
+            if (opts->stats) log_stats(log, &st, filename);
+            return 0;
+        }
+    }
+    // FORM ANIM: the frames are built from deltas against each other, so the whole file must be in memory
+    // (not -s) and there are many products per input (not -p)
+    AnimIter anim;
+    if (!stream && anim_begin(in.data, in.size, &anim) == IFFBPL_OK) {
+        int result = 0;
+        if (prod) {
+            log_error(log, "ANIM files cannot be written to a pack file: %s\n", filename);
+            result = 1;
+        } else if (opts->rect_w || opts->tile_w) {
+            log_error(log, "-rect and -tiles cannot be used with ANIM files: %s\n", filename);
+            result = 1;
+        } else {
+            result = convert_anim(log, filename, &in, output_base, to_stdout, opts, &st, arena);
+        }
+        close_input(&in);
+        if (opts->stats) log_stats(log, &st, filename);
+        return result;
+    }
+    unsigned produced = 0; // products written, bits 1 << PACK_BPL etc.
+    int num_tiles = 0; // -rect / -tiles: tiles written
+
+    int found_bmhd = 0, found_cmap = 0, found_body = 0;
+    BMHD bmhd = {0};
+    const uint8_t* cmap_data = NULL;
+    uint8_t* cmap_owned = NULL;
+    uint32_t cmap_size = 0;
+    BodySource body;
+    memset(&body, 0, sizeof(body));
+    uint32_t body_size = 0;
+    IlbmImage img; // parsed in place when the input is in memory; with -s only its BIDX row index is set
+    memset(&img, 0, sizeof(img));
+    int region = opts->rect_w || opts->tile_w;
+
+    t0 = time_seconds();
+    uint64_t parsed = 12; // bytes of the stream consumed by the chunk parser
+    if (stream) {
+        // Sequential chunk parser: only BMHD and CMAP are read, the BODY is left in the stream and
+        // decoded band by band by the output stage. Chunks after the BODY are ignored. The parser is
+        // driven by the FORM and chunk sizes alone and never seeks, so it also works on pipes.
+        uint8_t hdr[12];
+        size_t got = fread(hdr, 1, sizeof(hdr), stream); // "FORM", FORM size, "ILBM"
+        if (got == sizeof(hdr) && memcmp(hdr + 8, "ANIM", 4) == 0) {
+            log_error(log, "ANIM files cannot be streamed, convert %s without -s\n", filename);
+            got = 0;
+        }
+        uint64_t form_end = got == sizeof(hdr) ? (uint64_t)get_be32(hdr + 4) + 8 : got;
+        log_info(log, "File size: %u bytes\n", (uint32_t)form_end);
+        uint8_t chunk[8];
+        while (got == sizeof(hdr) && parsed + sizeof(chunk) <= form_end &&
+               fread(chunk, 1, sizeof(chunk), stream) == sizeof(chunk)) {
+            const char* chunk_id = (const char*)chunk;
+            uint32_t size = ((get_be32(chunk + 4) + 1) & ~1); // even size
+            parsed += sizeof(chunk);
+            if (strncmp(chunk_id, "BODY", 4) != 0) parsed += size;
+
+            if (strncmp(chunk_id, "BMHD", 4) == 0) {
+                uint8_t b[20];
+                size_t n = size < sizeof(b) ? size : sizeof(b);
+                if (fread(b, 1, n, stream) == sizeof(b)) {
+                    parse_bmhd(b, &bmhd);
+                    found_bmhd = 1;
+                    // The CMAP usually follows, its size is not known yet: assume 256 colours
+                    size_t index_size = BODY_INDEX_SIZE((size_t)bmhd.height * ilbm_body_planes(&bmhd));
+                    arena_reserve(arena, conversion_arena_size(&bmhd, 256 * 3, 1, opts) +
+                                         (region ? ARENA_SIZE(index_size) : 0));
+                }
+                skip_stream(stream, size - n);
+            } else if (strncmp(chunk_id, "CMAP", 4) == 0) {
+                cmap_owned = (uint8_t*)arena_alloc(arena, size);
+                if (cmap_owned) {
+                    cmap_size = (uint32_t)fread(cmap_owned, 1, size, stream);
+                    cmap_data = cmap_owned;
+                    found_cmap = 1;
+                } else {
+                    skip_stream(stream, size);
+                }
+            } else if (strncmp(chunk_id, BODY_INDEX_ID, 4) == 0 && region) {
+                // Only a region is entered through the index when streaming, the BODY is never held whole
+                uint8_t* index = (uint8_t*)arena_alloc(arena, size);
+                if (index && fread(index, 1, size, stream) == size) {
+                    img.body_index = index;
+                    img.body_index_size = size;
+                } else if (!index) {
+                    skip_stream(stream, size);
+                }
+            } else if (strncmp(chunk_id, "BODY", 4) == 0) {
+                body.stream = stream;
+                body.remaining = size;
+                body_size = size;
+                found_body = 1;
+                break;
+            } else {
+                skip_stream(stream, size);
+            }
+        }
+    } else {
+        log_info(log, "File size: %zu bytes\n", in.size);
+
+        // Chunks are parsed in place - CMAP and BODY point into the input data, nothing is copied
+        ilbm_parse(in.data, in.size, &img);
+        bmhd = img.bmhd;
+        found_bmhd = img.found_bmhd;
+        cmap_data = img.cmap;
+        cmap_size = (uint32_t)img.cmap_size;
+        found_cmap = img.cmap != NULL;
+        body.data = img.body;
+        body.len = img.body_size;
+        body_size = (uint32_t)img.body_size;
+        found_body = img.body != NULL;
+    }
+    body.size = body_size;
+    // A BIDX row index (bpl2iff -ri) locates every compressed scanline: a region is entered at its first row,
+    // and a large image is decoded up front by decode_threads threads, each taking a band of rows
+    if (found_bmhd && found_body && bmhd.compression == 1 && img.body_index) {
+        if (body_index_check(img.body_index, img.body_index_size, &bmhd, body_size) == IFFBPL_OK) {
+            body.index = img.body_index;
+            log_info(log, "BIDX row index found\n");
+        } else {
+            log_error(log, "Warning: the BIDX row index of %s does not match its BODY, ignored\n", filename);
+        }
+    }
+    int parallel = body.index && !stream && !region && opts->decode_threads > 1 &&
+                   ilbm_body_planar_size(&bmhd) >= PARALLEL_DECODE_MIN_BYTES;
+    if (found_bmhd && !stream) {
+        arena_reserve(arena, conversion_arena_size(&bmhd, cmap_size, 0, opts) +
+                             (parallel ? ARENA_SIZE(ilbm_body_planar_size(&bmhd) + 1) : 0));
+    }
+    // In streaming mode this includes reading the chunks before the BODY
+    stats_add(&st, STAGE_PARSE, t0, stream ? parsed : in.size);
+
+    if (found_bmhd) {
+        log_bmhd(log, &bmhd);
+    } else {
+        log_info(log, "BMHD chunk not found.\n");
+    }
+    Region r; // -rect / -tiles
+    memset(&r, 0, sizeof(r));
+    int rejected = 0;
+    if (found_bmhd && region && region_of(&bmhd, opts, &r) != 0) {
+        // Checked before anything is written, so a bad region leaves no partial products behind
+        if (r.x + r.width > bmhd.width || r.y + r.height > bmhd.height) {
+            log_error(log, "Error: -rect %zu,%zu,%zu,%zu is not inside the %ux%u image of %s\n", r.x, r.y,
+                      r.width, r.height, bmhd.width, bmhd.height, filename);
+        } else {
+            log_error(log, "Error: no %ux%u tile fits into the %zux%zu %s of %s\n", r.tile.width,
+                      r.tile.height, r.width, r.height, opts->rect_w ? "region" : "image", filename);
+        }
+        rejected = 1;
+    } else if (found_bmhd && opts->create_chunky_doubled && bmhd.numPlanes > 8) {
+        log_error(log, "Error: -cd needs an image of at most 8 planes, %s has %u (use -c)\n", filename, bmhd.numPlanes);
+        rejected = 1;
+    } else if (found_bmhd && opts->sprites && bmhd.numPlanes > SPRITE_MAX_PLANES) {
+        log_error(log, "Error: -spr needs an image of at most %d planes, %s has %u\n", SPRITE_MAX_PLANES, filename,
+                  bmhd.numPlanes);
+        rejected = 1;
+    } else if (found_bmhd && opts->sprites && opts->sprite_y + (region ? r.tile.height : bmhd.height) > 511) {
+        // VSTOP is a 9 bit line number
+        log_error(log, "Error: sprites of %u rows at line %d of %s end below line 511\n",
+                  region ? r.tile.height : bmhd.height, opts->sprite_y, filename);
+        rejected = 1;
+    }
+    if (rejected) {
+        if (stream) {
+            if (stream != stdin) fclose(stream);
+        } else {
+            close_input(&in);
+        }
+        if (opts->stats) log_stats(log, &st, filename);
+        return 1;
+    }
+
+    if (found_cmap && to_stdout) {
+        log_info(log, "CMAP found, .pal not written (bitplane data goes to stdout)\n");
+    } else if (found_cmap) {
+        produced |= write_palette(log, cmap_data, cmap_size, output_base, prod, opts, &st, arena);
+    } else {
+        log_info(log, "CMAP chunk not found.\n");
+    }
+
+    if (found_body) {
+        log_info(log, "+BODY (%u bytes):\n", body_size);
+        if (!found_bmhd) {
+            log_error(log, "BODY cannot be converted without BMHD\n");
+        } else if ((bmhd.compression == 0 || bmhd.compression == 1) && region) {
+            produced |= write_region_outputs(log, &bmhd, &body, output_base, to_stdout, prod, opts, &st, arena,
+                                             &num_tiles);
+        } else if (parallel) {
+            // All rows are decoded first, then written from memory by the same output stage
+            size_t planar_size = ilbm_body_planar_size(&bmhd);
+            uint8_t* planes = (uint8_t*)arena_alloc(arena, planar_size + 1);
+            if (planes) {
+                size_t short_rows = 0;
+                t0 = time_seconds();
+                ilbm_decode_body_parallel(&img, planes, &short_rows, opts->decode_threads);
+                stats_add(&st, STAGE_DECODE, t0, planar_size);
+                log_info(log, "BODY decoded by %d threads using the BIDX row index\n", opts->decode_threads);
+                if (short_rows) {
+                    log_error(log, "Warning: %zu scanlines decompressed short (expected %zu bytes), zero padded\n",
+                              short_rows, ilbm_row_bytes(bmhd.width));
+                }
+                BodySource decoded;
+                memset(&decoded, 0, sizeof(decoded));
+                decoded.data = planes;
+                decoded.len = planar_size;
+                decoded.size = planar_size;
+                decoded.decoded = 1;
+                produced |= write_body_outputs(log, &bmhd, &decoded, body_size, output_base, to_stdout, prod, opts,
+                                               &st, arena);
+            } else {
+                log_error(log, "Failed to allocate memory for the decoded BODY\n");
+            }
+        } else if (bmhd.compression == 0 || bmhd.compression == 1) {
+            produced |= write_body_outputs(log, &bmhd, &body, body_size, output_base, to_stdout, prod, opts, &st,
+                                           arena);
+        } else {
+            log_error(log, "Unknown compression type: %u\n", bmhd.compression);
+        }
+    } else {
+        log_info(log, "BODY chunk not found.\n");
+    }
+
+    // Converted only if every product the options ask for was written (for every tile of a region)
+    unsigned wanted = wanted_products(&bmhd, found_cmap, to_stdout, prod != NULL, opts);
+    int complete = found_bmhd && found_body && (produced & wanted) == wanted && (!region || num_tiles);
+
+    if (use_cache && !to_stdout && produced && !complete) {
+        // An entry with a product missing would be restored as if it were the whole conversion
+        log_error(log, "Warning: not all products of %s written, not stored in the cache\n", filename);
+    } else if (use_cache && !to_stdout && produced) {
+        // Keep copies of the products just written for the next run
+        t0 = time_seconds();
+        char paths[NUM_PRODUCTS][512];
+        const char* exts[NUM_PRODUCTS];
+        const char* srcs[NUM_PRODUCTS];
+        int count = 0, too_long = 0;
+        for (int i = 0; i < NUM_PRODUCTS; i++) {
+            if (!(produced & (1u << i))) continue;
+            int len = snprintf(paths[count], sizeof(paths[count]), "%s.%s", output_base, product_ext[i]);
+            if (len < 0 || (size_t)len >= sizeof(paths[count])) too_long = 1;
+            exts[count] = product_ext[i];
+            srcs[count] = paths[count];
+            count++;
+        }
+        // A cut off path would store some other file under this key
+        if (too_long) {
+            log_error(log, "Warning: output name %s too long, %s not stored in the cache\n", output_base, filename);
+        } else if (cache_store(opts->cache_dir, key, exts, srcs, count) != 0) {
+            log_error(log, "Warning: failed to store %s in the cache %s\n", filename, opts->cache_dir);
+        }
+        stats_add(&st, STAGE_CACHE, t0, 0);
+    }
+
+    if (!body.window_fixed) free(body.window);
+    if (stream) {
+        if (stream != stdin) fclose(stream);
+    } else {
+        close_input(&in);
+    }
+
+    if (log_level >= LOG_NORMAL) {
+        // One line per file at the default message level
+        char outputs[2600];
+        char geometry[96];
+        if (prod) snprintf(outputs, sizeof(outputs), "pack entry %s", prod->entry.name);
+        else if (to_stdout) snprintf(outputs, sizeof(outputs), "<stdout>");
+        else if (opts->tile_w) snprintf(outputs, sizeof(outputs), "%s_0000.bpl .. %s_%04d.bpl%s%s%s", output_base,
+                                        output_base, num_tiles - 1, produced & (1u << PACK_PAL) ? ", " : "",
+                                        produced & (1u << PACK_PAL) ? output_base : "",
+                                        produced & (1u << PACK_PAL) ? ".pal" : "");
+        else list_products(outputs, sizeof(outputs), output_base, produced);
+        if (opts->tile_w) snprintf(geometry, sizeof(geometry), "%d tiles of %ux%u", num_tiles, r.tile.width,
+                                   r.tile.height);
+        else if (opts->rect_w) snprintf(geometry, sizeof(geometry), "%ux%u at %d,%d of %ux%u", r.tile.width,
+                                        r.tile.height, opts->rect_x, opts->rect_y, bmhd.width, bmhd.height);
+        else snprintf(geometry, sizeof(geometry), "%ux%u", bmhd.width, bmhd.height);
+        if (!found_bmhd || !found_body || !(produced & wanted) || (region && !num_tiles)) {
+            log_at(log, LOG_NORMAL, "%s: nothing converted (%s)\n", filename,
+                   !found_bmhd ? "no BMHD chunk" : !found_body ? "no BODY chunk" : "no output written");
+        } else if (!complete) {
+            log_at(log, LOG_NORMAL, "%s: not all products written, only %s\n", filename, outputs);
+        } else {
+            log_at(log, LOG_NORMAL, "%s -> %s (%s, %u planes%s)\n", filename, outputs, geometry, bmhd.numPlanes,
+                   bmhd.masking == MSK_HAS_MASK ? " + mask" : "");
+        }
+    }
+    if (opts->stats) {
+        if (found_bmhd) {
+            st.width = bmhd.width;
+            st.height = bmhd.height;
+            st.planes = bmhd.numPlanes;
+            st.compression = bmhd.compression;
+        }
+        log_stats(log, &st, filename);
+    }
+    if (prod) {
+        if (found_bmhd) {
+            // The pack entry of a -rect conversion holds the region
+            int rect = opts->rect_w && region_of(&bmhd, opts, &r) == 0;
+            prod->entry.width = rect ? r.tile.width : bmhd.width;
+            prod->entry.height = rect ? r.tile.height : bmhd.height;
+            prod->entry.planes = bmhd.numPlanes;
+        }
+        if (opts->create_chunky_doubled) prod->entry.flags |= PACK_FLAG_CHUNKY_DOUBLED;
+        if (opts->palette_format == PAL_AGA) prod->entry.flags |= PACK_FLAG_PAL_AGA;
+        if (opts->palette_format == PAL_RGB32) prod->entry.flags |= PACK_FLAG_PAL_RGB32;
+        for (int i = 0; i < PACK_SECTIONS; i++) {
+            if (prod->out[i].failed) {
+                log_error(log, "Failed to allocate memory for the pack entry of %s\n", filename);
+                free_products(prod);
+                return 1;
+            }
+        }
+    }
+    return complete ? 0 : 1;
+}
+
+// As convert_input() for a file. 'arena' may be NULL for a one-off conversion; batch and server workers
+// pass their own, so its block is reused from image to image.
+int convert_file(const char* input_filename, const char* output_name, const ConvertOptions* opts, ConvertLog* log,
+                 ConvertProducts* prod, Arena* arena) {
+    if (arena) return convert_input(input_filename, NULL, output_name, opts, log, prod, arena);
+    Arena local = {0};
+    int result = convert_input(input_filename, NULL, output_name, opts, log, prod, &local);
+    arena_free(&local);
+    return result;
+}
+
+// ---------------------------------------------------------------------------------------------
+// Batch mode: a small worker pool over a list of input files
+// ---------------------------------------------------------------------------------------------
+
+// One input file of a batch run, with its result and collected messages
+typedef struct {
+    const char* input_filename;
+    const char* output_name;
+    ConvertLog log;
+    int result;
+    ConvertProducts products; // pack mode only
+} ConvertJob;
+
+// Shared job queue - workers take the next unprocessed job index under the lock
+typedef struct {
+    ConvertJob* jobs;
+    size_t num_jobs;
+    size_t next_job;
+    mutex_t lock;
+    const ConvertOptions* opts;
+} JobQueue;
+
+static THREAD_FUNC batch_worker(void* arg) {
+    JobQueue* q = (JobQueue*)arg;
+    Arena arena = {0};
+    for (;;) {
+        mutex_lock(&q->lock);
+        size_t i = q->next_job++;
+        mutex_unlock(&q->lock);
+        if (i >= q->num_jobs) break;
+        ConvertJob* job = &q->jobs[i];
+        job->result = convert_file(job->input_filename, job->output_name, q->opts, &job->log,
+                                   q->opts->pack_filename ? &job->products : NULL, &arena);
+    }
+    arena_free(&arena);
+    return 0;
+}
+
+// Run all jobs on up to num_threads workers, then print the results in input order.
+// Returns the number of failed conversions.
+int run_batch(ConvertJob* jobs, size_t num_jobs, const ConvertOptions* opts, int num_threads) {
+    if (num_threads < 1) num_threads = 1;
+    if ((size_t)num_threads > num_jobs) num_threads = (int)num_jobs;
+
+    JobQueue q;
+    q.jobs = jobs;
+    q.num_jobs = num_jobs;
+    q.next_job = 0;
+    q.opts = opts;
+    mutex_init(&q.lock);
+
+    for (size_t i = 0; i < num_jobs; i++) {
+        memset(&jobs[i].log, 0, sizeof(jobs[i].log));
+        jobs[i].log.buffered = 1;
+        jobs[i].result = 1;
+    }
+
+    thread_t* threads = (thread_t*)malloc((size_t)num_threads * sizeof(thread_t));
+    int started = 0;
+    if (threads) {
+        for (; started < num_threads; started++) {
+            if (thread_start(&threads[started], batch_worker, &q) != 0) break;
+        }
+    }
+    if (started == 0) {
+        // No threads available - process everything on the calling thread
+        batch_worker(&q);
+    }
+    for (int t = 0; t < started; t++) thread_join(threads[t]);
+    free(threads);
+    mutex_destroy(&q.lock);
+
+    // The messages of all files are joined and written once per stream, in input order
+    TextBuffer out = {0}, err = {0};
+    int failed = 0;
+    for (size_t i = 0; i < num_jobs; i++) {
+        ConvertLog* log = &jobs[i].log;
+        size_t out_len = out.len, err_len = err.len;
+        if ((log->out.len && text_append(&out, log->out.text, log->out.len)) ||
+            (log->err.len && text_append(&err, log->err.text, log->err.len))) {
+            // Out of memory: print what was joined so far, then this file on its own
+            if (out_len) fwrite(out.text, 1, out_len, info_stream);
+            if (err_len) fwrite(err.text, 1, err_len, stderr);
+            out.len = err.len = 0;
+            flush_log(log);
+        }
+        if (jobs[i].result != 0) failed++;
+    }
+    if (out.len) fwrite(out.text, 1, out.len, info_stream);
+    if (err.len) fwrite(err.text, 1, err.len, stderr);
+    free(out.text);
+    free(err.text);
+    for (size_t i = 0; i < num_jobs; i++) {
+        free(jobs[i].log.out.text);
+        free(jobs[i].log.err.text);
+    }
+    return failed;
+}
+
+// Parse argv[*i] if it is an option of a single conversion (also accepted per request in server mode),
+// advancing *i past its argument. Returns 1 if it was one, 0 if not, -1 on an invalid argument.
+static int parse_convert_option(ConvertLog* log, int argc, char** argv, int* i, ConvertOptions* opts) {
+    const char* arg = argv[*i];
+    int has_value = *i + 1 < argc;
+    if (strcmp(arg, "-c") == 0) {
+        opts->create_chunky = 1;
+    } else if (strcmp(arg, "-cd") == 0) {
+        opts->create_chunky_doubled = 1;
+    } else if (strcmp(arg, "-ni") == 0) {
+        opts->create_noninterleaved = 1;
+    } else if (strcmp(arg, "-m") == 0) {
+        opts->write_mask = 1;
+    } else if (strcmp(arg, "-s") == 0) {
+        opts->streaming = 1;
+    } else if (strcmp(arg, "--stats") == 0) {
+        opts->stats = 1;
+    } else if (strcmp(arg, "--hex") == 0) {
+        opts->hex_dump = 1;
+    } else if (strcmp(arg, "--info") == 0) {
+        opts->info = 1;
+    } else if (strcmp(arg, "--cache") == 0 && has_value) {
+        opts->cache_dir = argv[++*i];
+    } else if (strcmp(arg, "-pf") == 0 && has_value) {
+        const char* format = argv[++*i];
+        if (strcmp(format, "ocs") == 0) {
+            opts->palette_format = PAL_OCS;
+        } else if (strcmp(format, "aga") == 0) {
+            opts->palette_format = PAL_AGA;
+        } else if (strcmp(format, "rgb32") == 0) {
+            opts->palette_format = PAL_RGB32;
+        } else {
+            log_error(log, "Error: unknown palette format %s (ocs, aga or rgb32)\n", format);
+            return -1;
+        }
+    } else if (strcmp(arg, "-rect") == 0 && has_value) {
+        int x, y, w, h;
+        char end;
+        if (sscanf(argv[++*i], "%d,%d,%d,%d%c", &x, &y, &w, &h, &end) != 4 || x < 0 || y < 0 || w <= 0 || h <= 0 ||
+            x + w > 65535 || y + h > 65535) {
+            log_error(log, "Error: -rect needs x,y,width,height inside 65535x65535 pixels, e.g. -rect 32,0,16,16\n");
+            return -1;
+        }
+        opts->rect_x = x;
+        opts->rect_y = y;
+        opts->rect_w = w;
+        opts->rect_h = h;
+    } else if (strcmp(arg, "-tiles") == 0 && has_value) {
+        int w, h;
+        char end;
+        if (sscanf(argv[++*i], "%dx%d%c", &w, &h, &end) != 2 || w <= 0 || h <= 0 || w > 65535 || h > 65535) {
+            log_error(log, "Error: -tiles needs a tile size WxH, e.g. -tiles 16x16\n");
+            return -1;
+        }
+        opts->tile_w = w;
+        opts->tile_h = h;
+    } else if (strcmp(arg, "-spr") == 0) {
+        opts->sprites = 1;
+    } else if (strcmp(arg, "-sprpos") == 0 && has_value) {
+        int x, y;
+        char end;
+        if (sscanf(argv[++*i], "%d,%d%c", &x, &y, &end) != 2 || x < 0 || y < 0 || x > 511 || y > 511) {
+            log_error(log, "Error: -sprpos needs a hardware position x,y of 0 to 511 each, e.g. -sprpos 128,44\n");
+            return -1;
+        }
+        opts->sprites = 1;
+        opts->sprite_x = x;
+        opts->sprite_y = y;
+    } else if (strcmp(arg, "-ps") == 0 && has_value) {
+        opts->palette_set_colours = atoi(argv[++*i]);
+        if (opts->palette_set_colours <= 0 || opts->palette_set_colours > 65535) {
+            log_error(log, "Error: -ps needs a number of colours per palette between 1 and 65535\n");
+            return -1;
+        }
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+// ---------------------------------------------------------------------------------------------
+// Server mode (--serve): a long running converter that takes requests on stdin and answers on stdout,
+// so a client (an editor converting on every save) pays the process start only once
+// ---------------------------------------------------------------------------------------------
+
+// Shared by the server workers: each worker reads a whole request under in_lock, converts it
+// unlocked and writes the whole response under out_lock, so up to -j requests run at once.
+typedef struct {
+    mutex_t in_lock;
+    mutex_t out_lock;
+    int eof;
+    const ConvertOptions* defaults; // options of the command line, the base of every request
+} Server;
+
+// Write the messages of a request, every line prefixed with its id ("<id> !" for errors and
+// warnings), then the closing "<id> done <result>" line
+static void write_response(const char* id, const ConvertLog* log, int result) {
+    const TextBuffer* bufs[2] = { &log->out, &log->err };
+    for (int b = 0; b < 2; b++) {
+        const char* text = bufs[b]->text;
+        size_t len = bufs[b]->len, start = 0;
+        for (size_t i = 0; i < len; i++) {
+            if (text[i] != '\n' && i + 1 < len) continue;
+            size_t end = text[i] == '\n' ? i : i + 1;
+            fprintf(stdout, "%s%s %.*s\n", id, b ? " !" : "", (int)(end - start), text + start);
+            start = i + 1;
+        }
+    }
+    fprintf(stdout, "%s done %d\n", id, result);
+    fflush(stdout);
+}
+
+// Read one request: its line into 'line' and, for "-data <size>", the inline input that follows it.
+// Returns 0 on success, 1 at the end of the input. *data is NULL if the request has no inline input.
+// *failed is set to 1 if the inline input could not be read completely, 2 if the line is too long
+// (its inline input is skipped) and 3 if the -data size is invalid, which ends the session: the
+// requests that follow cannot be told from the inline input.
+static int read_request(char* line, uint8_t** data, size_t* data_size, int* failed) {
+    *data = NULL;
+    *failed = 0;
+    int r = serve_read_request(stdin, line, data_size);
+    if (r == SERVE_REQUEST_EOF) return 1;
+    if (r != SERVE_REQUEST_OK) {
+        *failed = r == SERVE_REQUEST_TOO_LONG ? 2 : 3;
+        return 0;
+    }
+    if (*data_size) {
+        *data = (uint8_t*)malloc(*data_size);
+        if (!*data) {
+            serve_skip(stdin, *data_size);
+            *failed = 1;
+        } else if (fread(*data, 1, *data_size, stdin) != *data_size) {
+            *failed = 1;
+        }
+    }
+    return 0;
+}
+
+// Convert one request "<id> [options] [-o output_name] <input>" or "<id> [options] -o output_name
+// -data <size>" (followed by <size> bytes of inline input)
+static int serve_request(Server* srv, char* line, uint8_t* data, size_t data_size, int failed, ConvertLog* log,
+                         Arena* arena, const char** id) {
+    char* args[SERVE_MAX_ARGS];
+    int argc = serve_split_request(line, args, SERVE_MAX_ARGS);
+    *id = argc > 0 ? args[0] : "?";
+    if (argc < 0 || failed) {
+        log_error(log, failed == 1 ? "Error: failed to read the inline input\n" :
+                       failed == 2 ? "Error: request line too long\n" :
+                       failed == 3 ? "Error: invalid -data size, closing the session\n" : "Error: too many arguments\n");
+        free(data);
+        return 1;
+    }
+    ConvertOptions opts = *srv->defaults;
+    const char* output_name = NULL;
+    const char* input = NULL;
+    int has_data = 0;
+    for (int i = 1; i < argc; i++) {
+        int r = parse_convert_option(log, argc, args, &i, &opts);
+        if (r < 0) {
+            free(data);
+            return 1;
+        }
+        if (r > 0) continue;
+        if (strcmp(args[i], "-o") == 0 && i + 1 < argc) {
+            output_name = args[++i];
+        } else if (strcmp(args[i], "-data") == 0 && i + 1 < argc) {
+            i++;
+            has_data = 1;
+        } else if (!input && (args[i][0] != '-' || args[i][1] == '\0')) {
+            input = args[i];
+        } else {
+            log_error(log, "Error: unexpected argument %s\n", args[i]);
+            free(data);
+            return 1;
+        }
+    }
+    const char* error = NULL;
+    if (has_data != (data != NULL)) error = "Error: -data must be given with the size of the inline input\n";
+    else if (!data && !input) error = "Error: no input file in the request\n";
+    else if (data && input) error = "Error: a request has either an input file or -data\n";
+    else if (data && !output_name && !opts.info) error = "Error: -o is required with -data\n";
+    else if (!data && strcmp(input, "-") == 0) error = "Error: stdin carries the requests, use -data for inline input\n";
+    else if (output_name && strcmp(output_name, "-") == 0) error = "Error: stdout carries the responses, -o - cannot be used\n";
+    else if (opts.palette_set_colours && opts.streaming) error = "Error: -ps cannot be combined with -s\n";
+    if (error) {
+        log_error(log, "%s", error);
+        free(data);
+        return 1;
+    }
+    if (!data) return convert_file(input, output_name, &opts, log, NULL, arena);
+    // Inline input is already in memory, there is nothing to stream
+    InputFile in;
+    memset(&in, 0, sizeof(in));
+    in.data = data;
+    in.size = data_size;
+    opts.streaming = 0;
+    return convert_input("<inline>", &in, output_name, &opts, log, NULL, arena);
+}
+
+static THREAD_FUNC serve_worker(void* arg) {
+    Server* srv = (Server*)arg;
+    char line[SERVE_MAX_LINE];
+    Arena arena = {0}; // kept warm from request to request
+    for (;;) {
+        uint8_t* data;
+        size_t data_size;
+        int failed;
+        mutex_lock(&srv->in_lock);
+        int eof = srv->eof || read_request(line, &data, &data_size, &failed) != 0;
+        if (eof || failed == 3) srv->eof = 1;
+        mutex_unlock(&srv->in_lock);
+        if (eof) break;
+        if (line[strspn(line, " \t")] == '\0' && !failed) continue; // empty line
+
+        ConvertLog log;
+        memset(&log, 0, sizeof(log));
+        log.buffered = 1;
+        const char* id;
+        int result = serve_request(srv, line, data, data_size, failed, &log, &arena, &id);
+        mutex_lock(&srv->out_lock);
+        write_response(id, &log, result);
+        mutex_unlock(&srv->out_lock);
+        free(log.out.text);
+        free(log.err.text);
+    }
+    arena_free(&arena);
+    return 0;
+}
+
+// Serve requests until the end of stdin on up to num_threads workers. The process, its thread pool
+// and the file mappings of the system cache stay warm between requests.
+int run_server(const ConvertOptions* defaults, int num_threads) {
+    if (num_threads < 1) num_threads = 1;
+    Server srv;
+    srv.eof = 0;
+    srv.defaults = defaults;
+    mutex_init(&srv.in_lock);
+    mutex_init(&srv.out_lock);
+    set_binary_mode(stdin);
+    set_binary_mode(stdout);
+
+    thread_t* threads = (thread_t*)malloc((size_t)num_threads * sizeof(thread_t));
+    int started = 0;
+    if (threads) {
+        for (; started < num_threads; started++) {
+            if (thread_start(&threads[started], serve_worker, &srv) != 0) break;
+        }
+    }
+    if (started == 0) serve_worker(&srv);
+    for (int t = 0; t < started; t++) thread_join(threads[t]);
+    free(threads);
+    mutex_destroy(&srv.in_lock);
+    mutex_destroy(&srv.out_lock);
+    return 0;
+}
+
+// Round a pack offset up to the section alignment
+static uint64_t pack_align(uint64_t pos) {
+    return (pos + PACK_ALIGN - 1) & ~(uint64_t)(PACK_ALIGN - 1);
+}
+
+// Returns 1 if the job goes into the pack file: it succeeded and produced some section data
+static int pack_job_used(const ConvertJob* job) {
+    if (job->result != 0) return 0;
+    for (int k = 0; k < PACK_SECTIONS; k++) {
+        if (job->products.out[k].len) return 1;
+    }
+    return 0;
+}
+
+// Write the products of all successful jobs to a pack file, in input order; jobs without any section data
+// (such as a 0x0 image) are left out. With 'append' they are added to an existing pack (a new one is created
+// if it does not exist yet): the new sections and the extended TOC are written at its end and the header is
+// pointed at the new TOC last, so until then the old TOC is intact and an interrupted append leaves the pack
+// as it was (with unused bytes at its end). The old TOC stays behind as unused bytes. Returns 0 on success.
+static int write_pack(const char* pack_filename, int append, ConvertJob* jobs, size_t num_jobs) {
+    uint32_t old_entries = 0;
+    uint64_t data_end = PACK_HEADER_SIZE; // end of the file, where the new sections start
+    uint8_t* old_toc = NULL;
+    FILE* f = append ? fopen(pack_filename, "r+b") : NULL;
+    if (f) {
+        uint8_t hdr[PACK_HEADER_SIZE];
+        uint32_t toc_offset = 0;
+        fseek(f, 0, SEEK_END);
+        long size = ftell(f);
+        fseek(f, 0, SEEK_SET);
+        int ok = size >= PACK_HEADER_SIZE && fread(hdr, 1, sizeof(hdr), f) == sizeof(hdr) &&
+                 pack_parse_header(hdr, (size_t)size, &old_entries, &toc_offset) == IFFBPL_OK &&
+                 toc_offset >= PACK_HEADER_SIZE;
+        if (ok) {
+            old_toc = (uint8_t*)malloc((size_t)old_entries * PACK_ENTRY_SIZE + 1);
+            ok = old_toc && fseek(f, (long)toc_offset, SEEK_SET) == 0 &&
+                 fread(old_toc, 1, (size_t)old_entries * PACK_ENTRY_SIZE, f) == (size_t)old_entries * PACK_ENTRY_SIZE;
+        }
+        if (!ok) {
+            fprintf(stderr, "Error: %s is not a valid pack file\n", pack_filename);
+            free(old_toc);
+            fclose(f);
+            return 1;
+        }
+        data_end = (uint64_t)size;
+    } else {
+        f = fopen(pack_filename, "wb");
+        if (!f) {
+            fprintf(stderr, "Failed to open %s for writing\n", pack_filename);
+            return 1;
+        }
+    }
+
+    // Lay out the new sections; all offsets are known before anything is written
+    size_t new_entries = 0;
+    uint64_t pos = data_end;
+    for (size_t i = 0; i < num_jobs; i++) {
+        if (!pack_job_used(&jobs[i])) {
+            if (jobs[i].result == 0) {
+                fprintf(stderr, "Warning: %s has no image data, left out of %s\n", jobs[i].input_filename,
+                        pack_filename);
+            }
+            continue;
+        }
+        PackEntry* e = &jobs[i].products.entry;
+        for (int k = 0; k < PACK_SECTIONS; k++) {
+            size_t len = jobs[i].products.out[k].len;
+            pos = pack_align(pos);
+            e->offset[k] = len ? (uint32_t)pos : 0;
+            e->size[k] = (uint32_t)len;
+            pos += len;
+        }
+        new_entries++;
+    }
+    uint64_t toc_offset = pack_align(pos);
+    uint64_t total_entries = old_entries + (uint64_t)new_entries;
+    if (toc_offset + total_entries * PACK_ENTRY_SIZE > 0xFFFFFFFFu) {
+        fprintf(stderr, "Error: pack file %s would exceed 4 GB\n", pack_filename);
+        free(old_toc);
+        fclose(f);
+        return 1;
+    }
+
+    uint8_t hdr[PACK_HEADER_SIZE];
+    pack_store_header((uint32_t)total_entries, (uint32_t)toc_offset, hdr);
+    static const uint8_t zero[PACK_ALIGN] = {0};
+    int failed = 0;
+    if (old_toc) {
+        failed |= fseek(f, (long)data_end, SEEK_SET) != 0;
+    } else {
+        failed |= fwrite(hdr, 1, sizeof(hdr), f) != sizeof(hdr);
+    }
+    pos = data_end;
+    for (size_t i = 0; i < num_jobs; i++) {
+        if (!pack_job_used(&jobs[i])) continue;
+        for (int k = 0; k < PACK_SECTIONS; k++) {
+            const Output* o = &jobs[i].products.out[k];
+            if (!o->len) continue;
+            failed |= fwrite(zero, 1, (size_t)(pack_align(pos) - pos), f) != (size_t)(pack_align(pos) - pos);
+            failed |= fwrite(o->mem, 1, o->len, f) != o->len;
+            pos = pack_align(pos) + o->len;
+        }
+    }
+    failed |= fwrite(zero, 1, (size_t)(toc_offset - pos), f) != (size_t)(toc_offset - pos);
+    if (old_entries) failed |= fwrite(old_toc, 1, (size_t)old_entries * PACK_ENTRY_SIZE, f) != (size_t)old_entries * PACK_ENTRY_SIZE;
+    for (size_t i = 0; i < num_jobs; i++) {
+        if (!pack_job_used(&jobs[i])) continue;
+        uint8_t entry[PACK_ENTRY_SIZE];
+        pack_store_entry(&jobs[i].products.entry, entry);
+        failed |= fwrite(entry, 1, sizeof(entry), f) != sizeof(entry);
+    }
+    if (old_toc) {
+        // The header of an existing pack is updated last
+        failed |= fseek(f, 0, SEEK_SET) != 0;
+        failed |= fwrite(hdr, 1, sizeof(hdr), f) != sizeof(hdr);
+    }
+    failed |= fclose(f) != 0;
+    free(old_toc);
+    if (failed) {
+        fprintf(stderr, "Failed to write pack file: %s\n", pack_filename);
+        return 1;
+    }
+    if (log_level >= LOG_NORMAL) fprintf(info_stream, "Pack: %zu entries %s %s (%u entries, %llu bytes)\n", new_entries,
+            old_entries ? "appended to" : "written to", pack_filename, (unsigned)total_entries,
+            (unsigned long long)(toc_offset + total_entries * PACK_ENTRY_SIZE));
+    return 0;
+}
+
+// Read a list file with one input file name per line. Empty lines and lines starting with '#' are ignored.
+// The returned text buffer owns the name strings; names are appended to *names (grown as needed).
+// "-" reads the list from stdin.
+char* read_list_file(const char* list_filename, const char*** names, size_t* num_names, size_t* cap_names) {
+    int from_stdin = strcmp(list_filename, "-") == 0;
+    FILE* f = from_stdin ? stdin : fopen(list_filename, "rb");
+    if (!f) return NULL;
+    InputFile in;
+    int failed = read_input_stdio(f, &in);
+    if (!from_stdin) fclose(f);
+    if (failed) return NULL;
+    char* text = (char*)realloc((void*)in.data, in.size + 1);
+    if (!text) { free((void*)in.data); return NULL; }
+    text[in.size] = '\0';
+
+    char* line = text;
+    while (*line) {
+        char* end = line;
+        while (*end && *end != '\n' && *end != '\r') end++;
+        char* next = *end ? end + 1 : end;
+        *end = '\0';
+        // trim surrounding blanks
+        while (*line == ' ' || *line == '\t') line++;
+        char* tail = line + strlen(line);
+        while (tail > line && (tail[-1] == ' ' || tail[-1] == '\t')) *--tail = '\0';
+        if (*line && *line != '#') {
+            if (*num_names == *cap_names) {
+                size_t cap = *cap_names ? *cap_names * 2 : 64;
+                const char** tmp = (const char**)realloc((void*)*names, cap * sizeof(const char*));
+                if (!tmp) break;
+                *names = tmp;
+                *cap_names = cap;
+            }
+            (*names)[(*num_names)++] = line;
+        }
+        line = next;
+    }
+    return text;
+}
+
+int main(int argc, char* argv[]) {
+    // "-o -" sends the bitplane data to stdout, so all messages go to stderr
+    info_stream = stdout;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc && strcmp(argv[i + 1], "-") == 0) info_stream = stderr;
+        if (strcmp(argv[i], "-q") == 0) log_level = LOG_QUIET;
+        if (strcmp(argv[i], "-v") == 0) log_level = LOG_VERBOSE;
+    }
+    if (log_level >= LOG_VERBOSE || argc < 2) fprintf(info_stream, "IFF to Amiga BPL converter (c) Kane/Sct 2025\n");
+    if (argc < 2) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    const char* output_name = NULL;
+    ConvertOptions opts = {0};
+    int num_threads = 0;
+    int serve = 0, option;
+    const char** inputs = NULL;
+    size_t num_inputs = 0, cap_inputs = 0;
+    char* list_text = NULL;
+
+    // Parse command line arguments
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0) {
+            if (i + 1 < argc) {
+                output_name = argv[++i];
+            } else {
+                fprintf(stderr, "Error: -o option requires an output filename\n");
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else if ((option = parse_convert_option(NULL, argc, argv, &i, &opts)) != 0) {
+            if (option < 0) return 1;
+        } else if (strcmp(argv[i], "--serve") == 0) {
+            serve = 1;
+        } else if ((strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "-pa") == 0) && i + 1 < argc) {
+            opts.pack_append = strcmp(argv[i], "-pa") == 0;
+            opts.pack_filename = argv[++i];
+        } else if (strcmp(argv[i], "-q") == 0 || strcmp(argv[i], "-v") == 0) {
+            // message level, already set above
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            num_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+            if (list_text) {
+                fprintf(stderr, "Error: only one -l list file is supported\n");
+                return 1;
+            }
+            list_text = read_list_file(argv[++i], &inputs, &num_inputs, &cap_inputs);
+            if (!list_text) {
+                fprintf(stderr, "Error: failed to read list file: %s\n", argv[i]);
+                return 1;
+            }
+        } else {
+            if (num_inputs == cap_inputs) {
+                size_t cap = cap_inputs ? cap_inputs * 2 : 16;
+                const char** tmp = (const char**)realloc((void*)inputs, cap * sizeof(const char*));
+                if (!tmp) {
+                    fprintf(stderr, "Out of memory\n");
+                    return 1;
+                }
+                inputs = tmp;
+                cap_inputs = cap;
+            }
+            inputs[num_inputs++] = argv[i];
+        }
+    }
+
+    if (serve) {
+        // Server mode: the command line options are the defaults of every request
+        if (num_inputs || output_name || opts.pack_filename || info_stream == stderr) {
+            fprintf(stderr, "Error: --serve takes its inputs from the requests, not with input files, -o, -p or -pa\n");
+            free((void*)inputs);
+            free(list_text);
+            return 1;
+        }
+        return run_server(&opts, num_threads > 0 ? num_threads : cpu_count());
+    }
+
+    if (num_inputs == 0) {
+        fprintf(stderr, "Error: No input file specified\n");
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    if (opts.info && (opts.palette_set_colours || opts.pack_filename)) {
+        fprintf(stderr, "Error: --info cannot be combined with -ps, -p or -pa\n");
+        free((void*)inputs);
+        free(list_text);
+        return 1;
+    }
+
+    if ((opts.rect_w || opts.tile_w) && (opts.info || opts.palette_set_colours)) {
+        fprintf(stderr, "Error: -rect and -tiles cannot be combined with --info or -ps\n");
+        free((void*)inputs);
+        free(list_text);
+        return 1;
+    }
+
+    if (opts.tile_w && opts.pack_filename) {
+        fprintf(stderr, "Error: -tiles cannot be used with a pack file (-rect can)\n");
+        free((void*)inputs);
+        free(list_text);
+        return 1;
+    }
+
+    if ((opts.write_mask || opts.sprites) && opts.pack_filename) {
+        fprintf(stderr, "Error: -m and -spr cannot be used with a pack file (packs have no mask or sprite section)\n");
+        free((void*)inputs);
+        free(list_text);
+        return 1;
+    }
+
+    if (opts.palette_set_colours && (opts.streaming || opts.pack_filename)) {
+        fprintf(stderr, "Error: -ps cannot be combined with -s, -p or -pa\n");
+        free((void*)inputs);
+        free(list_text);
+        return 1;
+    }
+
+    if (info_stream == stderr) {
+        if (opts.create_chunky || opts.create_chunky_doubled || opts.create_noninterleaved) {
+            fprintf(stderr, "Error: -o - writes only the bitplane data, it cannot be combined with -c, -cd or -ni\n");
+            free((void*)inputs);
+            free(list_text);
+            return 1;
+        }
+        set_binary_mode(stdout);
+    }
+    if (num_inputs == 1 && !output_name && !opts.info && strcmp(inputs[0], "-") == 0) {
+        fprintf(stderr, "Error: -o is required when reading from stdin\n");
+        free((void*)inputs);
+        free(list_text);
+        return 1;
+    }
+
+    if (opts.pack_filename && info_stream == stderr) {
+        fprintf(stderr, "Error: -o - cannot be used with a pack file\n");
+        free((void*)inputs);
+        free(list_text);
+        return 1;
+    }
+
+    int ret;
+    if (num_inputs == 1 && !opts.pack_filename) {
+        // A single image can use the threads for its BODY (batch mode keeps them busy with whole files)
+        opts.decode_threads = num_threads > 0 ? num_threads : cpu_count();
+        ret = convert_file(inputs[0], output_name, &opts, NULL, NULL, NULL);
+    } else {
+        // Batch mode; a pack file is also built this way for a single input
+        if (output_name && num_inputs > 1) {
+            fprintf(stderr, "Error: -o cannot be used with more than one input file\n");
+            free((void*)inputs);
+            free(list_text);
+            return 1;
+        }
+        ConvertJob* jobs = (ConvertJob*)calloc(num_inputs, sizeof(ConvertJob));
+        if (!jobs) {
+            fprintf(stderr, "Out of memory\n");
+            free((void*)inputs);
+            free(list_text);
+            return 1;
+        }
+        for (size_t i = 0; i < num_inputs; i++) {
+            if (num_inputs > 1 && strcmp(inputs[i], "-") == 0) {
+                fprintf(stderr, "Error: - (stdin) can only be used as the only input file\n");
+                free(jobs);
+                free((void*)inputs);
+                free(list_text);
+                return 1;
+            }
+            jobs[i].input_filename = inputs[i];
+            jobs[i].output_name = output_name;
+        }
+        if (num_threads <= 0) num_threads = cpu_count();
+        int failed = run_batch(jobs, num_inputs, &opts, num_threads);
+        if (num_inputs > 1 && log_level >= LOG_NORMAL) {
+            fprintf(info_stream, "Batch: %zu files %s, %d failed\n", num_inputs - (size_t)failed,
+                    opts.info ? "read" : "converted", failed);
+        }
+        ret = failed ? 1 : 0;
+        if (opts.pack_filename) {
+            if (write_pack(opts.pack_filename, opts.pack_append, jobs, num_inputs) != 0) ret = 1;
+            for (size_t i = 0; i < num_inputs; i++) free_products(&jobs[i].products);
+        }
+        free(jobs);
+    }
+
+    free((void*)inputs);
+    free(list_text);
+    return ret;
+}
@@ -12,188 +12,187 @@
         -i            Input bitplane rows are interleaved in memory (row0_plane0,row0_plane1,...). If omitted the input is expected to be non-interleaved (all rows of plane0, then plane1, ...)
         -t <colwidth> Input data is stored in byte-columns of specified width and must be transposed before conversion. Each column contains <colwidth> bytes per row; transpose reorders bytes to rows.
         -r            Compress the BODY chunk using PackBits (RLE). When omitted the BODY is written uncompressed.
-        -o <output>   Base name for the output file (the program will append ".iff" if missing) (required)
-        <input_file>  Path to the raw input file containing planar data
+        -r2           As -r, but with the slower compression-optimal encoder (smallest possible BODY)
+        -ri           With -r/-r2, also write a BIDX chunk in front of the BODY holding the offset of every
+                      compressed scanline, so iff2bpl can decode any row range directly and large images in
+                      parallel (other IFF readers skip the chunk)
+        -j <threads>  Number of threads used for PackBits compression (default: number of CPU cores)
+        -o <output>   Base name for the output file (the program will append ".iff" if missing) (required).
+                      "-" writes the IFF to stdout (messages go to stderr)
+        -q            Quiet: print only errors and warnings (and the --stats line)
+        -v            Verbose: also print the palette found and the PackBits savings
+        --stats       Print one JSON line with the time and bytes of every stage (read, interleave, encode, write, cache)
+        --cache <dir> Reuse the IFF of an earlier conversion of the same input with the same options from <dir>,
+                      and store new conversions there
+        <input_file>  Path to the raw input file containing planar data, "-" reads stdin
+        --serve       Server mode: convert the requests read from stdin until its end, as iff2bpl --serve.
+                      A request is one line "<id> [options] -o <output> <input_file>", or "<id> [options]
+                      -o <output> -data <size>" followed by <size> bytes of inline input, with the options
+                      above; those of the command line are the defaults. Requests are converted one at a
+                      time, the answer is "<id> <message>" lines ("<id> ! <message>" for errors and
+                      warnings) and "<id> done <result>" (0 = success) on stdout.
 
     Notes:
         - CMAP: the generated palette contains 2^n entries (where n is the number of bitplanes).
                         If a palette is found at the end of the raw file, then it is used.
                         Otherwise the first entry is set to RGB 00,00,00 and the remaining entries are set to FF,FF,FF.
+                        With more than 8 bitplanes (deep ILBM: 24 = RGB, 32 = RGBA) no CMAP is written.
 
     Examples:
         bpl2iff -x 320 -y 256 -n 5 -o image.raw.iff input.bpl
         bpl2iff -x 16 -y 4 -n 1 -t 1 -o test.iff tests/test_input.bin
         bpl2iff -x 320 -y 200 -n 4 -r -o compressed.iff input.bpl
+        cat input.bpl | bpl2iff -x 320 -y 256 -n 5 -r -o - - | iff2bpl -c -o image -
 
     Compile:
-        gcc bpl2iff.c -o bpl2iff.exe
+        gcc bpl2iff.c libiffbpl.c convcache.c -o bpl2iff.exe
+        (on Linux/macOS add -pthread: gcc bpl2iff.c libiffbpl.c convcache.c -pthread -o bpl2iff)
 
     Copyright (c) 2025 Kane/Suspect, provided under the GNU GPLv3 License.
 */
 
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 
-#pragma pack(push,1)
-typedef struct {
-    uint16_t width;
-    uint16_t height;
-    uint16_t x;
-    uint16_t y;
-    uint8_t numPlanes;
-    uint8_t masking;
-    uint8_t compression;
-    uint8_t pad1;
-    uint16_t transparentColor;
-    uint8_t xAspect;
-    uint8_t yAspect;
-    uint16_t pageWidth;
-    uint16_t pageHeight;
-} BMHD;
-#pragma pack(pop)
-
-// write 32-bit BE
-void write_be32(FILE* f, uint32_t v) {
-    uint8_t b[4];
-    b[0] = (v >> 24) & 0xFF;
-    b[1] = (v >> 16) & 0xFF;
-    b[2] = (v >> 8) & 0xFF;
-    b[3] = v & 0xFF;
-    fwrite(b,1,4,f);
-}
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
 
-// write 16-bit BE
-void write_be16(FILE* f, uint16_t v) {
-    uint8_t b[2];
-    b[0] = (v >> 8) & 0xFF;
-    b[1] = v & 0xFF;
-    fwrite(b,1,2,f);
-}
+#include "libiffbpl.h"
+#include "convcache.h"
 
-void usage(const char* prog) {
-    fprintf(stderr, "Usage: %s -x <xsize> -y <ysize> -n <bplnum> [-i] [-t <colwidth>] [-r] -o <output_name> <input_file>\n", prog);
-}
+#define WRITE_BLOCK_BYTES (64 * 1024) // target size of one fwrite of an uncompressed BODY
 
-// PackBits (ILBM RLE) encoder: compress src_len bytes into dynamically allocated buffer, returns size and sets out_len
-uint8_t* packbits_encode(const uint8_t* src, size_t src_len, size_t* out_len) {
-    // Worst case size is src_len + src_len/128 + 1, allocate conservatively
-    size_t max_out = src_len + (src_len / 128) + 16;
-    uint8_t* out = (uint8_t*)malloc(max_out);
-    if (!out) return NULL;
-    size_t si = 0, di = 0;
-    while (si < src_len) {
-        // find run of repeated bytes
-        size_t run_len = 1;
-        while (si + run_len < src_len && src[si] == src[si + run_len] && run_len < 128) run_len++;
-        if (run_len >= 3) {
-            // emit any pending literals before the run
-            // but in this simple loop just emit run directly
-            out[di++] = (uint8_t)(1 - run_len); // n = -(run_len-1) in signed byte -> 1-run_len as unsigned
-            out[di++] = src[si];
-            si += run_len;
-        } else {
-            // emit literal sequence up to 128 bytes or until a run of 3+ starts
-            size_t lit_start = si;
-            size_t lit_len = 0;
-            while (si < src_len && lit_len < 128) {
-                // peek ahead to see if a run of 3 starts
-                if (si + 2 < src_len && src[si] == src[si+1] && src[si] == src[si+2]) break;
-                si++; lit_len++;
-            }
-            out[di++] = (uint8_t)(lit_len - 1); // n = lit_len-1
-            memcpy(out + di, src + lit_start, lit_len);
-            di += lit_len;
-        }
-    }
-    *out_len = di;
-    // shrink buffer
-    uint8_t* shr = (uint8_t*)realloc(out, di);
-    if (shr) out = shr;
-    return out;
+// Stages timed for --stats. Reordering the input into BODY scanlines is fused with the stage that consumes
+// them: it is "interleave" for an uncompressed BODY and part of the (threaded) "encode" stage with -r.
+enum { STAGE_READ, STAGE_INTERLEAVE, STAGE_ENCODE, STAGE_WRITE, STAGE_CACHE, NUM_STAGES };
+static const char* const stage_names[NUM_STAGES] = { "read", "interleave", "encode", "write", "cache" };
+
+// Switch stdin/stdout to binary mode when they carry image data ("-" file names)
+static void set_binary_mode(FILE* f) {
+#ifdef _WIN32
+    _setmode(_fileno(f), _O_BINARY);
+#else
+    (void)f;
+#endif
 }
 
-// decode PackBits into dst, returns number of bytes written (or 0 on error)
-size_t packbits_decode(const uint8_t* src, size_t src_len, uint8_t* dst, size_t dst_len) {
-    size_t si = 0, di = 0;
-    while (si < src_len && di < dst_len) {
-        int8_t n = (int8_t)src[si++];
-        if (n >= 0) {
-            int count = n + 1;
-            if (si + count > src_len) return 0;
-            if (di + count > dst_len) return 0;
-            memcpy(dst + di, src + si, count);
-            si += count; di += count;
-        } else if (n != -128) {
-            int count = (-n) + 1;
-            if (si >= src_len) return 0;
-            if (di + count > dst_len) return 0;
-            uint8_t v = src[si++];
-            memset(dst + di, v, count);
-            di += count;
-        }
-        // n == -128 -> NOP
+// Options of a conversion. In server mode (--serve) those of the command line are the defaults of
+// every request.
+typedef struct {
+    int xsize, ysize, bplnum;
+    int interleaved;
+    int transpose_col_width; // -t, the input is transposed if above 0
+    int use_rle; // 1 = -r, 2 = -r2
+    int row_index; // -ri
+    int num_threads; // 0 = number of CPU cores
+    int print_stats;
+    int verbosity; // 0 = -q, 1 = default, 2 = -v
+    const char* cache_dir;
+} RawOptions;
+
+// Destination of the messages of a conversion: 'out' (stdout, or stderr when the IFF goes to stdout)
+// and stderr for errors and warnings. In server mode ('id' set) they are "<id> <message>" lines on
+// stdout, "<id> ! <message>" for errors and warnings.
+typedef struct {
+    FILE* out;
+    const char* id;
+} Messages;
+
+static void msg_print(const Messages* m, int error, const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    if (m->id) {
+        fprintf(stdout, error ? "%s ! " : "%s ", m->id);
+        vfprintf(stdout, fmt, ap);
+    } else {
+        vfprintf(error ? stderr : m->out, fmt, ap);
     }
-    return di;
+    va_end(ap);
 }
 
-int main(int argc, char* argv[]) {
-    if (argc < 2) {
-        usage(argv[0]);
-        return 1;
-    }
+// fread() of at most *left bytes (the size of an inline input), *left is reduced by the bytes read
+static size_t read_input(void* buf, size_t len, FILE* f, size_t* left) {
+    size_t n = fread(buf, 1, len < *left ? len : *left, f);
+    *left -= n;
+    return n;
+}
 
-    int xsize = -1, ysize = -1, bplnum = -1;
-    int interleaved = 0;
-    int transpose_cols = 0;
-    int transpose_col_width = 0;
-    int use_rle = 0;
-    const char* outname = NULL;
-    const char* infile = NULL;
+void usage(const char* prog) {
+    fprintf(stderr, "Usage: %s -x <xsize> -y <ysize> -n <bplnum> [-i] [-t <colwidth>] [-r | -r2] [-ri] [-j <threads>] [-q | -v] [--stats] [--cache <dir>] -o <output_name> <input_file>\n", prog);
+    fprintf(stderr, "       %s --serve [options]\n", prog);
+}
 
-    for (int i = 1; i < argc; i++) {
-        if (strcmp(argv[i], "-x") == 0 && i+1 < argc) {
-            xsize = atoi(argv[++i]);
-        } else if (strcmp(argv[i], "-y") == 0 && i+1 < argc) {
-            ysize = atoi(argv[++i]);
-        } else if (strcmp(argv[i], "-n") == 0 && i+1 < argc) {
-            bplnum = atoi(argv[++i]);
-        } else if (strcmp(argv[i], "-i") == 0) {
-            interleaved = 1;
-        } else if (strcmp(argv[i], "-t") == 0 && i+1 < argc) {
-            transpose_col_width = atoi(argv[++i]);
-            if (transpose_col_width > 0) transpose_cols = 1;
-        } else if (strcmp(argv[i], "-r") == 0) {
-            use_rle = 1;
-        } else if (strcmp(argv[i], "-o") == 0 && i+1 < argc) {
-            outname = argv[++i];
-        } else if (argv[i][0] == '-') {
-            fprintf(stderr, "Unknown option: %s\n", argv[i]);
-            usage(argv[0]);
-            return 1;
-        } else {
-            infile = argv[i];
-        }
+// Parse the conversion option at argv[*i] (advancing *i past its value). Returns 1 if it is one, 0 if not.
+static int parse_raw_option(int argc, char** argv, int* i, RawOptions* o) {
+    const char* arg = argv[*i];
+    int has_value = *i + 1 < argc;
+    if (strcmp(arg, "-x") == 0 && has_value) {
+        o->xsize = atoi(argv[++*i]);
+    } else if (strcmp(arg, "-y") == 0 && has_value) {
+        o->ysize = atoi(argv[++*i]);
+    } else if (strcmp(arg, "-n") == 0 && has_value) {
+        o->bplnum = atoi(argv[++*i]);
+    } else if (strcmp(arg, "-i") == 0) {
+        o->interleaved = 1;
+    } else if (strcmp(arg, "-t") == 0 && has_value) {
+        o->transpose_col_width = atoi(argv[++*i]);
+    } else if (strcmp(arg, "-r") == 0) {
+        o->use_rle = 1;
+    } else if (strcmp(arg, "-r2") == 0) {
+        o->use_rle = 2;
+    } else if (strcmp(arg, "-ri") == 0) {
+        o->row_index = 1;
+    } else if (strcmp(arg, "-j") == 0 && has_value) {
+        o->num_threads = atoi(argv[++*i]);
+    } else if (strcmp(arg, "-q") == 0) {
+        o->verbosity = 0;
+    } else if (strcmp(arg, "-v") == 0) {
+        o->verbosity = 2;
+    } else if (strcmp(arg, "--stats") == 0) {
+        o->print_stats = 1;
+    } else if (strcmp(arg, "--cache") == 0 && has_value) {
+        o->cache_dir = argv[++*i];
+    } else {
+        return 0;
     }
+    return 1;
+}
 
-    if (xsize <= 0 || ysize <= 0 || bplnum <= 0 || outname == NULL || infile == NULL) {
-        fprintf(stderr, "Some mandatory parameters missing\n");
-        usage(argv[0]);
-        return 1;
-    }
+// Convert the raw planar input 'infile' ("-" = stdin) to the ILBM file 'outname' ("-" = stdout). If 'inf'
+// is given the input is instead read from it, at most *in_left bytes (the inline input of a server
+// request), and *in_left is reduced by the bytes read. Returns 0 on success.
+static int convert_raw(const RawOptions* o, const char* infile, FILE* inf, size_t* in_left, const char* outname,
+                       const Messages* m) {
+    int xsize = o->xsize, ysize = o->ysize, bplnum = o->bplnum;
+    int interleaved = o->interleaved;
+    int transpose_col_width = o->transpose_col_width;
+    int transpose_cols = transpose_col_width > 0;
+    int use_rle = o->use_rle;
+    int row_index = o->row_index;
+    int num_threads = o->num_threads > 0 ? o->num_threads : cpu_count();
+    int print_stats = o->print_stats;
+    int verbosity = o->verbosity;
+    const char* cache_dir = o->cache_dir;
+
+
+    int to_stdout = strcmp(outname, "-") == 0;
 
     // Ensure output name ends with .iff
     char outfilename[1024];
-    strncpy(outfilename, outname, sizeof(outfilename)-1);
+    strncpy(outfilename, to_stdout ? "<stdout>" : outname, sizeof(outfilename)-1);
     outfilename[sizeof(outfilename)-1] = '\0';
     size_t olen = strlen(outfilename);
-    if (olen < 4 || strcmp(outfilename+olen-4, ".iff") != 0) {
+    if (!to_stdout && (olen < 4 || strcmp(outfilename+olen-4, ".iff") != 0)) {
         strncat(outfilename, ".iff", sizeof(outfilename)-olen-1);
     }
 
     // compute expected input size
-    size_t row_bytes = ((xsize + 15) / 16) * 2; // bytes per row per plane (word-aligned as ILBM expects)
+    size_t row_bytes = ilbm_row_bytes((uint16_t)xsize); // bytes per row per plane (word-aligned as ILBM expects)
     size_t bytes_per_row_min = (xsize + 7) / 8; // minimal bytes per row (no word padding)
     size_t columns = 0; // number of byte-columns per row (transpose works on these bytes)
     size_t plane_input_size;
@@ -206,76 +205,93 @@ int main(int argc, char* argv[]) {
         // expect input rows padded to Amiga word boundary
         plane_input_size = row_bytes * ysize;
     }
-    size_t plane_size = row_bytes * ysize; // final plane size after padding rows to word boundary
     size_t expected_size = plane_input_size * bplnum;
     
     // Check if file might contain a color map at the end
-    uint32_t num_colors = 1u << bplnum;
-    if (num_colors > 256) num_colors = 256;
+    // A deep ILBM (more than 8 planes, 24 = RGB, 32 = RGBA) stores its colours in the pixels and has no CMAP
+    uint32_t num_colors = bplnum <= 8 ? 1u << bplnum : 0;
     size_t palette_size = num_colors * 2; // 2 bytes per color in Amiga format
     size_t expected_size_with_palette = expected_size + palette_size;
     int has_custom_palette = 0;
     uint16_t* custom_palette = NULL;
 
-    FILE* inf = fopen(infile, "rb");
+    StageStats st;
+    stats_init(&st, stage_names, NUM_STAGES);
+    st.width = xsize;
+    st.height = ysize;
+    st.planes = bplnum;
+    st.compression = use_rle ? 1 : 0;
+
+    double t0 = time_seconds();
+    // "-" reads the input from stdin
+    size_t unlimited = SIZE_MAX;
+    int from_stdin = inf || strcmp(infile, "-") == 0;
     if (!inf) {
-        fprintf(stderr, "Failed to open input file: %s\n", infile);
-        return 1;
+        if (from_stdin) set_binary_mode(stdin);
+        inf = from_stdin ? stdin : fopen(infile, "rb");
+        in_left = &unlimited;
     }
-    // get size
-    fseek(inf, 0, SEEK_END);
-    long fsize = ftell(inf);
-    fseek(inf, 0, SEEK_SET);
-
-    // Check if file contains custom palette
-    if (fsize == (long)expected_size_with_palette) {
-        has_custom_palette = 1;
-    } else if (fsize == (long)expected_size) {
-        has_custom_palette = 0;
-    } else {
-        fprintf(stderr, "Input file size mismatch: expected %zu bytes (or %zu with palette), got %ld\n", 
-                expected_size, expected_size_with_palette, fsize);
-        fclose(inf);
+    if (!inf) {
+        msg_print(m, 1, "Failed to open input file: %s\n", infile);
         return 1;
     }
 
-    uint8_t* data = (uint8_t*)malloc(expected_size);
+    // All buffers of the conversion come from one arena block sized from the geometry: the input, the
+    // palette and the FORM (with -r/-r2, and the scanline offsets with -ri) or the write block; they are
+    // released together.
+    size_t num_scanlines = (size_t)ysize * (size_t)bplnum;
+    size_t cmap_bytes = (size_t)num_colors * 3;
+    size_t header_size = row_index ? ILBM_INDEXED_HEADER_SIZE(cmap_bytes, num_scanlines) : ILBM_HEADER_SIZE(cmap_bytes);
+    size_t block_cap = header_size + WRITE_BLOCK_BYTES + row_bytes + 1;
+    size_t form_cap = header_size + encode_body_bound(row_bytes, num_scanlines) + 1;
+    Arena arena = {0};
+    arena_reserve(&arena, ARENA_SIZE(expected_size_with_palette) + ARENA_SIZE(palette_size) +
+                          ARENA_SIZE(use_rle ? form_cap : block_cap) +
+                          (row_index ? ARENA_SIZE(num_scanlines * sizeof(size_t) + 1) : 0));
+
+    // The input is read sequentially without seeking, so it can be a pipe. Its size decides whether a
+    // palette is appended; anything beyond the largest valid size is only counted for the error message.
+    uint8_t* data = (uint8_t*)arena_alloc(&arena, expected_size_with_palette);
     if (!data) {
-        fprintf(stderr, "Out of memory\n");
-        fclose(inf);
+        msg_print(m, 1, "Out of memory\n");
+        if (!from_stdin) fclose(inf);
+        arena_free(&arena);
         return 1;
     }
+    size_t fsize = read_input(data,expected_size_with_palette,inf,in_left);
+    if (fsize == expected_size_with_palette) {
+        uint8_t extra[4096];
+        size_t n;
+        while ((n = read_input(extra,sizeof(extra),inf,in_left)) > 0) fsize += n;
+    }
+    if (!from_stdin) fclose(inf);
 
-    if (fread(data,1,expected_size,inf) != expected_size) {
-        fprintf(stderr, "Failed to read input file\n");
-        free(data);
-        fclose(inf);
+    // Check if file contains custom palette
+    if (palette_size && fsize == expected_size_with_palette) {
+        has_custom_palette = 1;
+    } else if (fsize == expected_size) {
+        has_custom_palette = 0;
+    } else {
+        msg_print(m, 1, "Input file size mismatch: expected %zu bytes (or %zu with palette), got %zu\n", 
+                expected_size, expected_size_with_palette, fsize);
+        arena_free(&arena);
         return 1;
     }
     
     // Read custom palette if present
     if (has_custom_palette) {
-        custom_palette = (uint16_t*)malloc(palette_size);
+        custom_palette = (uint16_t*)arena_alloc(&arena, palette_size);
         if (!custom_palette) {
-            fprintf(stderr, "Out of memory (palette)\n");
-            free(data);
-            fclose(inf);
-            return 1;
-        }
-        // Read palette as bytes and convert to big-endian uint16_t
-        uint8_t* palette_bytes = (uint8_t*)custom_palette;
-        if (fread(palette_bytes, 1, palette_size, inf) != palette_size) {
-            fprintf(stderr, "Failed to read palette data\n");
-            free(custom_palette);
-            free(data);
-            fclose(inf);
+            msg_print(m, 1, "Out of memory (palette)\n");
+            arena_free(&arena);
             return 1;
         }
         // Convert from big-endian bytes to host uint16_t
+        const uint8_t* palette_bytes = data + expected_size;
         for (uint32_t i = 0; i < num_colors; i++) {
             custom_palette[i] = ((uint16_t)palette_bytes[i*2] << 8) | palette_bytes[i*2 + 1];
         }
-        printf("Found palette with %u colours at index %zu in the file.\n", num_colors, expected_size);
+        if (verbosity >= 2) msg_print(m, 0, "Found palette with %u colours at index %zu in the file.\n", num_colors, expected_size);
         // printf("Palette: ");
         // for (uint32_t i = 0; i < num_colors; i++) {
         //     printf("%04X", custom_palette[i]);
@@ -283,25 +299,39 @@ int main(int argc, char* argv[]) {
         // }
         // printf("\n");
     }
-    fclose(inf);
-
-    // Prepare output file
-    FILE* out = fopen(outfilename, "wb");
-    if (!out) {
-        fprintf(stderr, "Failed to open output file: %s\n", outfilename);
-        free(data);
-        return 1;
+    stats_add(&st, STAGE_READ, t0, (uint64_t)fsize);
+
+    // The key covers the input bytes (with any palette) and every option that changes the IFF; -j does not
+    char cache_key_str[CACHE_KEY_SIZE];
+    if (cache_dir) {
+        char key_options[128];
+        CacheManifest manifest;
+        t0 = time_seconds();
+        snprintf(key_options, sizeof(key_options), "bpl2iff x=%d y=%d n=%d i=%d t=%d r=%d%s",
+                 xsize, ysize, bplnum, interleaved, transpose_col_width, use_rle, row_index ? " ri=1" : "");
+        cache_key(key_options, data, fsize, cache_key_str);
+        st.cache = cache_lookup(cache_dir, cache_key_str, &manifest);
+        if (st.cache) {
+            if (to_stdout) set_binary_mode(stdout);
+            int failed = cache_fetch(cache_dir, cache_key_str, "iff", to_stdout ? NULL : outfilename, stdout);
+            stats_add(&st, STAGE_CACHE, t0, (uint64_t)fsize);
+            arena_free(&arena);
+            if (failed) {
+                msg_print(m, 1, "Failed to write output file: %s\n", outfilename);
+                return 1;
+            }
+            if (verbosity >= 1) msg_print(m, 0, "Restored from cache: %s (%llu bytes)\n", outfilename, (unsigned long long)manifest.size[0]);
+            if (print_stats) {
+                char json[2048];
+                stats_format_json(&st, "bpl2iff", infile, json, sizeof(json));
+                msg_print(m, 0, "%s\n", json);
+            }
+            return 0;
+        }
+        stats_add(&st, STAGE_CACHE, t0, 0);
     }
 
-    // Write FORM header with placeholder size, then patch it later
-    fwrite("FORM",1,4,out);
-    write_be32(out, 0); // placeholder for FORM size
-    fwrite("ILBM",1,4,out);
-
-    // Prepare BMHD chunk
-    // BMHD chunk is 20 bytes
-    fwrite("BMHD",1,4,out);
-    write_be32(out, 20);
+    // BMHD (compression 0 = none, 1 = PackBits)
     BMHD bmhd;
     memset(&bmhd,0,sizeof(bmhd));
     bmhd.width = xsize;
@@ -310,7 +340,7 @@ int main(int argc, char* argv[]) {
     bmhd.y = 0;
     bmhd.numPlanes = (uint8_t)bplnum;
     bmhd.masking = 0; // none
-    bmhd.compression = 0; // no compression
+    bmhd.compression = use_rle ? 1 : 0;
     bmhd.pad1 = 0;
     bmhd.transparentColor = 0;
     bmhd.xAspect = 1;
@@ -318,233 +348,266 @@ int main(int argc, char* argv[]) {
     bmhd.pageWidth = xsize;
     bmhd.pageHeight = ysize;
 
-    // BMHD fields must be big-endian when written. Write each field explicitly.
-    write_be16(out, bmhd.width);
-    write_be16(out, bmhd.height);
-    write_be16(out, bmhd.x);
-    write_be16(out, bmhd.y);
-    fwrite(&bmhd.numPlanes,1,1,out);
-    fwrite(&bmhd.masking,1,1,out);
-    fwrite(&bmhd.compression,1,1,out);
-    fwrite(&bmhd.pad1,1,1,out);
-    write_be16(out, bmhd.transparentColor);
-    fwrite(&bmhd.xAspect,1,1,out);
-    fwrite(&bmhd.yAspect,1,1,out);
-    write_be16(out, bmhd.pageWidth);
-    write_be16(out, bmhd.pageHeight);
-
-    // CMAP chunk
+    // CMAP
     size_t cmap_size = num_colors * 3;
-    fwrite("CMAP",1,4,out);
-    write_be32(out, (uint32_t)cmap_size);
-    
+    uint8_t cmap[256 * 3];
     if (has_custom_palette && custom_palette) {
         // Use custom palette from file
         // Format is 0RGB: first byte = 0000RRRR, second byte = GGGGBBBB
-        int palette_warning_shown = 0;
         for (uint32_t i = 0; i < num_colors; i++) {
             uint16_t color = custom_palette[i];
             // Check if the leading 4 bits are zero (valid 0RGB format)
-            if ((color & 0xF000) != 0 && !palette_warning_shown) {
-                fprintf(stderr, "Warning: Color %u has non-zero leading bits (0x%04X). Palette format might be incorrect.\n", i, color);
-                palette_warning_shown = 1;
+            if ((color & 0xF000) != 0) {
+                msg_print(m, 1, "Warning: Color %u has non-zero leading bits (0x%04X). Palette format might be incorrect.\n", i, color);
+                break;
             }
-            // Extract 4-bit components and expand to 8-bit
-            uint8_t r = ((color >> 8) & 0x0F) * 17; // 0x0F -> 0xFF (multiply by 17)
-            uint8_t g = ((color >> 4) & 0x0F) * 17;
-            uint8_t b = (color & 0x0F) * 17;
-            uint8_t rgb[3] = {r, g, b};
-            fwrite(rgb, 1, 3, out);
         }
+        palette_to_cmap(custom_palette, num_colors, cmap);
     } else {
         // Default palette: first color black, others white
-        for (uint32_t i = 0; i < num_colors; i++) {
-            if (i == 0) {
-                uint8_t rgb[3] = {0x00,0x00,0x00};
-                fwrite(rgb,1,3,out);
-            } else {
-                uint8_t rgb[3] = {0xFF,0xFF,0xFF};
-                fwrite(rgb,1,3,out);
-            }
-        }
-    }
-    // pad CMAP to even size
-    if ((cmap_size & 1) != 0) {
-        uint8_t zero = 0;
-        fwrite(&zero,1,1,out);
+        memset(cmap, 0xFF, cmap_size);
+        memset(cmap, 0x00, 3);
     }
 
-    // Write BODY later after preparing plane buffers to optionally compress with RLE.
+    // BODY must be interleaved regardless of input layout. Every scanline is gathered straight from the
+    // input data (padded to 'row_bytes') and either copied to the output or fed to the encoder.
+    PlanarInput src;
+    memset(&src, 0, sizeof(src));
+    src.data = data;
+    src.height = (size_t)ysize;
+    src.planes = (size_t)bplnum;
+    src.row_bytes = row_bytes;
+    src.in_row_bytes = bytes_per_row_min;
+    src.plane_input_size = plane_input_size;
+    if (transpose_cols) {
+        src.layout = LAYOUT_COLUMNS;
+        src.col_width = (size_t)transpose_col_width;
+        src.columns = columns;
+    } else {
+        src.layout = interleaved ? LAYOUT_INTERLEAVED : LAYOUT_NONINTERLEAVED;
+    }
 
-    // Must produce interleaved data in BODY regardless of input layout.
-    // Normalize input into per-plane buffers where each row is padded to 'row_bytes'.
-    uint8_t* plane_buffers = (uint8_t*)malloc((size_t)bplnum * plane_size);
-    if (!plane_buffers) {
-        fprintf(stderr, "Out of memory (plane buffers)\n");
-        free(data);
-        fclose(out);
+    // All chunk sizes are known before the first byte is written, so the file is written front to back
+    // in large blocks without seeking back to patch sizes.
+    if (to_stdout) set_binary_mode(stdout);
+    FILE* out = to_stdout ? stdout : fopen(outfilename, "wb");
+    if (!out) {
+        msg_print(m, 1, "Failed to open output file: %s\n", outfilename);
+        arena_free(&arena);
         return 1;
     }
-
-    if (transpose_cols) {
-        // Input layout per plane: column-major bytes: for c=0..columns-1, for y=0..ysize-1, for b=0..transpose_col_width-1 -> byte
-        // Transpose bytes: dst_row[y][c*transpose_col_width + b] = src_plane[(c*ysize + y)*transpose_col_width + b]
-        for (int p = 0; p < bplnum; p++) {
-            uint8_t* dst_plane = plane_buffers + (size_t)p * plane_size;
-            uint8_t* src_plane = data + (size_t)p * plane_input_size;
-            // Zero destination plane
-            memset(dst_plane, 0, plane_size);
-            for (size_t c = 0; c < columns; c++) {
-                for (int y = 0; y < ysize; y++) {
-                    for (int b = 0; b < transpose_col_width; b++) {
-                        size_t sidx = (c * (size_t)ysize + (size_t)y) * (size_t)transpose_col_width + (size_t)b;
-                        if (sidx >= plane_input_size) continue;
-                        uint8_t val = src_plane[sidx];
-                        size_t didx = (size_t)y * row_bytes + c * (size_t)transpose_col_width + (size_t)b;
-                        if (didx < plane_size) dst_plane[didx] = val;
-                    }
-                }
+    size_t form_size = 0;
+    int write_failed = 0;
+    if (use_rle) {
+        // Compressed: the whole FORM is built in one buffer (the BODY is encoded in place behind the
+        // header) and written with a single fwrite
+        size_t greedy_size = 0;
+        t0 = time_seconds();
+        uint8_t* form = (uint8_t*)arena_alloc(&arena, form_cap);
+        if (form && row_index) {
+            // The encoder returns the offset of every scanline, which fills the BIDX chunk of the header
+            size_t* offsets = (size_t*)arena_alloc(&arena, num_scanlines * sizeof(size_t) + 1);
+            size_t body_size = offsets ? encode_body_into(&src, num_threads, use_rle == 2, form + header_size, offsets,
+                                                          &greedy_size) : (size_t)-1;
+            form_size = body_size;
+            if (body_size != (size_t)-1) {
+                ilbm_store_header_indexed(&bmhd, cmap, cmap_size, offsets, num_scanlines, body_size, form);
+                form_size = header_size + body_size;
+                if (body_size & 1) form[form_size++] = 0;
             }
-            // rows are padded automatically since dst_plane was zeroed
+        } else if (form) {
+            form_size = ilbm_build_into(&bmhd, cmap, cmap_size, &src, num_threads, use_rle == 2, form, &greedy_size);
         }
+        stats_add(&st, STAGE_ENCODE, t0, row_bytes * num_scanlines);
+        if (!form || form_size == (size_t)-1) {
+            msg_print(m, 1, "Out of memory (packed buffer)\n");
+            arena_free(&arena);
+            fclose(out);
+            return 1;
+        }
+        if (use_rle == 2) {
+            size_t packed_size = form_size - header_size - (form_size & 1);
+            if (verbosity >= 2) msg_print(m, 0, "Optimal PackBits: BODY %zu bytes, %zu bytes smaller than greedy (%zu bytes)\n",
+                                        packed_size, greedy_size - packed_size, greedy_size);
+        }
+        if (row_index && verbosity >= 2) {
+            msg_print(m, 0, "Row index: BIDX chunk with the offsets of %zu scanlines (%zu bytes)\n", num_scanlines,
+                    BODY_INDEX_SIZE(num_scanlines));
+        }
+        t0 = time_seconds();
+        write_failed = fwrite(form,1,form_size,out) != form_size;
+        stats_add(&st, STAGE_WRITE, t0, form_size);
     } else {
-        // No transpose requested. Input layout may be interleaved or per-plane sequential (non-interleaved).
-        if (interleaved) {
-            // Input is interleaved rows per plane already but may have minimal bytes per row or padded rows.
-            // Read row-by-row from input and write into plane_buffers, expanding to padded row_bytes if necessary.
-            size_t in_row_bytes = bytes_per_row_min;
-            size_t src_offset = 0;
-            for (int y = 0; y < ysize; y++) {
-                for (int p = 0; p < bplnum; p++) {
-                    uint8_t* dst = plane_buffers + (size_t)p * plane_size + (size_t)y * row_bytes;
-                    uint8_t* src = data + src_offset;
-                    memcpy(dst, src, in_row_bytes);
-                    // zero pad remainder of the row if row_bytes > in_row_bytes
-                    if (row_bytes > in_row_bytes) memset(dst + in_row_bytes, 0, row_bytes - in_row_bytes);
-                    src_offset += in_row_bytes;
-                }
-            }
-        } else {
-            // Input is non-interleaved: plane0 rows..., plane1 rows...
-            for (int p = 0; p < bplnum; p++) {
-                uint8_t* src_plane = data + (size_t)p * plane_input_size;
-                uint8_t* dst_plane = plane_buffers + (size_t)p * plane_size;
-                // For each row, copy minimal bytes and pad to row_bytes
-                for (int y = 0; y < ysize; y++) {
-                    size_t sidx = (size_t)y * bytes_per_row_min;
-                    size_t didx = (size_t)y * row_bytes;
-                    memcpy(dst_plane + didx, src_plane + sidx, bytes_per_row_min);
-                    if (row_bytes > bytes_per_row_min) memset(dst_plane + didx + bytes_per_row_min, 0, row_bytes - bytes_per_row_min);
-                }
-            }
+        // Uncompressed: the header and the scanlines are gathered into fixed size blocks, so memory use
+        // does not grow with the image size
+        size_t body_size = row_bytes * num_scanlines;
+        uint8_t* block = (uint8_t*)arena_alloc(&arena, block_cap);
+        ScanlineReader reader;
+        if (!block || reader_init(&reader, &src) != 0) {
+            msg_print(m, 1, "Out of memory (body buffer)\n");
+            arena_free(&arena);
+            fclose(out);
+            return 1;
         }
+        size_t fill = ilbm_store_header(&bmhd, cmap, cmap_size, body_size, block);
+        size_t r = 0;
+        do {
+            t0 = time_seconds();
+            size_t start = fill;
+            for (; r < num_scanlines && fill < WRITE_BLOCK_BYTES; r++) {
+                memcpy(block + fill, read_scanline(&reader, r), row_bytes);
+                fill += row_bytes;
+            }
+            stats_add(&st, STAGE_INTERLEAVE, t0, fill - start);
+            if (r == num_scanlines && (body_size & 1)) block[fill++] = 0; // pad BODY chunk to even size
+            t0 = time_seconds();
+            write_failed |= fwrite(block,1,fill,out) != fill;
+            stats_add(&st, STAGE_WRITE, t0, fill);
+            form_size += fill;
+            fill = 0;
+        } while (r < num_scanlines);
+        reader_free(&reader);
     }
-
-    // Assemble interleaved BODY into a contiguous buffer
-    size_t body_uncomp_size = row_bytes * (size_t)ysize * (size_t)bplnum;
-    uint8_t* body_uncomp = (uint8_t*)malloc(body_uncomp_size);
-    if (!body_uncomp) {
-        fprintf(stderr, "Out of memory (body buffer)\n");
-        free(plane_buffers);
-        free(data);
-        fclose(out);
+    t0 = time_seconds();
+    if ((to_stdout ? fflush(out) : fclose(out)) != 0) write_failed = 1;
+    stats_add(&st, STAGE_WRITE, t0, 0);
+    arena_free(&arena);
+    if (write_failed) {
+        msg_print(m, 1, "Failed to write output file: %s\n", outfilename);
         return 1;
     }
-    size_t bo = 0;
-    for (int y = 0; y < ysize; y++) {
-        for (int p = 0; p < bplnum; p++) {
-            uint8_t* src = plane_buffers + (size_t)p * plane_size + (size_t)y * row_bytes;
-            memcpy(body_uncomp + bo, src, row_bytes);
-            bo += row_bytes;
+
+    if (verbosity >= 1) msg_print(m, 0, "Wrote ILBM file: %s (size %zu bytes)\n", outfilename, form_size);
+    if (cache_dir && !to_stdout) {
+        const char* ext = "iff";
+        const char* src = outfilename;
+        t0 = time_seconds();
+        if (cache_store(cache_dir, cache_key_str, &ext, &src, 1) != 0) {
+            msg_print(m, 1, "Warning: failed to store %s in the cache %s\n", outfilename, cache_dir);
         }
+        stats_add(&st, STAGE_CACHE, t0, form_size);
     }
+    if (print_stats) {
+        char json[2048];
+        stats_format_json(&st, "bpl2iff", infile, json, sizeof(json));
+        msg_print(m, 0, "%s\n", json);
+    }
+    return 0;
+}
 
-    // Write BODY chunk (optionally RLE compressed)
-    if (use_rle) bmhd.compression = 1; else bmhd.compression = 0;
-
-    // encode if requested
-    uint8_t* body_to_write = body_uncomp;
-    size_t body_to_write_size = body_uncomp_size;
-    uint8_t* packed = NULL;
-    size_t packed_size = 0;
-    if (use_rle) {
-        // Compress each scanline (for each row y and plane p) separately and concatenate.
-        size_t est_cap = body_uncomp_size + (body_uncomp_size / 128) + 16;
-        packed = (uint8_t*)malloc(est_cap);
-        if (!packed) {
-            fprintf(stderr, "Out of memory (packed buffer)\n");
-            free(body_uncomp);
-            free(plane_buffers);
-            free(data);
-            fclose(out);
+// Check and convert one request "<id> [options] -o output_name <input>" or "<id> [options] -o output_name
+// -data <size>" (followed by <size> bytes of inline input, *data_left of which are still unread)
+static int serve_request(const RawOptions* defaults, int argc, char** args, size_t* data_left, const Messages* m) {
+    RawOptions o = *defaults;
+    const char* outname = NULL;
+    const char* infile = NULL;
+    int has_data = 0;
+    for (int i = 1; i < argc; i++) {
+        if (parse_raw_option(argc, args, &i, &o)) continue;
+        if (strcmp(args[i], "-o") == 0 && i + 1 < argc) {
+            outname = args[++i];
+        } else if (strcmp(args[i], "-data") == 0 && i + 1 < argc) {
+            i++;
+            has_data = 1;
+        } else if (!infile && (args[i][0] != '-' || args[i][1] == '\0')) {
+            infile = args[i];
+        } else {
+            msg_print(m, 1, "Error: unexpected argument %s\n", args[i]);
             return 1;
         }
-        packed_size = 0;
-        for (int y = 0; y < ysize; y++) {
-            for (int p = 0; p < bplnum; p++) {
-                uint8_t* seg = body_uncomp + ((size_t)y * (size_t)bplnum + (size_t)p) * row_bytes;
-                size_t enc_len = 0;
-                uint8_t* enc = packbits_encode(seg, row_bytes, &enc_len);
-                if (!enc) {
-                    fprintf(stderr, "RLE compression failed (row %d plane %d)\n", y, p);
-                    free(packed);
-                    free(body_uncomp);
-                    free(plane_buffers);
-                    free(data);
-                    fclose(out);
-                    return 1;
-                }
-                // ensure capacity
-                if (packed_size + enc_len > est_cap) {
-                    est_cap = (packed_size + enc_len) * 2;
-                    uint8_t* tmp = (uint8_t*)realloc(packed, est_cap);
-                    if (!tmp) { free(enc); free(packed); free(body_uncomp); free(plane_buffers); free(data); fclose(out); return 1; }
-                    packed = tmp;
-                }
-                memcpy(packed + packed_size, enc, enc_len);
-                packed_size += enc_len;
-                free(enc);
-            }
-        }
-        // shrink packed
-        uint8_t* shr = (uint8_t*)realloc(packed, packed_size);
-        if (shr) packed = shr;
-        body_to_write = packed;
-        body_to_write_size = packed_size;
     }
+    const char* error = NULL;
+    if (has_data != (*data_left > 0)) error = "Error: -data must be given with the size of the inline input\n";
+    else if (!has_data && !infile) error = "Error: no input file in the request\n";
+    else if (has_data && infile) error = "Error: a request has either an input file or -data\n";
+    else if (!outname) error = "Error: no output name (-o) in the request\n";
+    else if (infile && strcmp(infile, "-") == 0) error = "Error: stdin carries the requests, use -data for inline input\n";
+    else if (strcmp(outname, "-") == 0) error = "Error: stdout carries the responses, -o - cannot be used\n";
+    else if (o.xsize <= 0 || o.ysize <= 0 || o.bplnum <= 0) error = "Error: -x, -y and -n are required\n";
+    else if (o.row_index && !o.use_rle) error = "Error: -ri needs -r or -r2\n";
+    if (error) {
+        msg_print(m, 1, "%s", error);
+        return 1;
+    }
+    return has_data ? convert_raw(&o, "<inline>", stdin, data_left, outname, m) : convert_raw(&o, infile, NULL, NULL, outname, m);
+}
+
+// Serve requests read from stdin until its end, one at a time; the answers go to stdout
+static int run_server(const RawOptions* defaults) {
+    char line[SERVE_MAX_LINE];
+    char* args[SERVE_MAX_ARGS];
+    set_binary_mode(stdin);
+    set_binary_mode(stdout);
+    for (;;) {
+        size_t data_left;
+        int status = serve_read_request(stdin, line, &data_left);
+        if (status == SERVE_REQUEST_EOF) break;
+        int argc = serve_split_request(line, args, SERVE_MAX_ARGS);
+        if (argc == 0 && status == SERVE_REQUEST_OK) continue; // empty line
+        Messages m = { stdout, argc > 0 ? args[0] : "?" };
+        int result = 1;
+        if (status == SERVE_REQUEST_TOO_LONG) msg_print(&m, 1, "Error: request line too long\n");
+        else if (status == SERVE_REQUEST_BAD_SIZE) msg_print(&m, 1, "Error: invalid -data size, closing the session\n");
+        else if (argc < 0) msg_print(&m, 1, "Error: too many arguments\n");
+        else result = serve_request(defaults, argc, args, &data_left, &m);
+        serve_skip(stdin, data_left); // what a failed request left of its inline input
+        fprintf(stdout, "%s done %d\n", m.id, result);
+        fflush(stdout);
+        if (status == SERVE_REQUEST_BAD_SIZE) break;
+    }
+    return 0;
+}
 
-    // Write BODY chunk header and data
-    fwrite("BODY",1,4,out);
-    write_be32(out, (uint32_t)body_to_write_size);
-    fwrite(body_to_write,1,body_to_write_size,out);
-    // pad BODY chunk to even size
-    if (body_to_write_size & 1) {
-        uint8_t zero = 0;
-        fwrite(&zero,1,1,out);
-        body_to_write_size++;
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        usage(argv[0]);
+        return 1;
     }
 
-    // cleanup
-    if (packed) free(packed);
-    free(body_uncomp);
-    free(plane_buffers);
+    RawOptions opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.xsize = opts.ysize = opts.bplnum = -1;
+    opts.verbosity = 1;
+    int serve = 0;
+    const char* outname = NULL;
+    const char* infile = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (parse_raw_option(argc, argv, &i, &opts)) continue;
+        if (strcmp(argv[i], "-o") == 0 && i+1 < argc) {
+            outname = argv[++i];
+        } else if (strcmp(argv[i], "--serve") == 0) {
+            serve = 1;
+        } else if (argv[i][0] == '-' && argv[i][1] != '\0') {
+            fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            usage(argv[0]);
+            return 1;
+        } else {
+            infile = argv[i];
+        }
+    }
 
-    // Record end of file now, before moving file pointer to update BMHD
-    long endpos = ftell(out);
-    uint32_t form_size = (uint32_t)(endpos - 8);
+    if (serve) {
+        // Server mode: the command line options are the defaults of every request
+        if (outname || infile) {
+            fprintf(stderr, "Error: --serve takes its inputs and outputs from the requests, not with -o or input files\n");
+            return 1;
+        }
+        return run_server(&opts);
+    }
 
-    // Update BMHD.compression field in file: compression is at offset 30 (start of file + 30)
-    fseek(out, 30, SEEK_SET);
-    uint8_t comp_byte = (use_rle ? 1 : 0);
-    fwrite(&comp_byte,1,1,out);
+    if (opts.xsize <= 0 || opts.ysize <= 0 || opts.bplnum <= 0 || outname == NULL || infile == NULL) {
+        fprintf(stderr, "Some mandatory parameters missing\n");
+        usage(argv[0]);
+        return 1;
+    }
 
-    // Patch FORM size using the recorded endpos
-    fseek(out, 4, SEEK_SET);
-    write_be32(out, form_size);
-    fclose(out);
-    if (custom_palette) free(custom_palette);
-    free(data);
+    if (opts.row_index && !opts.use_rle) {
+        fprintf(stderr, "-ri needs -r or -r2 (the rows of an uncompressed BODY are found from the row size)\n");
+        return 1;
+    }
 
-    printf("Wrote ILBM file: %s (size %u bytes)\n", outfilename, form_size + 8);
-    return 0;
+    // "-o -" writes the IFF to stdout; messages then go to stderr
+    Messages m = { strcmp(outname, "-") == 0 ? stderr : stdout, NULL };
+    return convert_raw(&opts, infile, NULL, NULL, outname, &m);
 }
@@ -0,0 +1,208 @@
+/*
+    convcache - on-disk conversion cache and server requests shared by iff2bpl and bpl2iff, see convcache.h
+
+    Copyright (c) 2025 Kane/Suspect, provided under the GNU GPLv3 License.
+*/
+
+#include "convcache.h"
+#include "libiffbpl.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <direct.h>
+#include <process.h>
+#define cache_mkdir(d) _mkdir(d)
+#define cache_getpid() _getpid()
+#else
+#include <unistd.h>
+#define cache_mkdir(d) mkdir(d, 0777)
+#define cache_getpid() getpid()
+#endif
+
+void cache_key(const char* options, const uint8_t* data, size_t len, char key[CACHE_KEY_SIZE]) {
+    char tagged[512];
+    snprintf(tagged, sizeof(tagged), "%s cache=%d", options, CACHE_VERSION);
+    uint64_t h = hash64(data, len, hash64(tagged, strlen(tagged), 0));
+    snprintf(key, CACHE_KEY_SIZE, "%016llx", (unsigned long long)h);
+}
+
+static void entry_path(char* out, size_t size, const char* dir, const char* key, const char* ext) {
+    snprintf(out, size, "%s/%s.%s", dir, key, ext);
+}
+
+// Replace dst by src (rename() does not replace existing files on Windows)
+static int replace_file(const char* src, const char* dst) {
+#ifdef _WIN32
+    return MoveFileExA(src, dst, MOVEFILE_REPLACE_EXISTING) ? 0 : 1;
+#else
+    return rename(src, dst) != 0;
+#endif
+}
+
+static int copy_stream(FILE* in, FILE* out) {
+    uint8_t buf[64 * 1024];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+        if (fwrite(buf, 1, n, out) != n) return 1;
+    }
+    return ferror(in) ? 1 : 0;
+}
+
+int cache_lookup(const char* dir, const char* key, CacheManifest* m) {
+    char path[1024];
+    memset(m, 0, sizeof(*m));
+    entry_path(path, sizeof(path), dir, key, "idx");
+    FILE* f = fopen(path, "r");
+    if (!f) return 0;
+    char ext[8];
+    unsigned long long size;
+    while (m->count < CACHE_MAX_PRODUCTS && fscanf(f, "%7s %llu", ext, &size) == 2) {
+        strcpy(m->ext[m->count], ext);
+        m->size[m->count] = size;
+        m->count++;
+    }
+    fclose(f);
+    // Every product must still be there, a partly cleaned cache directory is a miss
+    for (int i = 0; i < m->count; i++) {
+        struct stat st;
+        entry_path(path, sizeof(path), dir, key, m->ext[i]);
+        if (stat(path, &st) != 0 || (uint64_t)st.st_size != m->size[i]) return 0;
+    }
+    return m->count > 0;
+}
+
+int cache_fetch(const char* dir, const char* key, const char* ext, const char* dst_path, FILE* dst) {
+    char path[1024];
+    entry_path(path, sizeof(path), dir, key, ext);
+    FILE* in = fopen(path, "rb");
+    if (!in) return 1;
+    FILE* out = dst_path ? fopen(dst_path, "wb") : dst;
+    if (!out) {
+        fclose(in);
+        return 1;
+    }
+    int failed = copy_stream(in, out);
+    fclose(in);
+    if (dst_path) failed |= fclose(out) != 0;
+    else failed |= fflush(out) != 0;
+    return failed;
+}
+
+int cache_store(const char* dir, const char* key, const char* const* exts, const char* const* src_paths, int count) {
+    char path[1024], tmp[1100];
+    struct stat st;
+    if (count <= 0 || count > CACHE_MAX_PRODUCTS) return 1;
+    if (stat(dir, &st) != 0) cache_mkdir(dir);
+    char manifest[CACHE_MAX_PRODUCTS * 32];
+    size_t manifest_len = 0;
+    int failed = 0;
+    for (int i = 0; i < count && !failed; i++) {
+        // Temporary names are unique per process and output file, so parallel stores do not collide
+        entry_path(path, sizeof(path), dir, key, exts[i]);
+        snprintf(tmp, sizeof(tmp), "%s.%d-%08x.tmp", path, (int)cache_getpid(),
+                 (unsigned)hash64(src_paths[i], strlen(src_paths[i]), 0));
+        FILE* in = fopen(src_paths[i], "rb");
+        FILE* out = in ? fopen(tmp, "wb") : NULL;
+        failed = !out || copy_stream(in, out);
+        if (in) fclose(in);
+        if (out) failed |= fclose(out) != 0;
+        if (!failed) failed = stat(tmp, &st) != 0 || replace_file(tmp, path);
+        if (failed) remove(tmp);
+        else manifest_len += (size_t)snprintf(manifest + manifest_len, sizeof(manifest) - manifest_len, "%.7s %llu\n",
+                                              exts[i], (unsigned long long)st.st_size);
+    }
+    if (!failed) {
+        // The manifest is written last: it makes the entry visible
+        entry_path(path, sizeof(path), dir, key, "idx");
+        snprintf(tmp, sizeof(tmp), "%s.%d-%08x.tmp", path, (int)cache_getpid(),
+                 (unsigned)hash64(src_paths[0], strlen(src_paths[0]), 0));
+        FILE* out = fopen(tmp, "wb");
+        failed = !out || fwrite(manifest, 1, manifest_len, out) != manifest_len;
+        if (out) failed |= fclose(out) != 0;
+        if (!failed) failed = replace_file(tmp, path);
+        if (failed) remove(tmp);
+    }
+    return failed;
+}
+
+// Finds the size of the first " -data <size>" of a request line, fed one character at a time and
+// '\0' at the end of the line
+typedef struct {
+    size_t matched; // characters of " -data " matched so far
+    int state;      // 0 = searching, 1 = reading the size, 2 = size read, 3 = not a valid size
+    int digits;
+    size_t size;
+} DataSize;
+
+static void data_size_feed(DataSize* d, int c) {
+    static const char option[] = " -data ";
+    if (d->state == 0) {
+        d->matched = c == option[d->matched] ? d->matched + 1 : c == ' ';
+        if (d->matched == sizeof(option) - 1) d->state = 1;
+    } else if (d->state == 1) {
+        if (c >= '0' && c <= '9' && d->size <= (SIZE_MAX - 9) / 10) {
+            d->size = d->size * 10 + (size_t)(c - '0');
+            d->digits++;
+        } else if (c == ' ' || c == '\t' || c == '\r' || c == '\0') {
+            if (d->digits) d->state = 2;
+            else if (c == '\0' || c == '\r') d->state = 3;
+        } else {
+            d->state = 3;
+        }
+    }
+}
+
+int serve_read_request(FILE* f, char* line, size_t* data_size) {
+    *data_size = 0;
+    if (!fgets(line, SERVE_MAX_LINE, f)) return SERVE_REQUEST_EOF;
+    size_t len = strlen(line);
+    int too_long = len && line[len - 1] != '\n' && !feof(f);
+    while (len && (line[len - 1] == '\n' || line[len - 1] == '\r')) line[--len] = '\0';
+    DataSize d;
+    memset(&d, 0, sizeof(d));
+    for (size_t i = 0; i < len; i++) data_size_feed(&d, (unsigned char)line[i]);
+    if (too_long) {
+        // The rest of the line is dropped, but a -data in it still frames the inline input to skip
+        int ch;
+        while ((ch = fgetc(f)) != EOF && ch != '\n') data_size_feed(&d, ch);
+    }
+    data_size_feed(&d, '\0');
+    if (d.state == 3) return SERVE_REQUEST_BAD_SIZE;
+    if (too_long) {
+        serve_skip(f, d.size);
+        return SERVE_REQUEST_TOO_LONG;
+    }
+    *data_size = d.size;
+    return SERVE_REQUEST_OK;
+}
+
+int serve_split_request(char* line, char** args, int max_args) {
+    int n = 0;
+    char* c = line;
+    for (;;) {
+        while (*c == ' ' || *c == '\t') c++;
+        if (*c == '\0') return n;
+        if (n == max_args) return -1;
+        if (*c == '"') {
+            args[n++] = ++c;
+            while (*c && *c != '"') c++;
+        } else {
+            args[n++] = c;
+            while (*c && *c != ' ' && *c != '\t') c++;
+        }
+        if (*c == '\0') return n;
+        *c++ = '\0';
+    }
+}
+
+void serve_skip(FILE* f, size_t len) {
+    uint8_t buf[4096];
+    while (len > 0) {
+        size_t n = len < sizeof(buf) ? len : sizeof(buf);
+        if (fread(buf, 1, n, f) != n) break;
+        len -= n;
+    }
+}
@@ -0,0 +1,88 @@
+/*
+    convcache - on-disk conversion cache shared by iff2bpl and bpl2iff (--cache <dir>)
+
+    A cache entry is keyed by a 64-bit hash of the input bytes and of a string naming the tool and
+    every option that changes its output. An entry consists of one file per product,
+    <dir>/<key>.<ext> (for example .bpl, .pal, .chk, .bpf or .iff), and a manifest <dir>/<key>.idx
+    listing the products and their sizes. The manifest is written last, so an interrupted store is
+    a miss, not a corrupt hit. Restored products are copies: the tools overwrite existing output
+    files in place, which would damage hard linked cache files.
+
+    It also reads the requests of the server mode of both tools (--serve): a request is one line of
+    arguments, and "-data <size>" in it announces <size> bytes of inline input that follow the line.
+
+    Unlike libiffbpl this is file I/O code, used by the command line tools only.
+
+    Copyright (c) 2025 Kane/Suspect, provided under the GNU GPLv3 License.
+*/
+
+#ifndef CONVCACHE_H
+#define CONVCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Bump when the output of a tool changes for the same input and options, to invalidate old entries
+#define CACHE_VERSION 1
+
+#define CACHE_MAX_PRODUCTS 8
+#define CACHE_KEY_SIZE 17 // 16 hex digits and NUL
+
+// Key of an input: 'options' names the tool, CACHE_VERSION is added automatically
+void cache_key(const char* options, const uint8_t* data, size_t len, char key[CACHE_KEY_SIZE]);
+
+// Products of an entry as listed in its manifest
+typedef struct {
+    int count;
+    char ext[CACHE_MAX_PRODUCTS][8];
+    uint64_t size[CACHE_MAX_PRODUCTS];
+} CacheManifest;
+
+// Look up an entry. Returns 1 on a hit (every product file exists with the size from the manifest),
+// 0 on a miss.
+int cache_lookup(const char* dir, const char* key, CacheManifest* m);
+
+// Copy product 'ext' of an entry to the file dst_path, or to 'dst' if dst_path is NULL (e.g. stdout).
+// Returns 0 on success.
+int cache_fetch(const char* dir, const char* key, const char* ext, const char* dst_path, FILE* dst);
+
+// Store the files src_paths[i] as products exts[i] of an entry, then write its manifest. The cache
+// directory is created if needed. Products are written under temporary names and renamed, so
+// concurrent stores of the same key are safe. Returns 0 on success.
+int cache_store(const char* dir, const char* key, const char* const* exts, const char* const* src_paths, int count);
+
+#define SERVE_MAX_LINE 4096
+#define SERVE_MAX_ARGS 64
+
+// Result of serve_read_request()
+enum {
+    SERVE_REQUEST_OK,       // 'line' holds the request
+    SERVE_REQUEST_EOF,      // end of the input
+    SERVE_REQUEST_TOO_LONG, // the request was skipped with its inline input, 'line' holds its start (the id)
+    SERVE_REQUEST_BAD_SIZE  // the -data size is not a number, so the end of the inline input and the
+                            // requests after it cannot be found
+};
+
+// Read one server request line from 'f' into 'line' (SERVE_MAX_LINE bytes), without the line end.
+// *data_size is the size given with -data, 0 without: the caller reads or skips those bytes before
+// the next request.
+int serve_read_request(FILE* f, char* line, size_t* data_size);
+
+// Split a request line into arguments at spaces and tabs, "double quotes" group an argument with
+// spaces (no escapes). The arguments point into 'line', which is modified. Returns the count, -1 if
+// there are more than max_args.
+int serve_split_request(char* line, char** args, int max_args);
+
+// Read and drop 'len' bytes of 'f', for example the inline input of a rejected request
+void serve_skip(FILE* f, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CONVCACHE_H
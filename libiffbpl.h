@@ -0,0 +1,612 @@
+/*
+    libiffbpl - ILBM and Amiga bitplane conversion routines shared by iff2bpl and bpl2iff
+
+    All functions work on buffers in memory: no file I/O, no console output and no global state,
+    so they can be linked into other programs (asset servers, editors) and called from several threads
+    at once. The command line tools are thin file/option front ends over this library.
+
+    Bitplane data is "interleaved" (ILBM BODY order: row 0 of every plane, then row 1, ...) unless stated
+    otherwise. Rows are padded to a 16-bit word boundary: ilbm_row_bytes(width) bytes per row per plane.
+
+    Typical use (decode an ILBM held in memory):
+        IlbmImage img;
+        if (ilbm_parse(data, size, &img) == IFFBPL_OK) {
+            uint8_t* planar = malloc(ilbm_body_planar_size(&img.bmhd));
+            ilbm_decode_body(&img, planar, NULL);
+            convert_to_chunky(planar, ilbm_planar_size(&img.bmhd), chunky, img.bmhd.width, ...);
+        }
+
+    Compile: add libiffbpl.c to the gcc command line (on Linux/macOS also -pthread).
+
+    Copyright (c) 2025 Kane/Suspect, provided under the GNU GPLv3 License.
+*/
+
+#ifndef LIBIFFBPL_H
+#define LIBIFFBPL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Result codes
+enum {
+    IFFBPL_OK = 0,
+    IFFBPL_ERR_FORMAT, // not a FORM ILBM
+    IFFBPL_ERR_NO_BMHD, // BMHD chunk missing or too short
+    IFFBPL_ERR_NO_BODY, // BODY chunk missing
+    IFFBPL_ERR_COMPRESSION, // unsupported BMHD compression
+    IFFBPL_ERR_MEMORY
+};
+
+#pragma pack(push, 1)
+typedef struct {
+    uint16_t width;
+    uint16_t height;
+    uint16_t x;
+    uint16_t y;
+    uint8_t numPlanes;
+    uint8_t masking;
+    uint8_t compression;
+    uint8_t pad1;
+    uint16_t transparentColor;
+    uint8_t xAspect;
+    uint8_t yAspect;
+    uint16_t pageWidth;
+    uint16_t pageHeight;
+} BMHD;
+#pragma pack(pop)
+
+#define BMHD_SIZE 20 // size of the BMHD chunk data in the file
+#define MSK_HAS_MASK 1 // BMHD masking: every row of the BODY ends with one mask scanline after the planes
+
+// ---------------------------------------------------------------------------------------------
+// Byte order and ILBM chunks
+// ---------------------------------------------------------------------------------------------
+
+uint32_t get_be32(const uint8_t* b);
+uint16_t get_be16(const uint8_t* b);
+void put_be32(uint8_t* b, uint32_t v);
+void put_be16(uint8_t* b, uint16_t v);
+
+// Decode / encode the 20 byte big-endian BMHD chunk data
+void parse_bmhd(const uint8_t* p, BMHD* bmhd);
+void store_bmhd(const BMHD* bmhd, uint8_t* p);
+
+// Bytes per row per plane (rows are padded to a 16-bit word)
+static inline size_t ilbm_row_bytes(uint16_t width) { return ((size_t)(width + 15) / 16) * 2; }
+
+// Size of the decoded interleaved bitplane data of an image
+static inline size_t ilbm_planar_size(const BMHD* bmhd) {
+    return ilbm_row_bytes(bmhd->width) * bmhd->numPlanes * bmhd->height;
+}
+
+// Scanlines per row in the BODY: the planes, plus the mask plane with masking MSK_HAS_MASK
+static inline unsigned ilbm_body_planes(const BMHD* bmhd) {
+    return bmhd->numPlanes + (bmhd->masking == MSK_HAS_MASK);
+}
+
+// Size of the decoded BODY, including the mask scanlines (ilbm_planar_size() without a mask plane)
+static inline size_t ilbm_body_planar_size(const BMHD* bmhd) {
+    return ilbm_row_bytes(bmhd->width) * ilbm_body_planes(bmhd) * bmhd->height;
+}
+
+// Bytes per chunky pixel: 1 up to 8 planes, 3 for a 24 plane (RGB) and 4 for a 32 plane (RGBA) deep ILBM
+static inline size_t ilbm_chunky_pixel_bytes(unsigned num_planes) { return num_planes <= 8 ? 1 : (num_planes + 7) / 8; }
+
+// Chunks of an ILBM held in memory. cmap/body point into the parsed data; nothing is copied.
+typedef struct {
+    BMHD bmhd;
+    int found_bmhd;
+    const uint8_t* cmap;
+    size_t cmap_size;
+    const uint8_t* body;
+    size_t body_size;
+    const uint8_t* body_index; // BIDX chunk (see below), NULL if there is none
+    size_t body_index_size;
+} IlbmImage;
+
+// ANHD chunk of an ANIM frame: how its DLTA chunk changes the bitplanes
+typedef struct {
+    uint8_t operation; // 0 = full BODY, 5 = byte vertical delta, 7/8 = short/long vertical delta
+    uint8_t mask;
+    uint16_t width;
+    uint16_t height;
+    int16_t x;
+    int16_t y;
+    uint32_t abs_time; // in jiffies
+    uint32_t rel_time;
+    uint8_t interleave; // the delta applies to the frame this many frames back, 0 = 2 (double buffering)
+    uint32_t bits; // ANHD_BITS_...
+} AnimHeader;
+
+#define ANHD_SIZE 24 // bytes of the ANHD chunk data used (the chunk is 40 bytes, the rest is padding)
+#define ANHD_BITS_LONG 1 // operations 7/8: long (4 byte) instead of short (2 byte) data
+#define ANHD_BITS_XOR 2 // operation 5: XOR the data into the bitplanes instead of storing it
+
+void parse_anhd(const uint8_t* p, AnimHeader* anhd);
+
+// Parse a FORM ILBM in place. Unknown chunks are skipped; a truncated last chunk ends at the end of the
+// data. Returns IFFBPL_OK, or IFFBPL_ERR_FORMAT / IFFBPL_ERR_NO_BMHD / IFFBPL_ERR_NO_BODY (img is filled
+// with whatever was found in any case).
+int ilbm_parse(const uint8_t* data, size_t size, IlbmImage* img);
+
+// Index of the chunks of one FORM, built from the 8 byte chunk headers alone, so the caller can skip (seek
+// over) the data of every chunk it does not need. The caller does the I/O: it reads the FORM header and
+// passes it to chunk_index_begin(), then reads the chunk header at idx->next and passes it to
+// chunk_index_add() until chunk_index_done(). Offsets are from the start of the file.
+#define CHUNK_INDEX_MAX 64
+
+typedef struct {
+    char id[4];
+    uint64_t offset; // of the chunk data
+    uint32_t size; // as stored, odd sizes are followed by a pad byte
+} IffChunk;
+
+typedef struct {
+    char form_type[4]; // "ILBM", "ANIM", ...
+    uint64_t end; // offset just beyond the FORM
+    uint64_t next; // offset of the next chunk header
+    int count; // chunks stored in 'chunks'
+    int total; // chunks seen, later ones are not stored beyond CHUNK_INDEX_MAX
+    IffChunk chunks[CHUNK_INDEX_MAX];
+} ChunkIndex;
+
+// Start the index of the FORM whose 12 byte header ("FORM", size, type) is at 'offset'. Returns IFFBPL_OK,
+// or IFFBPL_ERR_FORMAT if it is not a FORM.
+int chunk_index_begin(ChunkIndex* idx, const uint8_t header[12], uint64_t offset);
+// Add the chunk whose 8 byte header was read at idx->next and advance idx->next to the following one.
+// 'chunk' (may be NULL) receives the entry, also when the index is full.
+void chunk_index_add(ChunkIndex* idx, const uint8_t header[8], IffChunk* chunk);
+// 1 when no chunk header is left in the FORM
+int chunk_index_done(const ChunkIndex* idx);
+// First indexed chunk with this id, or NULL
+const IffChunk* chunk_find(const ChunkIndex* idx, const char* id);
+
+// Decode the BODY of a parsed image into dst (ilbm_body_planar_size() bytes, interleaved; each row ends with
+// its mask scanline if the image has a mask plane, see ilbm_split_mask()). Missing or short scanlines are
+// zero padded and counted in *short_rows (may be NULL).
+// Returns IFFBPL_OK, IFFBPL_ERR_NO_BMHD, IFFBPL_ERR_NO_BODY or IFFBPL_ERR_COMPRESSION.
+int ilbm_decode_body(const IlbmImage* img, uint8_t* dst, size_t* short_rows);
+
+// BODY row index: a private "BIDX" chunk in front of the BODY of a compressed ILBM (bpl2iff -ri). It holds
+// a u32 count of scanlines (height * ilbm_body_planes()), then the u32 offset of every scanline (row y,
+// plane p at y * planes + p, the mask plane counted as the last plane) in the BODY data, all big-endian.
+// PackBits scanlines can otherwise only be found by decoding all scanlines before them; with the index any
+// row range is decoded directly and a BODY can be split across threads. Other ILBM readers skip the chunk.
+#define BODY_INDEX_ID "BIDX"
+#define BODY_INDEX_SIZE(num_rows) (4 + 4 * (size_t)(num_rows)) // chunk data bytes (always even)
+
+// Store the index of num_rows scanlines at row_offsets into out (BODY_INDEX_SIZE() bytes)
+void body_index_store(const size_t* row_offsets, size_t num_rows, uint8_t* out);
+// Check an index read from a file against the image: one entry per scanline, every offset ascending and
+// inside the BODY. Returns IFFBPL_OK, or IFFBPL_ERR_FORMAT if the index cannot be used.
+int body_index_check(const uint8_t* index, size_t index_size, const BMHD* bmhd, size_t body_size);
+// BODY offset of scanline 'scanline' in a checked index
+size_t body_index_offset(const uint8_t* index, size_t scanline);
+
+// Decode rows y0 .. y0 + num_rows - 1 (all planes and the mask) of a parsed image into dst (num_rows
+// interleaved BODY rows).
+// A compressed BODY is entered at row y0 through its BIDX index when it has a valid one, otherwise the
+// scanlines above are skipped with skip_packbits_rows(). Returns as ilbm_decode_body().
+int ilbm_decode_rows(const IlbmImage* img, size_t y0, size_t num_rows, uint8_t* dst, size_t* short_rows);
+
+// As ilbm_decode_body(), but a compressed BODY with a valid BIDX index is split into num_threads bands of
+// rows decoded in parallel (images below PARALLEL_DECODE_MIN_BYTES decoded, and images without an index,
+// are decoded on the calling thread). The result is the same.
+#define PARALLEL_DECODE_MIN_BYTES (256 * 1024) // decoded size below which threads cost more than they save
+int ilbm_decode_body_parallel(const IlbmImage* img, uint8_t* dst, size_t* short_rows, int num_threads);
+
+// Convert num_colours CMAP entries (8-bit R, G, B) to Amiga colour words (0RGB, 4 bits per gun),
+// stored big-endian in pal (2 bytes per colour) as in the .pal file.
+void cmap_to_palette(const uint8_t* cmap, size_t num_colours, uint8_t* pal);
+
+// Convert num_colours Amiga colour words to CMAP entries, expanding each gun to 8 bits (x * 17)
+void palette_to_cmap(const uint16_t* colours, size_t num_colours, uint8_t* cmap);
+
+// Palette formats (.pal file), all big-endian
+enum {
+    PAL_OCS = 0, // 2 bytes per colour: 0RGB word, 4 bits per gun (OCS/ECS colour registers)
+    PAL_AGA, // 4 bytes per colour: 0RGB word of the high nibbles, then of the low nibbles (AGA, BPLCON3 LOCT)
+    PAL_RGB32 // LoadRGB32() table: u16 count, u16 first colour (0), 3 u32 per colour (gun * 0x01010101), u32 0
+};
+
+// Bytes of one palette of num_colours colours in 'format'
+size_t palette_format_size(int format, size_t num_colours);
+
+// Convert a set of num_palettes palettes of num_colours CMAP entries each (stored back to back, e.g. fade
+// or colour cycling tables) in one call; pal receives num_palettes * palette_format_size() bytes. Built
+// with SSSE3 the OCS and AGA conversions run 16 colours per step. cmap_to_palette() is one PAL_OCS palette.
+void cmap_to_palette_set(const uint8_t* cmaps, size_t num_palettes, size_t num_colours, int format, uint8_t* pal);
+
+// Bytes of a FORM ILBM in front of the BODY data: FORM header, BMHD, CMAP (if any, padded to even size)
+// and the BODY chunk header
+#define ILBM_HEADER_SIZE(cmap_size) \
+    (12 + 8 + BMHD_SIZE + ((cmap_size) ? 8 + (((size_t)(cmap_size) + 1) & ~(size_t)1) : 0) + 8)
+
+// Store the start of a FORM ILBM whose BODY is body_size bytes long into 'out' (ILBM_HEADER_SIZE() bytes).
+// All chunk sizes, including the FORM size, are final: the BODY data and a pad byte if body_size is odd
+// follow directly, so the file can be written front to back without seeking. Returns the bytes stored.
+size_t ilbm_store_header(const BMHD* bmhd, const uint8_t* cmap, size_t cmap_size, size_t body_size, uint8_t* out);
+
+// As ILBM_HEADER_SIZE(), with a BIDX chunk of num_rows scanlines in front of the BODY chunk header
+#define ILBM_INDEXED_HEADER_SIZE(cmap_size, num_rows) (ILBM_HEADER_SIZE(cmap_size) + 8 + BODY_INDEX_SIZE(num_rows))
+
+// As ilbm_store_header(), with a BIDX chunk of the num_rows offsets at row_offsets (as returned by
+// encode_body_into()) in front of the BODY. Stores ILBM_INDEXED_HEADER_SIZE() bytes.
+size_t ilbm_store_header_indexed(const BMHD* bmhd, const uint8_t* cmap, size_t cmap_size, const size_t* row_offsets,
+                                 size_t num_rows, size_t body_size, uint8_t* out);
+
+// ---------------------------------------------------------------------------------------------
+// PackBits (ILBM compression 1)
+// ---------------------------------------------------------------------------------------------
+
+// Decompress ILBM RLE (PackBits) for a single scanline.
+// Returns the number of bytes written to dst. If src_used is not NULL it receives the number of source
+// bytes consumed. A packet that crosses the end of the scanline is clipped but consumed as a whole.
+size_t decompress_packbits(const uint8_t* src, size_t src_len, uint8_t* dst, size_t dst_len, size_t* src_used);
+
+// Decompress num_rows PackBits scanlines (row_bytes each) in one forward pass over src. Short scanlines
+// are zero padded and counted in *short_rows (may be NULL). Returns the number of source bytes consumed.
+size_t decompress_body(const uint8_t* src, size_t src_len, uint8_t* dst, size_t row_bytes, size_t num_rows,
+                       size_t* short_rows);
+
+// Skip num_rows PackBits scanlines (row_bytes each) without decoding them: only the packet headers are
+// read. Returns the number of source bytes consumed, the same as decompress_body() for these rows.
+size_t skip_packbits_rows(const uint8_t* src, size_t src_len, size_t row_bytes, size_t num_rows);
+
+// Worst case PackBits output size for src_len input bytes: one header byte per 128 literal bytes.
+// A run of 3+ bytes always saves at least the header of the literal that follows it, so a scanline of
+// row_bytes never encodes to more than row_bytes + ceil(row_bytes / 128) bytes (e.g. 40 -> 41, 128 -> 129).
+#define PACKBITS_MAX_SIZE(src_len) ((src_len) + ((src_len) + 127) / 128)
+
+// Scratch memory needed by packbits_encode_row_optimal() for src_len input bytes
+#define PACKBITS_OPTIMAL_SCRATCH(src_len) (((src_len) + 1) * (sizeof(uint32_t) + sizeof(int16_t)))
+
+// Greedy PackBits encoder: compress src_len bytes into out (PACKBITS_MAX_SIZE(src_len) bytes).
+// Returns the number of bytes written.
+size_t packbits_encode_row(const uint8_t* src, size_t src_len, uint8_t* out);
+
+// Compression-optimal PackBits encoder, see libiffbpl.c. scratch must hold PACKBITS_OPTIMAL_SCRATCH(src_len)
+// bytes. Returns the number of bytes written.
+size_t packbits_encode_row_optimal(const uint8_t* src, size_t src_len, uint8_t* out, void* scratch);
+
+// As packbits_encode_row(), into a malloc'ed buffer (shrunk to *out_len bytes). NULL if out of memory.
+uint8_t* packbits_encode(const uint8_t* src, size_t src_len, size_t* out_len);
+
+// ---------------------------------------------------------------------------------------------
+// Bitplane layouts
+// ---------------------------------------------------------------------------------------------
+
+// Convert interleaved planar data to chunky: width * ilbm_chunky_pixel_bytes(num_planes) bytes per row.
+// Up to 8 planes a pixel is one byte; in a deep image byte k of a pixel holds planes 8k .. 8k + 7, so 24
+// planes give packed RGB and 32 planes RGBA. Only rows fully contained in planar_size bytes are converted,
+// missing rows are set to 0. With double_bits (up to 8 planes only, ignored for deep images) the 4 lowest
+// planes each feed two adjacent pixel bits (-cd). Returns IFFBPL_OK, or IFFBPL_ERR_MEMORY if the
+// scanline scratch cannot be allocated (chunky_data is then all 0).
+int convert_to_chunky(const uint8_t* planar_data, size_t planar_size, uint8_t* chunky_data,
+                      uint16_t width, uint16_t height, uint8_t num_planes, int double_bits);
+
+// Reference implementation of convert_to_chunky(), one bit per plane per pixel
+void convert_to_chunky_ref(const uint8_t* planar_data, uint8_t* chunky_data,
+                           uint16_t width, uint16_t height, uint8_t num_planes, int double_bits);
+
+// Convert chunky pixels (bit p of each pixel goes to plane p, num_planes <= 8) to interleaved planar data.
+// The padding bits at the end of each row are set to 0.
+void convert_to_planar(const uint8_t* chunky_data, uint8_t* planar_data,
+                       uint16_t width, uint16_t height, uint8_t num_planes);
+
+// Copy the pixels x .. x + width - 1 of num_rows scanlines of src_row_bytes each (any layout, one scanline
+// per row of a plane) into scanlines of ilbm_row_bytes(width) bytes, so pixel x becomes pixel 0. The
+// region must lie inside the source rows; the padding bits of every destination row are set to 0.
+void crop_planar(const uint8_t* src, size_t src_row_bytes, size_t num_rows, size_t x, uint16_t width, uint8_t* dst);
+
+// Split num_rows BODY rows of an image with a mask plane (num_planes + 1 scanlines each) into the rows of
+// the planes (num_planes scanlines each) and the rows of the mask (one scanline each, or dropped if 'mask' is
+// NULL). 'planar' may be 'src', the planes are then moved up in place.
+void ilbm_split_mask(const uint8_t* src, size_t num_rows, uint16_t width, uint8_t num_planes, uint8_t* planar,
+                     uint8_t* mask);
+
+// Interleaved <-> non-interleaved (all rows of plane 0, then plane 1, ...) planar data
+void convert_to_noninterleaved(const uint8_t* interleaved_data, uint8_t* noninterleaved_data,
+                               uint16_t width, uint16_t height, uint8_t num_planes);
+void convert_to_interleaved(const uint8_t* noninterleaved_data, uint8_t* interleaved_data,
+                            uint16_t width, uint16_t height, uint8_t num_planes);
+
+// Hardware sprites: an image of up to 4 planes is cut into strips of 16 pixels, left to right. Each strip
+// is one sprite of planes 0 and 1, or with 3 or 4 planes an attached pair: the even sprite holds planes 0
+// and 1, the odd one planes 2 and 3 and has the attach bit set. A sprite is its SPRxPOS and SPRxCTL words,
+// the DATA (plane 0 or 2) and DATB (plane 1 or 3) words of every row and two 0 words ending the list, all
+// big-endian, as fetched by the sprite DMA. The sprites of an image are stored back to back.
+#define SPRITE_MAX_PLANES 4
+#define SPRITE_WIDTH 16
+static inline size_t sprite_count(uint16_t width, uint8_t num_planes) {
+    return ((size_t)width + SPRITE_WIDTH - 1) / SPRITE_WIDTH * (num_planes > 2 ? 2 : 1);
+}
+static inline size_t sprite_size(uint16_t height) { return ((size_t)height + 2) * 4; } // bytes of one sprite
+
+// Store the SPRxPOS and SPRxCTL words (4 bytes) of a sprite of 'height' rows at hardware position hstart,
+// vstart (9 bits each; VSTOP = vstart + height is stored in 9 bits as well)
+void sprite_store_control(uint16_t hstart, uint16_t vstart, uint16_t height, int attached, uint8_t* out);
+
+// Convert num_rows interleaved rows (num_planes <= SPRITE_MAX_PLANES) into the DATA/DATB word pairs of all
+// sprite_count() sprites in one pass over the rows: the rows of sprite s go to dst + s * num_rows * 4.
+void convert_to_sprites(const uint8_t* planar_data, uint16_t width, size_t num_rows, uint8_t num_planes,
+                        uint8_t* dst);
+
+// ---------------------------------------------------------------------------------------------
+// BODY encoding from raw bitplane layouts
+// ---------------------------------------------------------------------------------------------
+
+// Input bitplane layouts accepted by the BODY encoder
+enum {
+    LAYOUT_NONINTERLEAVED, // all rows of plane 0, then plane 1, ...
+    LAYOUT_INTERLEAVED, // row 0 of every plane, then row 1, ...
+    LAYOUT_COLUMNS // per plane: byte columns of col_width bytes, each column ysize rows high (bpl2iff -t)
+};
+
+// Description of the raw input data. Any BODY scanline (row y, plane p) can be gathered from it
+// directly in interleaved BODY order, so no normalised copy of the input is needed.
+typedef struct {
+    const uint8_t* data;
+    int layout;
+    size_t height;
+    size_t planes;
+    size_t row_bytes; // BODY bytes per row per plane (word aligned)
+    size_t in_row_bytes; // input bytes per row per plane (LAYOUT_INTERLEAVED, LAYOUT_NONINTERLEAVED)
+    size_t plane_input_size; // input bytes per plane (LAYOUT_NONINTERLEAVED, LAYOUT_COLUMNS)
+    size_t col_width; // LAYOUT_COLUMNS: bytes per column
+    size_t columns; // LAYOUT_COLUMNS: number of columns
+} PlanarInput;
+
+// Return BODY scanline number 'scanline' (= y * planes + p), row_bytes long. Points straight into the
+// input when it is already stored that way, otherwise the scanline is gathered and zero padded in 'line'.
+const uint8_t* get_scanline(const PlanarInput* in, size_t scanline, uint8_t* line);
+
+#define TRANSPOSE_BAND_ROWS 32 // LAYOUT_COLUMNS rows gathered at once by a ScanlineReader (multiple of 16)
+
+// Sequential scanline access. For LAYOUT_COLUMNS input whole bands of rows are transposed at once
+// (column-major reads, cache resident writes) instead of gathering every scanline from all columns separately.
+typedef struct {
+    const PlanarInput* in;
+    uint8_t* buf; // one scanline, or TRANSPOSE_BAND_ROWS interleaved rows for LAYOUT_COLUMNS
+    size_t band_y;
+    size_t band_rows;
+} ScanlineReader;
+
+int reader_init(ScanlineReader* rd, const PlanarInput* in); // returns 0 on success
+void reader_free(ScanlineReader* rd);
+const uint8_t* read_scanline(ScanlineReader* rd, size_t scanline);
+
+// Size of the arena needed by encode_body_into() for num_rows scanlines of row_bytes each
+// (num_rows = height * planes)
+size_t encode_body_bound(size_t row_bytes, size_t num_rows);
+
+// PackBits encode every BODY scanline of the input into 'arena' (encode_body_bound() bytes) using up to
+// num_threads threads. With 'optimal' the compression-optimal encoder is used and *greedy_size receives
+// the size the greedy encoder would have produced. row_offsets (height * planes entries) receives the
+// offset of every scanline. greedy_size and row_offsets may be NULL.
+// Returns the packed size, or (size_t)-1 if out of memory.
+size_t encode_body_into(const PlanarInput* src, int num_threads, int optimal,
+                        uint8_t* arena, size_t* row_offsets, size_t* greedy_size);
+
+// As encode_body_into(), but allocates the arena. Returns the packed buffer (owned by the caller and
+// shrunk to packed_size), or NULL if out of memory.
+uint8_t* encode_body(const PlanarInput* src, int num_threads, int optimal,
+                     size_t* packed_size, size_t* row_offsets, size_t* greedy_size);
+
+// Serialise a complete FORM ILBM (header, BMHD, CMAP, BODY) into one contiguous buffer. The BODY is
+// gathered from 'src', PackBits encoded (like encode_body()) if bmhd->compression is 1. Returns the
+// buffer (owned by the caller) and its size in *form_size, or NULL if out of memory.
+uint8_t* ilbm_build(const BMHD* bmhd, const uint8_t* cmap, size_t cmap_size, const PlanarInput* src,
+                    int num_threads, int optimal, size_t* form_size, size_t* greedy_size);
+
+// Size of the buffer needed by ilbm_build_into()
+size_t ilbm_build_bound(const BMHD* bmhd, size_t cmap_size, const PlanarInput* src);
+
+// As ilbm_build(), but into 'buf' of ilbm_build_bound() bytes. Returns the FORM size, or (size_t)-1 if
+// out of memory.
+size_t ilbm_build_into(const BMHD* bmhd, const uint8_t* cmap, size_t cmap_size, const PlanarInput* src,
+                       int num_threads, int optimal, uint8_t* buf, size_t* greedy_size);
+
+// ---------------------------------------------------------------------------------------------
+// ANIM frames and DLTA decoding
+// ---------------------------------------------------------------------------------------------
+
+// A FORM ANIM holds one FORM ILBM per frame. The first frame is a complete image (BMHD, CMAP, BODY); each
+// later frame has an ANHD and a DLTA chunk that change the bitplanes of an earlier frame.
+
+// One frame of an ANIM. All pointers point into the parsed data.
+typedef struct {
+    IlbmImage ilbm; // BMHD, CMAP and BODY of the frame, where present
+    AnimHeader anhd;
+    int found_anhd;
+    const uint8_t* dlta;
+    size_t dlta_size;
+} AnimFrame;
+
+// Position in a FORM ANIM held in memory
+typedef struct {
+    const uint8_t* data;
+    size_t size;
+    size_t pos;
+} AnimIter;
+
+// Start reading the frames of a FORM ANIM. Returns IFFBPL_OK, or IFFBPL_ERR_FORMAT if data is not a FORM ANIM.
+int anim_begin(const uint8_t* data, size_t size, AnimIter* it);
+
+// Parse the next frame in place. Returns 1 if a frame was found, 0 at the end of the ANIM.
+int anim_next(AnimIter* it, AnimFrame* frame);
+
+// Apply the DLTA of an ANHD operation 5, 7 or 8 frame in place to interleaved bitplanes (ilbm_planar_size()
+// bytes) holding the frame it is based on. Changes outside the image are ignored. Returns IFFBPL_OK,
+// IFFBPL_ERR_COMPRESSION for other operations (planes unchanged), or IFFBPL_ERR_FORMAT for a truncated or
+// corrupt DLTA (planes partly updated).
+int anim_apply_delta(const BMHD* bmhd, const AnimHeader* anhd, const uint8_t* dlta, size_t dlta_size, uint8_t* planes);
+
+// ---------------------------------------------------------------------------------------------
+// Asset packs
+// ---------------------------------------------------------------------------------------------
+
+// A pack file holds the products of many images (iff2bpl -p). All fields are big-endian, offsets are
+// from the start of the file and every section starts on a PACK_ALIGN boundary:
+//   header  "BPAK", u16 version, u16 TOC entry size, u32 number of entries, u32 TOC offset
+//   data    the sections of all entries
+//   TOC     one PACK_ENTRY_SIZE entry per image: name[32] (NUL padded), u16 width, u16 height,
+//           u8 planes, u8 flags, u16 colours, then u32 offset and u32 size of the bpl, pal, chk
+//           and bpf sections (size 0 = not present). The chk pixels of an image with more than 8 planes
+//           are ilbm_chunky_pixel_bytes(planes) bytes; a mask plane is not stored.
+// The TOC is at the end so images can be appended; entry i is at TOC offset + i * entry size.
+#define PACK_VERSION 1
+#define PACK_HEADER_SIZE 16
+#define PACK_ENTRY_SIZE 72
+#define PACK_NAME_SIZE 32
+#define PACK_ALIGN 8
+#define PACK_FLAG_CHUNKY_DOUBLED 1 // the chk section holds bit doubled chunky data (-cd)
+#define PACK_FLAG_PAL_AGA 2 // the pal section is in PAL_AGA format (-pf aga)
+#define PACK_FLAG_PAL_RGB32 4 // the pal section is in PAL_RGB32 format (-pf rgb32)
+
+enum { PACK_BPL, PACK_PAL, PACK_CHK, PACK_BPF, PACK_SECTIONS };
+
+typedef struct {
+    char name[PACK_NAME_SIZE];
+    uint16_t width;
+    uint16_t height;
+    uint8_t planes;
+    uint8_t flags;
+    uint16_t num_colours;
+    uint32_t offset[PACK_SECTIONS];
+    uint32_t size[PACK_SECTIONS];
+} PackEntry;
+
+void pack_store_header(uint32_t num_entries, uint32_t toc_offset, uint8_t* out); // PACK_HEADER_SIZE bytes
+void pack_store_entry(const PackEntry* e, uint8_t* out); // PACK_ENTRY_SIZE bytes
+
+// Read the header of a pack held in memory (at least PACK_HEADER_SIZE bytes). Returns IFFBPL_OK, or
+// IFFBPL_ERR_FORMAT if it is not a pack of a supported version or the TOC lies outside 'size'.
+int pack_parse_header(const uint8_t* data, size_t size, uint32_t* num_entries, uint32_t* toc_offset);
+
+// Entry 'index' of a pack held in memory. Returns IFFBPL_OK, or IFFBPL_ERR_FORMAT if the pack is invalid,
+// the index is out of range or a section of the entry lies outside 'size'.
+int pack_get_entry(const uint8_t* data, size_t size, uint32_t index, PackEntry* e);
+
+// ---------------------------------------------------------------------------------------------
+// Portable threads
+// ---------------------------------------------------------------------------------------------
+
+#ifdef _WIN32
+typedef HANDLE thread_t;
+typedef CRITICAL_SECTION mutex_t;
+#define THREAD_FUNC DWORD WINAPI
+typedef LPTHREAD_START_ROUTINE thread_func_t;
+#else
+typedef pthread_t thread_t;
+typedef pthread_mutex_t mutex_t;
+#define THREAD_FUNC void*
+typedef void* (*thread_func_t)(void*);
+#endif
+
+int thread_start(thread_t* t, thread_func_t fn, void* arg); // returns 0 on success
+void thread_join(thread_t t);
+void mutex_init(mutex_t* m);
+void mutex_destroy(mutex_t* m);
+void mutex_lock(mutex_t* m);
+void mutex_unlock(mutex_t* m);
+int cpu_count(void);
+
+// ---------------------------------------------------------------------------------------------
+// Arena allocator
+// ---------------------------------------------------------------------------------------------
+
+// Bump allocator for the buffers of one conversion: allocations are carved from one block, sized up front
+// with arena_reserve() from the image geometry, and released all at once by arena_reset() (or down to a
+// mark by arena_rewind()). An allocation that does not fit gets an overflow block of its own, so a low
+// estimate costs speed, not correctness; the next arena_reset() grows the block to the peak use, so an
+// arena reused for a batch of images settles at the size of the largest one. Not thread safe.
+// A zeroed Arena is a valid empty arena.
+typedef struct ArenaBlock ArenaBlock;
+
+typedef struct {
+    uint8_t* block; // allocated block, base aligned to ARENA_ALIGN inside it
+    uint8_t* base;
+    size_t size;
+    size_t used;
+    ArenaBlock* overflow; // allocations that did not fit, newest first
+    size_t overflow_used;
+    size_t peak; // most bytes in use at once since the last reset
+} Arena;
+
+typedef struct {
+    size_t used;
+    ArenaBlock* overflow;
+    size_t overflow_used;
+} ArenaMark;
+
+#define ARENA_ALIGN 64 // cache line, enough for any SIMD load
+#define ARENA_SIZE(n) (((size_t)(n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1)) // space taken by n bytes
+
+// Make at least 'size' bytes available in the block. Only acts on an empty arena (after arena_reset()).
+// Returns 0 on success, 1 if out of memory (allocations then use overflow blocks).
+int arena_reserve(Arena* a, size_t size);
+// Allocate n bytes aligned to ARENA_ALIGN, NULL if out of memory
+void* arena_alloc(Arena* a, size_t n);
+// Release everything allocated since the mark was taken
+ArenaMark arena_mark(const Arena* a);
+void arena_rewind(Arena* a, ArenaMark mark);
+// Release all allocations, keeping (if needed, growing) the block for the next image
+void arena_reset(Arena* a);
+void arena_free(Arena* a);
+
+// ---------------------------------------------------------------------------------------------
+// Hashing
+// ---------------------------------------------------------------------------------------------
+
+// Fast non-cryptographic 64-bit hash (the xxHash64 algorithm), several GB/s. Used to key caches on the
+// content of input files; chain calls by passing the previous result as seed.
+uint64_t hash64(const void* data, size_t len, uint64_t seed);
+
+// ---------------------------------------------------------------------------------------------
+// Stage statistics
+// ---------------------------------------------------------------------------------------------
+
+// Monotonic high resolution time in seconds, for timing stages
+double time_seconds(void);
+
+#define STATS_MAX_STAGES 16
+
+// Accumulated time and byte count of each stage of one conversion. The stage names are supplied by
+// the caller; image fields are -1 when unknown.
+typedef struct {
+    const char* const* names;
+    int num_stages;
+    double seconds[STATS_MAX_STAGES];
+    uint64_t bytes[STATS_MAX_STAGES];
+    double start; // time_seconds() at stats_init()
+    int width, height, planes, compression;
+    int cache; // conversion cache: -1 not used, 0 miss, 1 hit
+} StageStats;
+
+void stats_init(StageStats* st, const char* const* names, int num_stages);
+// Add the time since t0 (a time_seconds() value) and 'bytes' processed to a stage
+void stats_add(StageStats* st, int stage, double t0, uint64_t bytes);
+// Add the stage times and bytes of 'other' (collected by another thread, same stages) to st
+void stats_merge(StageStats* st, const StageStats* other);
+// Format the stats as a single line JSON object (no newline), total time measured up to now:
+// {"tool":..,"file":..,"width":..,"height":..,"planes":..,"compression":..,"cache":"off|miss|hit","total_s":..,
+//  "stages":{"<name>":{"s":..,"bytes":..,"mb_s":..},...}}
+// Returns the length of the full text; the output is truncated to size - 1 characters.
+size_t stats_format_json(const StageStats* st, const char* tool, const char* file, char* out, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LIBIFFBPL_H
@@ -0,0 +1,372 @@
+/*
+    Benchmark for the libiffbpl conversion kernels
+
+    Times every kernel used by iff2bpl and bpl2iff on synthetic images (random and highly compressible
+    data, sizes from 16x16 to 4096x4096, 1-8 planes) and optionally on real ILBM files, and reports
+    MB/s (of interleaved bitplane data) and CPU cycles per pixel (x86 only, from the time stamp counter).
+
+    Usage: bench [-quick] [-p planes] [-s WxH] [-t seconds] [-j threads] [file.iff ...]
+        -quick      only 320x256 and 1024x1024, planes 1, 5 and 8
+        -p planes   only this plane count (1-8)
+        -s WxH      only this image size
+        -t seconds  minimum measuring time per kernel (default 0.05)
+        -j threads  threads for encode_body (default 1)
+        file.iff    also benchmark the kernels on the image data of these files
+
+    Build (from the repository root):
+        gcc -O2 -I. tests/bench.c libiffbpl.c -o bench.exe
+        (on Linux/macOS add -pthread)
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "libiffbpl.h"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define HAVE_RDTSC 1
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC 1
+#endif
+
+static uint64_t cycles(void) {
+#ifdef HAVE_RDTSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+// One benchmark image: interleaved planar data plus everything the kernels need as input
+typedef struct {
+    uint16_t width;
+    uint16_t height;
+    uint8_t planes;
+    const char* kind;
+    size_t row_bytes;
+    size_t planar_size;
+    uint8_t* planar; // interleaved
+    uint8_t* noninterleaved;
+    uint8_t* columns; // bpl2iff -t 1 layout
+    uint8_t* chunky;
+    uint8_t* packed; // PackBits BODY of 'planar'
+    size_t packed_size;
+    uint8_t* scratch; // output buffer, planar_size (+ PackBits worst case)
+} BenchImage;
+
+static uint32_t rng_state = 12345;
+static uint32_t rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+// Random bytes, or runs of 1-64 equal bytes (75% of them zero) that PackBits compresses well
+static void fill_data(uint8_t* p, size_t n, int compressible) {
+    if (!compressible) {
+        for (size_t i = 0; i < n; i++) p[i] = (uint8_t)rng();
+        return;
+    }
+    for (size_t i = 0; i < n; ) {
+        size_t run = 1 + rng() % 64;
+        uint8_t v = (rng() & 3) ? 0 : (uint8_t)rng();
+        for (; run > 0 && i < n; run--) p[i++] = v;
+    }
+}
+
+// Derive the other layouts of an image whose interleaved planar data is filled in
+static int prepare_image(BenchImage* im) {
+    size_t pixels = (size_t)im->width * im->height;
+    im->noninterleaved = (uint8_t*)malloc(im->planar_size + 1);
+    im->columns = (uint8_t*)malloc(im->planar_size + 1);
+    im->chunky = (uint8_t*)malloc(pixels + 1);
+    im->scratch = (uint8_t*)malloc(encode_body_bound(im->row_bytes, (size_t)im->height * im->planes) + pixels + 1);
+    if (!im->noninterleaved || !im->columns || !im->chunky || !im->scratch) return 1;
+    convert_to_noninterleaved(im->planar, im->noninterleaved, im->width, im->height, im->planes);
+    if (convert_to_chunky(im->planar, im->planar_size, im->chunky, im->width, im->height, im->planes, 0) != IFFBPL_OK) return 1;
+    // -t 1: per plane, byte column c holds rows 0..height-1 of byte c
+    for (size_t p = 0; p < im->planes; p++) {
+        for (size_t y = 0; y < im->height; y++) {
+            for (size_t c = 0; c < im->row_bytes; c++) {
+                im->columns[p * im->row_bytes * im->height + c * im->height + y] =
+                    im->planar[(y * im->planes + p) * im->row_bytes + c];
+            }
+        }
+    }
+    PlanarInput src;
+    memset(&src, 0, sizeof(src));
+    src.data = im->planar;
+    src.layout = LAYOUT_INTERLEAVED;
+    src.height = im->height;
+    src.planes = im->planes;
+    src.row_bytes = im->row_bytes;
+    src.in_row_bytes = im->row_bytes;
+    im->packed = encode_body(&src, 1, 0, &im->packed_size, NULL, NULL);
+    return im->packed ? 0 : 1;
+}
+
+static int make_image(BenchImage* im, uint16_t width, uint16_t height, uint8_t planes, int compressible) {
+    memset(im, 0, sizeof(*im));
+    im->width = width;
+    im->height = height;
+    im->planes = planes;
+    im->kind = compressible ? "runs" : "random";
+    im->row_bytes = ilbm_row_bytes(width);
+    im->planar_size = im->row_bytes * planes * height;
+    im->planar = (uint8_t*)malloc(im->planar_size + 1);
+    if (!im->planar) return 1;
+    fill_data(im->planar, im->planar_size, compressible);
+    return prepare_image(im);
+}
+
+static void free_image(BenchImage* im) {
+    free(im->planar);
+    free(im->noninterleaved);
+    free(im->columns);
+    free(im->chunky);
+    free(im->packed);
+    free(im->scratch);
+    memset(im, 0, sizeof(*im));
+}
+
+enum {
+    K_DECODE, K_DECODE_REF, K_ENCODE, K_ENCODE_OPTIMAL, K_CHUNKY, K_CHUNKY_DOUBLED, K_CHUNKY_REF, K_PLANAR,
+    K_NONINTERLEAVED, K_INTERLEAVED, K_GATHER_NONINTERLEAVED, K_GATHER_COLUMNS, NUM_KERNELS
+};
+
+static const char* kernel_names[NUM_KERNELS] = {
+    "decompress_body", "decompress two-pass ref", "encode_body", "encode_body -r2", "convert_to_chunky", "convert_to_chunky -cd",
+    "convert_to_chunky_ref", "convert_to_planar", "convert_to_noninterleaved", "convert_to_interleaved",
+    "bpl2iff interleave", "bpl2iff transpose -t 1"
+};
+
+static double min_time = 0.05;
+static int encode_threads = 1;
+static volatile size_t sink; // keeps results alive
+
+// Read every BODY scanline of the input layout once, as bpl2iff does for an uncompressed BODY
+static void gather_body(const BenchImage* im, int layout) {
+    PlanarInput src;
+    memset(&src, 0, sizeof(src));
+    src.layout = layout;
+    src.height = im->height;
+    src.planes = im->planes;
+    src.row_bytes = im->row_bytes;
+    src.in_row_bytes = im->row_bytes;
+    src.plane_input_size = im->row_bytes * im->height;
+    if (layout == LAYOUT_COLUMNS) {
+        src.data = im->columns;
+        src.col_width = 1;
+        src.columns = im->row_bytes;
+    } else {
+        src.data = im->noninterleaved;
+    }
+    ScanlineReader rd;
+    if (reader_init(&rd, &src) != 0) return;
+    size_t sum = 0;
+    for (size_t r = 0; r < (size_t)im->height * im->planes; r++) sum += read_scanline(&rd, r)[0];
+    reader_free(&rd);
+    sink += sum;
+}
+
+// The BODY decoder iff2bpl started from, as the reference for decompress_body(): every scanline is
+// decompressed, then its PackBits packets are scanned a second time to find where the next one starts
+static size_t decode_body_two_pass(const uint8_t* src, size_t src_len, uint8_t* dst, size_t row_bytes,
+                                   size_t num_rows) {
+    size_t src_offset = 0;
+    for (size_t row = 0; row < num_rows; row++) {
+        decompress_packbits(src + src_offset, src_len - src_offset, dst + row * row_bytes, row_bytes, NULL);
+        size_t consumed = 0, produced = 0;
+        while (produced < row_bytes && src_offset + consumed < src_len) {
+            int8_t n = (int8_t)src[src_offset + consumed++];
+            if (n >= 0) {
+                consumed += (size_t)n + 1;
+                produced += (size_t)n + 1;
+            } else if (n != -128) {
+                consumed += 1;
+                produced += (size_t)(-n) + 1;
+            }
+        }
+        src_offset += consumed;
+        if (src_offset > src_len) src_offset = src_len;
+    }
+    return src_offset;
+}
+
+static void run_kernel(const BenchImage* im, int k) {
+    PlanarInput src;
+    switch (k) {
+    case K_DECODE:
+        sink += decompress_body(im->packed, im->packed_size, im->scratch, im->row_bytes,
+                                (size_t)im->height * im->planes, NULL);
+        break;
+    case K_DECODE_REF:
+        sink += decode_body_two_pass(im->packed, im->packed_size, im->scratch, im->row_bytes,
+                                     (size_t)im->height * im->planes);
+        break;
+    case K_ENCODE:
+    case K_ENCODE_OPTIMAL:
+        memset(&src, 0, sizeof(src));
+        src.data = im->planar;
+        src.layout = LAYOUT_INTERLEAVED;
+        src.height = im->height;
+        src.planes = im->planes;
+        src.row_bytes = im->row_bytes;
+        src.in_row_bytes = im->row_bytes;
+        sink += encode_body_into(&src, encode_threads, k == K_ENCODE_OPTIMAL, im->scratch, NULL, NULL);
+        break;
+    case K_CHUNKY:
+    case K_CHUNKY_DOUBLED:
+        convert_to_chunky(im->planar, im->planar_size, im->scratch, im->width, im->height, im->planes, k == K_CHUNKY_DOUBLED);
+        break;
+    case K_CHUNKY_REF:
+        convert_to_chunky_ref(im->planar, im->scratch, im->width, im->height, im->planes, 0);
+        break;
+    case K_PLANAR:
+        convert_to_planar(im->chunky, im->scratch, im->width, im->height, im->planes);
+        break;
+    case K_NONINTERLEAVED:
+        convert_to_noninterleaved(im->planar, im->scratch, im->width, im->height, im->planes);
+        break;
+    case K_INTERLEAVED:
+        convert_to_interleaved(im->noninterleaved, im->scratch, im->width, im->height, im->planes);
+        break;
+    case K_GATHER_NONINTERLEAVED:
+        gather_body(im, LAYOUT_NONINTERLEAVED);
+        break;
+    case K_GATHER_COLUMNS:
+        gather_body(im, LAYOUT_COLUMNS);
+        break;
+    }
+}
+
+// Run one kernel repeatedly for at least min_time and print its throughput
+static void bench_kernel(const BenchImage* im, int k) {
+    size_t reps = 0;
+    double t0 = time_seconds(), t;
+    uint64_t c0 = cycles();
+    do {
+        run_kernel(im, k);
+        reps++;
+        t = time_seconds() - t0;
+    } while (t < min_time);
+    uint64_t c = cycles() - c0;
+    double pixels = (double)im->width * im->height * (double)reps;
+    double mbs = (double)im->planar_size * (double)reps / t / 1e6;
+    printf("%-26s %5ux%-5u %u  %-6s %9.1f MB/s", kernel_names[k], im->width, im->height, im->planes, im->kind, mbs);
+    if (c) printf(" %8.2f cycles/pixel", (double)c / pixels);
+    printf("\n");
+}
+
+static void bench_image(const BenchImage* im) {
+    for (int k = 0; k < NUM_KERNELS; k++) {
+        // the reference and optimal kernels are slow, keep them to moderate sizes
+        if ((k == K_CHUNKY_REF || k == K_ENCODE_OPTIMAL) && im->planar_size > 4 * 1024 * 1024) continue;
+        bench_kernel(im, k);
+    }
+    printf("\n");
+}
+
+// Benchmark the kernels on the decoded image data of an ILBM file
+static int bench_file(const char* filename) {
+    FILE* f = fopen(filename, "rb");
+    if (!f) {
+        fprintf(stderr, "Failed to open %s\n", filename);
+        return 1;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    uint8_t* data = (uint8_t*)malloc(size > 0 ? (size_t)size : 1);
+    size_t got = data ? fread(data, 1, (size_t)size, f) : 0;
+    fclose(f);
+
+    IlbmImage img;
+    BenchImage im;
+    memset(&im, 0, sizeof(im));
+    int ret = 1;
+    if (data && ilbm_parse(data, got, &img) == IFFBPL_OK && img.bmhd.numPlanes >= 1 && img.bmhd.numPlanes <= 8) {
+        im.width = img.bmhd.width;
+        im.height = img.bmhd.height;
+        im.planes = img.bmhd.numPlanes;
+        im.kind = "file";
+        im.row_bytes = ilbm_row_bytes(im.width);
+        im.planar_size = ilbm_planar_size(&img.bmhd);
+        im.planar = (uint8_t*)malloc(im.planar_size + 1);
+        if (im.planar && ilbm_decode_body(&img, im.planar, NULL) == IFFBPL_OK && prepare_image(&im) == 0) {
+            printf("%s:\n", filename);
+            bench_image(&im);
+            ret = 0;
+        }
+    }
+    if (ret) fprintf(stderr, "Cannot benchmark %s (not a 1-8 plane ILBM?)\n", filename);
+    free_image(&im);
+    free(data);
+    return ret;
+}
+
+int main(int argc, char* argv[]) {
+    static const uint16_t sizes[][2] = { {16, 16}, {77, 33}, {320, 256}, {1024, 1024}, {4096, 4096} };
+    int quick = 0, only_planes = 0, only_w = 0, only_h = 0, num_files = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-quick") == 0) {
+            quick = 1;
+        } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            only_planes = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            if (sscanf(argv[++i], "%dx%d", &only_w, &only_h) != 2 || only_w <= 0 || only_h <= 0 ||
+                only_w > 65535 || only_h > 65535) {
+                fprintf(stderr, "Invalid size: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            min_time = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            encode_threads = atoi(argv[++i]);
+        } else if (argv[i][0] == '-') {
+            fprintf(stderr, "Usage: %s [-quick] [-p planes] [-s WxH] [-t seconds] [-j threads] [file.iff ...]\n", argv[0]);
+            return 1;
+        } else {
+            num_files++;
+        }
+    }
+
+    // Real corpora first; with only files given the synthetic images are skipped
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "-t") == 0 ||
+            strcmp(argv[i], "-j") == 0) {
+            i++;
+        } else if (argv[i][0] != '-') {
+            bench_file(argv[i]);
+        }
+    }
+    if (num_files > 0 && !quick && !only_w && !only_planes) return 0;
+
+    size_t num_sizes = only_w ? 1 : sizeof(sizes) / sizeof(sizes[0]);
+    for (size_t s = 0; s < num_sizes; s++) {
+        uint16_t w = only_w ? (uint16_t)only_w : sizes[s][0];
+        uint16_t h = only_w ? (uint16_t)only_h : sizes[s][1];
+        if (quick && !only_w && w != 320 && w != 1024) continue;
+        for (int planes = 1; planes <= 8; planes++) {
+            if (only_planes && planes != only_planes) continue;
+            if (!only_planes && quick && planes != 1 && planes != 5 && planes != 8) continue;
+            for (int compressible = 0; compressible < 2; compressible++) {
+                BenchImage im;
+                if (make_image(&im, w, h, (uint8_t)planes, compressible) != 0) {
+                    fprintf(stderr, "Out of memory for %ux%ux%d\n", w, h, planes);
+                    free_image(&im);
+                    continue;
+                }
+                bench_image(&im);
+                free_image(&im);
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,1231 @@
+/*
+    Differential check of the libiffbpl kernels
+
+    Runs every optimised kernel against a plain scalar reference on random geometry (odd widths, 1-8
+    planes and deep images, heights across the band sizes, misaligned buffers) and on malformed PackBits
+    streams, round-trips the sample files in this folder through the bpl2iff and iff2bpl code paths,
+    applies hand-built DLTA chunks of every supported ANIM operation against the frames they spell out,
+    and feeds random and damaged ILBM, ANIM (two frames with a random DLTA) and pack data to the parsers. Any difference is printed
+    with the geometry that produced it; the exit code is the number of failed checks.
+
+    Usage: check [-n rounds] [-seed n] [-d tests_dir] [-fuzz file ...]
+        -n rounds   random cases per check (default 200)
+        -seed n     random seed of the first case of every check (default 1). A failure prints the seed
+                    of its case, -seed that_seed -n 1 runs the case again
+        -d dir      folder holding dead.rawb, fonts8.fnt and fonts16.fnt. By default the folder of this
+                    source file, else tests/ next to the executable or the executable's own folder.
+                    A sample file that cannot be read counts as a failure
+        -fuzz file  run the parser target once on each file, as an AFL entry point or to replay a crash
+
+    Build (from the repository root), once plain and once with the SIMD paths enabled, and on an AVX2 CPU
+    once more with -DIFFBPL_NO_AVX2 to cover the SSE2 planar to chunky kernel; on ARM once more with
+    -DIFFBPL_NEON for the NEON kernel, which is not built without it:
+        gcc -O2 -I. tests/check.c libiffbpl.c -o check.exe
+        gcc -O2 -mssse3 -I. tests/check.c libiffbpl.c -o check.exe
+        (on Linux/macOS add -pthread), then run ./check.exe
+
+    Fuzzing the chunk parsers (the same target as -fuzz):
+        libFuzzer: clang -g -O1 -fsanitize=fuzzer,address -DCHECK_LIBFUZZER -I. tests/check.c libiffbpl.c
+                   -pthread -o check_fuzz, then ./check_fuzz corpus_dir
+        AFL:       afl-clang-fast -O2 -I. tests/check.c libiffbpl.c -pthread -o check_afl, then
+                   afl-fuzz -i seeds -o findings ./check_afl -fuzz @@
+    A fuzzed input that decodes differently on one thread and on several, or crashes, aborts the target.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include "libiffbpl.h"
+
+static uint32_t rng_state = 1;
+static uint32_t rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+static unsigned rnd(unsigned n) { return n ? rng() % n : 0; } // 0 .. n-1
+
+// Random bytes, or runs of equal bytes (mostly zero) that PackBits compresses well, or a mix of both
+static void fill_data(uint8_t* p, size_t n) {
+    unsigned kind = rnd(3);
+    for (size_t i = 0; i < n; ) {
+        if (kind == 0 || (kind == 2 && rnd(2))) {
+            p[i++] = (uint8_t)rng();
+            continue;
+        }
+        size_t run = 1 + rnd(kind == 1 ? 200 : 8);
+        uint8_t v = rnd(4) ? 0 : (uint8_t)rng();
+        for (; run > 0 && i < n; run--) p[i++] = v;
+    }
+}
+
+// A buffer of n bytes starting 0..15 bytes past a malloc'ed block, so no kernel can rely on alignment
+typedef struct {
+    uint8_t* block;
+    uint8_t* p;
+} Buf;
+
+static uint8_t* buf_alloc(Buf* b, size_t n) {
+    b->block = (uint8_t*)malloc(n + 16);
+    b->p = b->block ? b->block + rnd(16) : NULL;
+    return b->p;
+}
+
+static void buf_free(Buf* b) {
+    free(b->block);
+    b->block = b->p = NULL;
+}
+
+static int failures = 0;
+static uint32_t case_seed; // seed of the current case
+
+// Report a failed comparison with the case that produced it
+static void fail(const char* check, const char* fmt, ...) {
+    va_list ap;
+    failures++;
+    if (failures > 20) return;
+    printf("FAIL %s (seed %u): ", check, (unsigned)case_seed);
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+    printf("\n");
+}
+
+static size_t first_diff(const uint8_t* a, const uint8_t* b, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (a[i] != b[i]) return i;
+    }
+    return n;
+}
+
+static int get_bit(const uint8_t* row, size_t x) { return (row[x >> 3] >> (7 - (x & 7))) & 1; }
+static void set_bit(uint8_t* row, size_t x) { row[x >> 3] |= (uint8_t)(0x80 >> (x & 7)); }
+
+// ---------------------------------------------------------------------------------------------
+// Scalar references
+// ---------------------------------------------------------------------------------------------
+
+// PackBits scanline decoder written from the format description: n = 0..127 copies n + 1 bytes,
+// n = -1..-127 repeats the next byte 1 - n times, -128 is a no-op. Output beyond dst_len is dropped,
+// a literal cut off by the end of the source is copied as far as it goes.
+static size_t ref_packbits(const uint8_t* src, size_t src_len, uint8_t* dst, size_t dst_len, size_t* src_used) {
+    size_t si = 0, di = 0;
+    while (si < src_len && di < dst_len) {
+        int n = (int8_t)src[si++];
+        if (n >= 0) {
+            for (int i = 0; i <= n && si < src_len; i++, si++) {
+                if (di < dst_len) dst[di++] = src[si];
+            }
+        } else if (n != -128) {
+            if (si >= src_len) break;
+            uint8_t v = src[si++];
+            for (int i = 0; i <= -n && di < dst_len; i++) dst[di++] = v;
+        }
+    }
+    *src_used = si;
+    return di;
+}
+
+// Interleaved -> chunky, bit p of pixel x from plane p, for any plane count (byte k holds planes 8k..8k+7)
+static void ref_chunky(const uint8_t* planar, size_t rows, uint16_t width, uint8_t planes, int double_bits,
+                       uint8_t* out) {
+    size_t rb = ilbm_row_bytes(width), pb = ilbm_chunky_pixel_bytes(planes);
+    for (size_t y = 0; y < rows; y++) {
+        for (size_t x = 0; x < width; x++) {
+            uint8_t* px = out + (y * width + x) * pb;
+            memset(px, 0, pb);
+            for (unsigned p = 0; p < planes; p++) {
+                if (get_bit(planar + (y * planes + p) * rb, x)) px[p / 8] |= (uint8_t)(1 << (p % 8));
+            }
+            if (double_bits && pb == 1) {
+                uint8_t v = px[0], d = 0;
+                for (int b = 0; b < 4; b++) {
+                    if (v & (1 << b)) d |= (uint8_t)(3 << (2 * b));
+                }
+                px[0] = d;
+            }
+        }
+    }
+}
+
+// Scanline 'scanline' of a PlanarInput, byte by byte from the layout description in libiffbpl.h
+static void ref_scanline(const PlanarInput* in, size_t scanline, uint8_t* line) {
+    size_t y = scanline / in->planes, p = scanline % in->planes;
+    memset(line, 0, in->row_bytes);
+    for (size_t b = 0; b < in->row_bytes; b++) {
+        if (in->layout == LAYOUT_COLUMNS) {
+            size_t c = b / in->col_width;
+            if (c < in->columns) {
+                line[b] = in->data[p * in->plane_input_size + (c * in->height + y) * in->col_width + b % in->col_width];
+            }
+        } else if (b < in->in_row_bytes) {
+            size_t off = in->layout == LAYOUT_INTERLEAVED ? scanline * in->in_row_bytes
+                                                          : p * in->plane_input_size + y * in->in_row_bytes;
+            line[b] = in->data[off + b];
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------------------------
+// Kernel checks
+// ---------------------------------------------------------------------------------------------
+
+// decompress_packbits(), decompress_body() and skip_packbits_rows() on malformed streams: random packet
+// bytes, truncated literals and repeats, rows running short or past the end of the source
+static void check_packbits_decode(int rounds) {
+    for (int r = 0; r < rounds; r++) {
+        case_seed = rng_state;
+        size_t src_len = rnd(600), row_bytes = 2 * (1 + rnd(60)), num_rows = 1 + rnd(12);
+        size_t dst_len = row_bytes * num_rows;
+        Buf src = {0}, dst = {0}, ref = {0};
+        if (!buf_alloc(&src, src_len) || !buf_alloc(&dst, dst_len) || !buf_alloc(&ref, dst_len)) {
+            buf_free(&src); buf_free(&dst); buf_free(&ref);
+            return;
+        }
+        // Mostly well formed packets, with random bytes (any header, -128 included) mixed in
+        for (size_t i = 0; i < src_len; ) {
+            if (rnd(4) == 0) {
+                src.p[i++] = (uint8_t)rng();
+            } else if (rnd(2)) {
+                size_t n = rnd(128);
+                src.p[i++] = (uint8_t)n;
+                for (size_t k = 0; k <= n && i < src_len; k++) src.p[i++] = (uint8_t)rng();
+            } else {
+                src.p[i++] = (uint8_t)(257 - (2 + rnd(127)));
+                if (i < src_len) src.p[i++] = (uint8_t)rng();
+            }
+        }
+
+        size_t len = rnd((unsigned)row_bytes * 2 + 1), used, ref_used;
+        memset(dst.p, 0xA5, dst_len);
+        memset(ref.p, 0xA5, dst_len);
+        size_t got = decompress_packbits(src.p, src_len, dst.p, len < dst_len ? len : dst_len, &used);
+        size_t want = ref_packbits(src.p, src_len, ref.p, len < dst_len ? len : dst_len, &ref_used);
+        if (got != want || used != ref_used || memcmp(dst.p, ref.p, dst_len) != 0) {
+            fail("decompress_packbits", "src_len %zu dst_len %zu: wrote %zu used %zu, expected %zu used %zu",
+                 src_len, len, got, used, want, ref_used);
+        }
+
+        // The body decoders continue each row where the previous one stopped and zero pad short rows
+        size_t pos = 0, ref_short = 0, short_rows = 0;
+        for (size_t row = 0; row < num_rows; row++) {
+            size_t w = ref_packbits(src.p + pos, src_len - pos, ref.p + row * row_bytes, row_bytes, &ref_used);
+            if (w < row_bytes) {
+                memset(ref.p + row * row_bytes + w, 0, row_bytes - w);
+                ref_short++;
+            }
+            pos += ref_used;
+        }
+        size_t consumed = decompress_body(src.p, src_len, dst.p, row_bytes, num_rows, &short_rows);
+        if (consumed != pos || short_rows != ref_short || memcmp(dst.p, ref.p, dst_len) != 0) {
+            fail("decompress_body", "src_len %zu row_bytes %zu rows %zu: used %zu short %zu, expected %zu short %zu",
+                 src_len, row_bytes, num_rows, consumed, short_rows, pos, ref_short);
+        }
+        size_t skipped = skip_packbits_rows(src.p, src_len, row_bytes, num_rows);
+        if (skipped != pos) {
+            fail("skip_packbits_rows", "src_len %zu row_bytes %zu rows %zu: skipped %zu, expected %zu",
+                 src_len, row_bytes, num_rows, skipped, pos);
+        }
+        buf_free(&src);
+        buf_free(&dst);
+        buf_free(&ref);
+    }
+}
+
+// Both PackBits encoders: the output decodes to the input, stays within PACKBITS_MAX_SIZE() and the
+// optimal encoder is never larger than the greedy one
+static void check_packbits_encode(int rounds) {
+    for (int r = 0; r < rounds; r++) {
+        case_seed = rng_state;
+        size_t n = rnd(r < rounds / 2 ? 300 : 3000);
+        Buf src = {0}, out = {0}, opt = {0}, dec = {0};
+        void* scratch = malloc(PACKBITS_OPTIMAL_SCRATCH(n)); // needs uint32_t alignment
+        if (!buf_alloc(&src, n) || !buf_alloc(&out, PACKBITS_MAX_SIZE(n)) || !buf_alloc(&opt, PACKBITS_MAX_SIZE(n)) ||
+            !buf_alloc(&dec, n) || !scratch) {
+            buf_free(&src); buf_free(&out); buf_free(&opt); buf_free(&dec); free(scratch);
+            return;
+        }
+        fill_data(src.p, n);
+        size_t greedy = packbits_encode_row(src.p, n, out.p);
+        size_t optimal = packbits_encode_row_optimal(src.p, n, opt.p, scratch);
+        const uint8_t* enc[2] = { out.p, opt.p };
+        size_t len[2] = { greedy, optimal };
+        for (int k = 0; k < 2; k++) {
+            size_t used, w = ref_packbits(enc[k], len[k], dec.p, n, &used);
+            if (len[k] > PACKBITS_MAX_SIZE(n) || w != n || used != len[k] || memcmp(dec.p, src.p, n) != 0) {
+                fail(k ? "packbits_encode_row_optimal" : "packbits_encode_row",
+                     "%zu bytes: encoded to %zu, decodes to %zu bytes (%zu used)", n, len[k], w, used);
+            }
+        }
+        if (optimal > greedy) fail("packbits_encode_row_optimal", "%zu bytes: %zu > greedy %zu", n, optimal, greedy);
+        size_t packed_len;
+        uint8_t* packed = packbits_encode(src.p, n, &packed_len);
+        if (!packed || packed_len != greedy || memcmp(packed, out.p, greedy) != 0) {
+            fail("packbits_encode", "%zu bytes: differs from packbits_encode_row()", n);
+        }
+        free(packed);
+        buf_free(&src);
+        buf_free(&out);
+        buf_free(&opt);
+        buf_free(&dec);
+        free(scratch);
+    }
+}
+
+// A random image geometry: odd widths, mostly 1-8 planes
+static void random_geometry(uint16_t* width, uint16_t* height, uint8_t* planes, int deep) {
+    static const uint8_t deep_planes[] = { 9, 12, 16, 24, 24, 32, 32 };
+    *width = (uint16_t)(1 + (rnd(4) ? rnd(130) : rnd(1100)));
+    *height = (uint16_t)(1 + rnd(rnd(4) ? 20 : 80));
+    *planes = (uint8_t)(deep && rnd(4) == 0 ? deep_planes[rnd(sizeof(deep_planes))] : 1 + rnd(8));
+}
+
+// convert_to_chunky() (SWAR/SSE2/AVX2/NEON/SSSE3 paths, bit doubling, deep images, short input) against both
+// references, and convert_to_planar() as its inverse
+static void check_chunky(int rounds) {
+    for (int r = 0; r < rounds; r++) {
+        case_seed = rng_state;
+        uint16_t width, height;
+        uint8_t planes;
+        random_geometry(&width, &height, &planes, 1);
+        int double_bits = planes <= 8 && rnd(4) == 0;
+        size_t rb = ilbm_row_bytes(width), size = rb * planes * height;
+        size_t pb = ilbm_chunky_pixel_bytes(planes), out_size = (size_t)width * height * pb;
+        // Sometimes only part of the rows is present, the others must come out as 0
+        size_t avail = rnd(5) ? size : rnd((unsigned)size + 1);
+        size_t full_rows = avail / (rb * planes);
+        Buf planar = {0}, out = {0}, ref = {0}, spec = {0}, back = {0};
+        if (!buf_alloc(&planar, size) || !buf_alloc(&out, out_size) || !buf_alloc(&ref, out_size) ||
+            !buf_alloc(&spec, out_size) || !buf_alloc(&back, size)) {
+            buf_free(&planar); buf_free(&out); buf_free(&ref); buf_free(&spec); buf_free(&back);
+            return;
+        }
+        fill_data(planar.p, size);
+        memset(out.p, 0xA5, out_size);
+        if (convert_to_chunky(planar.p, avail, out.p, width, height, planes, double_bits) != IFFBPL_OK) {
+            fail("convert_to_chunky", "%ux%u %u planes: out of memory", width, height, planes);
+        }
+        memset(ref.p, 0, out_size);
+        ref_chunky(planar.p, full_rows, width, planes, double_bits, ref.p);
+        size_t d = first_diff(out.p, ref.p, out_size);
+        if (d < out_size) {
+            fail("convert_to_chunky", "%ux%u %u planes%s, %zu of %zu bytes: byte %zu is %02X, expected %02X",
+                 width, height, planes, double_bits ? " -cd" : "", avail, size, d, out.p[d], ref.p[d]);
+        }
+        if (avail == size) {
+            convert_to_chunky_ref(planar.p, spec.p, width, height, planes, double_bits);
+            d = first_diff(spec.p, ref.p, out_size);
+            if (d < out_size) fail("convert_to_chunky_ref", "%ux%u %u planes: byte %zu differs", width, height, planes, d);
+        }
+        if (planes <= 8 && !double_bits && avail == size) {
+            // Chunky -> planar gives the planes back with the row padding bits cleared
+            convert_to_planar(ref.p, back.p, width, height, planes);
+            for (size_t line = 0; line < (size_t)height * planes; line++) {
+                uint8_t* row = planar.p + line * rb;
+                for (size_t x = width; x < rb * 8; x++) row[x >> 3] &= (uint8_t)~(0x80 >> (x & 7));
+            }
+            d = first_diff(back.p, planar.p, size);
+            if (d < size) fail("convert_to_planar", "%ux%u %u planes: byte %zu differs", width, height, planes, d);
+        }
+        buf_free(&planar);
+        buf_free(&out);
+        buf_free(&ref);
+        buf_free(&spec);
+        buf_free(&back);
+    }
+}
+
+// The layout converters of iff2bpl: non-interleaved and back, -rect crops, mask plane split, sprites
+static void check_layouts(int rounds) {
+    for (int r = 0; r < rounds; r++) {
+        case_seed = rng_state;
+        uint16_t width, height;
+        uint8_t planes;
+        random_geometry(&width, &height, &planes, 0);
+        size_t rb = ilbm_row_bytes(width), size = rb * planes * height;
+        size_t masked_size = rb * (planes + 1u) * height;
+        Buf src = {0}, out = {0}, ref = {0}, back = {0};
+        if (!buf_alloc(&src, masked_size) || !buf_alloc(&out, masked_size) || !buf_alloc(&ref, masked_size) ||
+            !buf_alloc(&back, masked_size)) {
+            buf_free(&src); buf_free(&out); buf_free(&ref); buf_free(&back);
+            return;
+        }
+        fill_data(src.p, masked_size);
+
+        convert_to_noninterleaved(src.p, out.p, width, height, planes);
+        for (size_t p = 0; p < planes; p++) {
+            for (size_t y = 0; y < height; y++) {
+                memcpy(ref.p + (p * height + y) * rb, src.p + (y * planes + p) * rb, rb);
+            }
+        }
+        if (memcmp(out.p, ref.p, size) != 0) fail("convert_to_noninterleaved", "%ux%u %u planes", width, height, planes);
+        convert_to_interleaved(out.p, back.p, width, height, planes);
+        if (memcmp(back.p, src.p, size) != 0) fail("convert_to_interleaved", "%ux%u %u planes", width, height, planes);
+
+        // A region x, w of every scanline
+        size_t x = rnd(width), w = 1 + rnd((unsigned)(width - x));
+        size_t crb = ilbm_row_bytes((uint16_t)w), lines = (size_t)height * planes;
+        memset(out.p, 0xA5, crb * lines);
+        crop_planar(src.p, rb, lines, x, (uint16_t)w, out.p);
+        memset(ref.p, 0, crb * lines);
+        for (size_t l = 0; l < lines; l++) {
+            for (size_t i = 0; i < w; i++) {
+                if (get_bit(src.p + l * rb, x + i)) set_bit(ref.p + l * crb, i);
+            }
+        }
+        if (memcmp(out.p, ref.p, crb * lines) != 0) {
+            fail("crop_planar", "%ux%u %u planes, pixels %zu..%zu", width, height, planes, x, x + w - 1);
+        }
+
+        // Rows of planes + mask, split into a new buffer and in place
+        uint8_t* mask = back.p;
+        ilbm_split_mask(src.p, height, width, planes, out.p, mask);
+        memcpy(ref.p, src.p, masked_size);
+        ilbm_split_mask(ref.p, height, width, planes, ref.p, NULL);
+        for (size_t y = 0; y < height; y++) {
+            const uint8_t* s = src.p + y * (planes + 1u) * rb;
+            size_t n = planes * rb;
+            if (memcmp(out.p + y * n, s, n) != 0 || memcmp(ref.p + y * n, s, n) != 0 || memcmp(mask + y * rb, s + n, rb) != 0) {
+                fail("ilbm_split_mask", "%ux%u %u planes, row %zu", width, height, planes, y);
+                break;
+            }
+        }
+
+        if (planes <= SPRITE_MAX_PLANES) {
+            size_t n = sprite_count(width, planes), pair = planes > 2 ? 2 : 1;
+            convert_to_sprites(src.p, width, height, planes, out.p);
+            memset(ref.p, 0, n * height * 4);
+            for (size_t s = 0; s < n; s++) {
+                for (size_t y = 0; y < height; y++) {
+                    for (unsigned k = 0; k < 2; k++) {
+                        size_t p = (s % pair) * 2 + k;
+                        if (p >= planes) continue;
+                        memcpy(ref.p + (s * height + y) * 4 + k * 2, src.p + (y * planes + p) * rb + s / pair * 2, 2);
+                    }
+                }
+            }
+            if (memcmp(out.p, ref.p, n * height * 4) != 0) fail("convert_to_sprites", "%ux%u %u planes", width, height, planes);
+        }
+        buf_free(&src);
+        buf_free(&out);
+        buf_free(&ref);
+        buf_free(&back);
+    }
+}
+
+// The scanline gathering of bpl2iff: get_scanline() and the band transpose of read_scanline() for -t
+// columns of 1-4 bytes, -i interleaved and non-interleaved input with rows shorter than the BODY rows
+static void check_scanlines(int rounds) {
+    for (int r = 0; r < rounds; r++) {
+        case_seed = rng_state;
+        uint16_t width, height;
+        uint8_t planes;
+        random_geometry(&width, &height, &planes, 0);
+        if (rnd(3) == 0) height = (uint16_t)(TRANSPOSE_BAND_ROWS - 2 + rnd(TRANSPOSE_BAND_ROWS * 3));
+        PlanarInput in;
+        memset(&in, 0, sizeof(in));
+        in.layout = (int)rnd(3);
+        in.height = height;
+        in.planes = planes;
+        in.row_bytes = ilbm_row_bytes(width);
+        in.in_row_bytes = rnd(2) ? in.row_bytes : ((size_t)width + 7) / 8; // bpl2iff -x allows odd byte rows
+        if (in.layout == LAYOUT_COLUMNS) {
+            in.col_width = 1 + rnd(4);
+            in.columns = (in.in_row_bytes + in.col_width - 1) / in.col_width;
+            in.plane_input_size = in.columns * in.col_width * height;
+        } else {
+            in.plane_input_size = in.in_row_bytes * height;
+        }
+        size_t size = in.plane_input_size * planes;
+        Buf data = {0}, line = {0}, ref = {0};
+        if (!buf_alloc(&data, size) || !buf_alloc(&line, in.row_bytes) || !buf_alloc(&ref, in.row_bytes)) {
+            buf_free(&data); buf_free(&line); buf_free(&ref);
+            return;
+        }
+        fill_data(data.p, size);
+        in.data = data.p;
+        ScanlineReader rd;
+        if (reader_init(&rd, &in) != 0) {
+            buf_free(&data); buf_free(&line); buf_free(&ref);
+            return;
+        }
+        // read_scanline() in BODY order, and get_scanline() at random scanlines
+        for (size_t s = 0; s < (size_t)height * planes; s++) {
+            ref_scanline(&in, s, ref.p);
+            const uint8_t* got = read_scanline(&rd, s);
+            if (memcmp(got, ref.p, in.row_bytes) != 0) {
+                fail("read_scanline", "layout %d %ux%u %u planes col_width %zu, scanline %zu",
+                     in.layout, width, height, planes, in.col_width, s);
+                break;
+            }
+            size_t t = rnd((unsigned)((size_t)height * planes));
+            ref_scanline(&in, t, ref.p);
+            got = get_scanline(&in, t, line.p);
+            if (memcmp(got, ref.p, in.row_bytes) != 0) {
+                fail("get_scanline", "layout %d %ux%u %u planes col_width %zu, scanline %zu",
+                     in.layout, width, height, planes, in.col_width, t);
+                break;
+            }
+        }
+        reader_free(&rd);
+        buf_free(&data);
+        buf_free(&line);
+        buf_free(&ref);
+    }
+}
+
+// Build a FORM ILBM of 'src' as bpl2iff does (optionally with a BIDX row index), parse and decode it as
+// iff2bpl does, on one thread, in parallel and by row ranges, and compare with the gathered scanlines
+static void check_ilbm(const char* name, const PlanarInput* src, uint16_t width, int compression, int optimal,
+                       int threads, int indexed) {
+    BMHD bmhd;
+    memset(&bmhd, 0, sizeof(bmhd));
+    bmhd.width = width;
+    bmhd.height = (uint16_t)src->height;
+    bmhd.numPlanes = (uint8_t)src->planes;
+    bmhd.compression = (uint8_t)compression;
+    bmhd.xAspect = bmhd.yAspect = 1;
+    bmhd.pageWidth = width;
+    bmhd.pageHeight = bmhd.height;
+    size_t lines = src->height * src->planes, planar_size = src->row_bytes * lines;
+    size_t* offsets = (size_t*)malloc((lines + 1) * sizeof(size_t));
+    uint8_t* packed = NULL;
+    uint8_t* form = NULL;
+    size_t form_size = 0;
+    if (!offsets) return;
+    if (indexed && compression) {
+        // bpl2iff -ri: the offsets of every scanline go into a BIDX chunk in front of the BODY
+        size_t packed_size;
+        packed = encode_body(src, threads, optimal, &packed_size, offsets, NULL);
+        form = packed ? (uint8_t*)malloc(ILBM_INDEXED_HEADER_SIZE(0, lines) + packed_size + 1) : NULL;
+        if (form) {
+            size_t header = ilbm_store_header_indexed(&bmhd, NULL, 0, offsets, lines, packed_size, form);
+            memcpy(form + header, packed, packed_size);
+            form_size = header + packed_size;
+            if (packed_size & 1) form[form_size++] = 0;
+        }
+    } else {
+        form = ilbm_build(&bmhd, NULL, 0, src, threads, optimal, &form_size, NULL);
+    }
+    Buf ref = {0}, out = {0};
+    if (!form || !buf_alloc(&ref, planar_size) || !buf_alloc(&out, planar_size)) {
+        fail(name, "out of memory");
+        free(offsets); free(packed); free(form);
+        return;
+    }
+    for (size_t s = 0; s < lines; s++) ref_scanline(src, s, ref.p + s * src->row_bytes);
+
+    IlbmImage img;
+    size_t short_rows = 0;
+    int rc = ilbm_parse(form, form_size, &img);
+    if (rc != IFFBPL_OK || (indexed && compression && !img.body_index)) {
+        fail(name, "ilbm_parse returned %d", rc);
+    } else {
+        const char* how = "ilbm_decode_body";
+        rc = ilbm_decode_body(&img, out.p, &short_rows);
+        if (rc == IFFBPL_OK && !short_rows && memcmp(out.p, ref.p, planar_size) == 0) {
+            how = "ilbm_decode_body_parallel";
+            memset(out.p, 0xA5, planar_size);
+            rc = ilbm_decode_body_parallel(&img, out.p, &short_rows, threads);
+        }
+        if (rc == IFFBPL_OK && !short_rows && memcmp(out.p, ref.p, planar_size) == 0 && src->height > 1) {
+            how = "ilbm_decode_rows";
+            size_t y0 = rnd((unsigned)src->height), n = 1 + rnd((unsigned)(src->height - y0));
+            size_t row_size = src->row_bytes * src->planes;
+            memcpy(out.p, ref.p, planar_size);
+            memset(out.p + y0 * row_size, 0xA5, n * row_size);
+            rc = ilbm_decode_rows(&img, y0, n, out.p + y0 * row_size, &short_rows);
+        }
+        size_t d = first_diff(out.p, ref.p, planar_size);
+        if (rc != IFFBPL_OK || short_rows || d < planar_size) {
+            fail(name, "%s: %ux%zu %zu planes, compression %d%s%s, %d threads: rc %d, %zu short rows, byte %zu differs",
+                 how, width, src->height, src->planes, compression, optimal ? " -r2" : "", indexed ? " -ri" : "",
+                 threads, rc, short_rows, d);
+        }
+        if (compression && !indexed && lines > 0) {
+            // encode_body() row offsets point at every scanline of the BODY
+            size_t packed_size;
+            uint8_t* body = encode_body(src, threads, optimal, &packed_size, offsets, NULL);
+            for (size_t s = 0; body && s < lines; s += 1 + rnd(8)) {
+                size_t used;
+                size_t w = ref_packbits(body + offsets[s], packed_size - offsets[s], out.p, src->row_bytes, &used);
+                if (w != src->row_bytes || memcmp(out.p, ref.p + s * src->row_bytes, w) != 0) {
+                    fail(name, "encode_body: scanline %zu at offset %zu does not decode", s, offsets[s]);
+                    break;
+                }
+            }
+            free(body);
+        }
+    }
+    buf_free(&ref);
+    buf_free(&out);
+    free(offsets);
+    free(packed);
+    free(form);
+}
+
+static void check_body_round_trip(int rounds) {
+    for (int r = 0; r < rounds; r++) {
+        case_seed = rng_state;
+        uint16_t width, height;
+        uint8_t planes;
+        random_geometry(&width, &height, &planes, 0);
+        // Some images big enough for ilbm_decode_body_parallel() to split the work
+        if (rnd(10) == 0) height = (uint16_t)(PARALLEL_DECODE_MIN_BYTES / (ilbm_row_bytes(width) * planes) + 1 + rnd(50));
+        PlanarInput in;
+        memset(&in, 0, sizeof(in));
+        in.layout = rnd(2) ? LAYOUT_INTERLEAVED : LAYOUT_NONINTERLEAVED;
+        in.height = height;
+        in.planes = planes;
+        in.row_bytes = in.in_row_bytes = ilbm_row_bytes(width);
+        in.plane_input_size = in.row_bytes * height;
+        Buf data = {0};
+        if (!buf_alloc(&data, in.plane_input_size * planes)) return;
+        fill_data(data.p, in.plane_input_size * planes);
+        in.data = data.p;
+        int compression = rnd(4) != 0;
+        check_ilbm("round trip", &in, width, compression, rnd(3) == 0, 1 + (int)rnd(4), compression && rnd(2));
+        buf_free(&data);
+    }
+}
+
+// palette_to_cmap() (SSSE3 path) against the 4 -> 8 bit expansion of every gun
+static void check_palette(int rounds) {
+    for (int r = 0; r < rounds; r++) {
+        case_seed = rng_state;
+        size_t n = rnd(300);
+        uint16_t colours[300];
+        uint8_t cmap[900];
+        for (size_t i = 0; i < n; i++) colours[i] = (uint16_t)rng();
+        palette_to_cmap(colours, n, cmap);
+        for (size_t i = 0; i < n; i++) {
+            if (cmap[i * 3] != ((colours[i] >> 8) & 15) * 17 || cmap[i * 3 + 1] != ((colours[i] >> 4) & 15) * 17 ||
+                cmap[i * 3 + 2] != (colours[i] & 15) * 17) {
+                fail("palette_to_cmap", "%zu colours, colour %zu (%04X)", n, i, colours[i]);
+                break;
+            }
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------------------------
+// ANIM deltas
+// ---------------------------------------------------------------------------------------------
+
+// Hand-built DLTA chunks are applied to a 48x4 frame of 2 planes: 6 bytes per row and plane, so with long
+// data a row has one long column and one word column
+#define DELTA_WIDTH 48
+#define DELTA_HEIGHT 4
+#define DELTA_PLANES 2
+#define DELTA_ROW_BYTES (DELTA_WIDTH / 8)
+#define DELTA_SIZE (DELTA_ROW_BYTES * DELTA_PLANES * DELTA_HEIGHT)
+
+typedef struct {
+    uint8_t d[256];
+    size_t len;
+} Dlta;
+
+// 16 list offsets, all 0 (plane unchanged) until dlta_list() sets one
+static void dlta_begin(Dlta* t) {
+    memset(t, 0, sizeof(*t));
+    t->len = 64;
+}
+
+// The list that follows starts at offset 'slot' (0-7 plane lists, 8-15 the data lists of operation 7)
+static void dlta_list(Dlta* t, int slot) {
+    put_be32(t->d + slot * 4, (uint32_t)t->len);
+}
+
+// Append n big-endian items of 'size' bytes
+static void dlta_add(Dlta* t, size_t size, int n, ...) {
+    va_list ap;
+    va_start(ap, n);
+    for (; n > 0; n--) {
+        uint32_t v = va_arg(ap, uint32_t);
+        for (size_t i = 0; i < size; i++) t->d[t->len++] = (uint8_t)(v >> (8 * (size - 1 - i)));
+    }
+    va_end(ap);
+}
+
+static size_t delta_at(int plane, int y, int col) {
+    return (size_t)y * DELTA_ROW_BYTES * DELTA_PLANES + (size_t)plane * DELTA_ROW_BYTES + (size_t)col;
+}
+
+static void delta_frame(uint8_t* planes) {
+    for (size_t i = 0; i < DELTA_SIZE; i++) planes[i] = (uint8_t)(i * 37 + 11);
+}
+
+// Apply the DLTA to the frame, which must then be 'expected'; cut short by one byte the DLTA is corrupt
+static void expect_delta(const char* name, uint8_t operation, uint32_t bits, const Dlta* t, const uint8_t* expected) {
+    BMHD bmhd;
+    memset(&bmhd, 0, sizeof(bmhd));
+    bmhd.width = DELTA_WIDTH;
+    bmhd.height = DELTA_HEIGHT;
+    bmhd.numPlanes = DELTA_PLANES;
+    AnimHeader anhd;
+    memset(&anhd, 0, sizeof(anhd));
+    anhd.operation = operation;
+    anhd.bits = bits;
+    uint8_t planes[DELTA_SIZE];
+    delta_frame(planes);
+    int rc = anim_apply_delta(&bmhd, &anhd, t->d, t->len, planes);
+    size_t d = first_diff(planes, expected, DELTA_SIZE);
+    if (rc != IFFBPL_OK) {
+        fail(name, "result %d", rc);
+    } else if (d < DELTA_SIZE) {
+        fail(name, "plane %zu row %zu byte %zu is %02X, expected %02X", (d / DELTA_ROW_BYTES) % DELTA_PLANES,
+             d / (DELTA_ROW_BYTES * DELTA_PLANES), d % DELTA_ROW_BYTES, planes[d], expected[d]);
+    }
+    delta_frame(planes);
+    rc = anim_apply_delta(&bmhd, &anhd, t->d, t->len - 1, planes);
+    if (rc != IFFBPL_ERR_FORMAT) fail(name, "DLTA cut short by a byte: result %d", rc);
+}
+
+// anim_apply_delta() on operation 5 (store and XOR), 7 and 8 (short and long data) against the frames the
+// ops spell out; 'rounds' is not used, the cases are fixed
+static void check_anim_deltas(int rounds) {
+    (void)rounds;
+    case_seed = rng_state;
+    Dlta t;
+    uint8_t base[DELTA_SIZE], set[DELTA_SIZE], xored[DELTA_SIZE], expected[DELTA_SIZE];
+
+    // Operation 5: skip, unique and repeat ops, a plane list per plane
+    dlta_begin(&t);
+    dlta_list(&t, 0);
+    dlta_add(&t, 1, 5, 2, 0x01, 0x82, 0xA0, 0xA1); // column 0: skip 1 row, 2 unique bytes
+    dlta_add(&t, 1, 4, 1, 0x00, 4, 0x55); // column 1: 4 rows of 0x55
+    dlta_add(&t, 1, 1, 0); // column 2: unchanged
+    dlta_add(&t, 1, 4, 2, 0x03, 0x81, 0xC3); // column 3: skip 3 rows, 1 unique byte
+    dlta_add(&t, 1, 2, 0, 0);
+    dlta_list(&t, 1);
+    dlta_add(&t, 1, 4, 0, 0, 0, 0);
+    dlta_add(&t, 1, 5, 2, 0x03, 0x82, 0x11, 0x22); // column 4: the second byte is below the image
+    dlta_add(&t, 1, 4, 1, 0x00, 2, 0xFF); // column 5: 2 rows of 0xFF
+    static const struct {
+        int plane, y, col;
+        uint8_t value;
+    } op5[] = {
+        { 0, 1, 0, 0xA0 }, { 0, 2, 0, 0xA1 }, { 0, 0, 1, 0x55 }, { 0, 1, 1, 0x55 }, { 0, 2, 1, 0x55 },
+        { 0, 3, 1, 0x55 }, { 0, 3, 3, 0xC3 }, { 1, 3, 4, 0x11 }, { 1, 0, 5, 0xFF }, { 1, 1, 5, 0xFF },
+    };
+    delta_frame(base);
+    memcpy(set, base, DELTA_SIZE);
+    memcpy(xored, base, DELTA_SIZE);
+    for (size_t i = 0; i < sizeof(op5) / sizeof(op5[0]); i++) {
+        size_t at = delta_at(op5[i].plane, op5[i].y, op5[i].col);
+        set[at] = op5[i].value;
+        xored[at] = (uint8_t)(base[at] ^ op5[i].value);
+    }
+    expect_delta("DLTA operation 5", 5, 0, &t, set);
+    expect_delta("DLTA operation 5 XOR", 5, ANHD_BITS_XOR, &t, xored);
+
+    // Short data: 3 word columns per row
+    memcpy(expected, base, DELTA_SIZE);
+    expected[delta_at(0, 1, 0)] = 0xA0;
+    expected[delta_at(0, 1, 1)] = 0xA1;
+    expected[delta_at(0, 2, 0)] = 0xB0;
+    expected[delta_at(0, 2, 1)] = 0xB1;
+    for (int y = 0; y < 3; y++) {
+        expected[delta_at(0, y, 2)] = 0x55;
+        expected[delta_at(0, y, 3)] = 0x66;
+    }
+    expected[delta_at(1, 2, 4)] = 0xC0;
+    expected[delta_at(1, 2, 5)] = 0xC1;
+    expected[delta_at(1, 3, 4)] = 0xD0;
+    expected[delta_at(1, 3, 5)] = 0xD1;
+    // Operation 7: op bytes and data words in separate lists
+    dlta_begin(&t);
+    dlta_list(&t, 0);
+    dlta_add(&t, 1, 7, 2, 0x01, 0x82, 1, 0x00, 3, 0); // skip 1, 2 unique words | 3 rows of a word | none
+    dlta_list(&t, 8);
+    dlta_add(&t, 2, 3, 0xA0A1, 0xB0B1, 0x5566);
+    dlta_list(&t, 1);
+    dlta_add(&t, 1, 5, 0, 0, 2, 0x02, 0x82); // column 2: skip 2, 2 unique words
+    dlta_list(&t, 9);
+    dlta_add(&t, 2, 2, 0xC0C1, 0xD0D1);
+    expect_delta("DLTA operation 7", 7, 0, &t, expected);
+    // Operation 8: counts, ops and data all words in one list per plane
+    dlta_begin(&t);
+    dlta_list(&t, 0);
+    dlta_add(&t, 2, 10, 2, 0x0001, 0x8002, 0xA0A1, 0xB0B1, 1, 0x0000, 3, 0x5566, 0);
+    dlta_list(&t, 1);
+    dlta_add(&t, 2, 6, 0, 0, 2, 0x0002, 0x8002, 0xC0C1);
+    dlta_add(&t, 2, 1, 0xD0D1);
+    expect_delta("DLTA operation 8", 8, 0, &t, expected);
+
+    // Long data: a long column and, as the width is not a multiple of 32, a word column per row
+    memcpy(expected, base, DELTA_SIZE);
+    for (int i = 0; i < 4; i++) expected[delta_at(0, 0, i)] = (uint8_t)(i + 1);
+    for (int y = 0; y < DELTA_HEIGHT; y++) {
+        expected[delta_at(0, y, 4)] = 0xEE;
+        expected[delta_at(0, y, 5)] = 0xFF;
+    }
+    for (int y = 2; y < 4; y++) {
+        expected[delta_at(1, y, 0)] = 0xCA;
+        expected[delta_at(1, y, 1)] = 0xFE;
+        expected[delta_at(1, y, 2)] = 0xBA;
+        expected[delta_at(1, y, 3)] = 0xBE;
+    }
+    dlta_begin(&t);
+    dlta_list(&t, 0);
+    dlta_add(&t, 1, 5, 1, 0x81, 1, 0x00, 4); // 1 unique long | 4 rows of a word
+    dlta_list(&t, 8);
+    dlta_add(&t, 4, 1, 0x01020304);
+    dlta_add(&t, 2, 1, 0xEEFF);
+    dlta_list(&t, 1);
+    dlta_add(&t, 1, 5, 2, 0x02, 0x00, 5, 0); // skip 2, 5 rows of a long (3 below the image) | none
+    dlta_list(&t, 9);
+    dlta_add(&t, 4, 1, 0xCAFEBABE);
+    expect_delta("DLTA operation 7 long", 7, ANHD_BITS_LONG, &t, expected);
+    // Operation 8: the items of the word column are words
+    dlta_begin(&t);
+    dlta_list(&t, 0);
+    dlta_add(&t, 4, 3, 1, 0x80000001, 0x01020304);
+    dlta_add(&t, 2, 4, 1, 0x0000, 4, 0xEEFF);
+    dlta_list(&t, 1);
+    dlta_add(&t, 4, 5, 2, 0x00000002, 0x00000000, 5, 0xCAFEBABE);
+    dlta_add(&t, 2, 1, 0);
+    expect_delta("DLTA operation 8 long", 8, ANHD_BITS_LONG, &t, expected);
+
+    // Other operations leave the frame as it is
+    BMHD bmhd;
+    memset(&bmhd, 0, sizeof(bmhd));
+    bmhd.width = DELTA_WIDTH;
+    bmhd.height = DELTA_HEIGHT;
+    bmhd.numPlanes = DELTA_PLANES;
+    AnimHeader anhd;
+    memset(&anhd, 0, sizeof(anhd));
+    anhd.operation = 4;
+    uint8_t planes[DELTA_SIZE];
+    delta_frame(planes);
+    if (anim_apply_delta(&bmhd, &anhd, t.d, t.len, planes) != IFFBPL_ERR_COMPRESSION ||
+        first_diff(planes, base, DELTA_SIZE) < DELTA_SIZE) {
+        fail("DLTA operation 4", "not rejected, or the frame was changed");
+    }
+}
+
+// ---------------------------------------------------------------------------------------------
+// Sample files
+// ---------------------------------------------------------------------------------------------
+
+// Read a whole file, NULL if it cannot be opened or is too large for memory
+static uint8_t* load_file(const char* path, size_t* size) {
+    FILE* f = fopen(path, "rb");
+    if (!f) return NULL;
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    uint8_t* data = (uint8_t*)malloc(len > 0 ? (size_t)len : 1);
+    *size = data ? fread(data, 1, (size_t)len, f) : 0;
+    fclose(f);
+    return data;
+}
+
+// The conversions of the README (bpl2iff -x 768 -y 8 -n 1 -t 1, -x 1536 -y 16 -n 1 -t 2 and
+// -x 320 -y 200 -n 5 -i with the palette after the planes), every one with and without RLE, -r2 and -ri
+static void check_files(const char* dir) {
+    static const struct {
+        const char* name;
+        uint16_t width, height;
+        uint8_t planes;
+        int layout;
+        size_t col_width;
+    } files[] = {
+        { "fonts8.fnt", 768, 8, 1, LAYOUT_COLUMNS, 1 },
+        { "fonts16.fnt", 1536, 16, 1, LAYOUT_COLUMNS, 2 },
+        { "dead.rawb", 320, 200, 5, LAYOUT_INTERLEAVED, 0 },
+    };
+    for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+        char path[1024];
+        size_t size = 0;
+        int len = snprintf(path, sizeof(path), "%s/%s", dir, files[i].name);
+        uint8_t* data = len > 0 && (size_t)len < sizeof(path) ? load_file(path, &size) : NULL;
+        case_seed = rng_state;
+        if (!data) {
+            fail(files[i].name, "cannot read %s (use -d to give the folder of the sample files)", path);
+            continue;
+        }
+        PlanarInput in;
+        memset(&in, 0, sizeof(in));
+        in.data = data;
+        in.layout = files[i].layout;
+        in.height = files[i].height;
+        in.planes = files[i].planes;
+        in.row_bytes = in.in_row_bytes = ilbm_row_bytes(files[i].width);
+        in.col_width = files[i].col_width;
+        in.columns = in.col_width ? in.row_bytes / in.col_width : 0;
+        in.plane_input_size = in.row_bytes * in.height;
+        if (size < in.plane_input_size * in.planes) {
+            fail(files[i].name, "%zu bytes, expected at least %zu", size, in.plane_input_size * in.planes);
+        } else {
+            for (int mode = 0; mode < 4; mode++) {
+                check_ilbm(files[i].name, &in, files[i].width, mode != 0, mode == 2, 1 + mode, mode == 3);
+            }
+        }
+        free(data);
+    }
+}
+
+// ---------------------------------------------------------------------------------------------
+// Parser fuzz target
+// ---------------------------------------------------------------------------------------------
+
+#define FUZZ_MAX_PLANAR (16u << 20) // images decoding to more are only parsed
+
+// 1 if every entry of the BIDX index of a compressed image is where the scanline really starts. An index
+// that only passes body_index_check() may legally make the decoders entering through it produce other rows.
+static int index_matches(const IlbmImage* img) {
+    size_t row_bytes = ilbm_row_bytes(img->bmhd.width), total = (size_t)img->bmhd.height * ilbm_body_planes(&img->bmhd);
+    if (body_index_check(img->body_index, img->body_index_size, &img->bmhd, img->body_size) != IFFBPL_OK) return 1;
+    for (size_t s = 0, pos = 0; s < total; s++) {
+        if (body_index_offset(img->body_index, s) != pos) return 0;
+        pos += skip_packbits_rows(img->body + pos, img->body_size - pos, row_bytes, 1);
+    }
+    return 1;
+}
+
+// Decode a parsed image on one thread, in parallel and by row range; the results must agree
+static void fuzz_image(const IlbmImage* img) {
+    if (!img->found_bmhd || !img->body || !img->bmhd.width || !img->bmhd.height) return;
+    size_t size = ilbm_body_planar_size(&img->bmhd);
+    if (size == 0 || size > FUZZ_MAX_PLANAR) return;
+    uint8_t* a = (uint8_t*)malloc(size);
+    uint8_t* b = (uint8_t*)malloc(size);
+    if (a && b) {
+        size_t short_a = 0, short_b = 0;
+        int rc = ilbm_decode_body(img, a, &short_a);
+        int rc_b = ilbm_decode_body_parallel(img, b, &short_b, 3);
+        int same = img->bmhd.compression != 1 || !img->body_index || index_matches(img);
+        if (rc != rc_b || (rc == IFFBPL_OK && same && (short_a != short_b || memcmp(a, b, size) != 0))) abort();
+        if (rc == IFFBPL_OK) {
+            // The last rows through the row entry point, as -rect does
+            size_t row = size / img->bmhd.height, y0 = img->bmhd.height / 2;
+            rc_b = ilbm_decode_rows(img, y0, img->bmhd.height - y0, b, NULL);
+            if (rc_b != IFFBPL_OK || (same && memcmp(a + y0 * row, b, (img->bmhd.height - y0) * row) != 0)) abort();
+            uint8_t planes = img->bmhd.numPlanes;
+            size_t chunky = (size_t)img->bmhd.width * img->bmhd.height * ilbm_chunky_pixel_bytes(planes);
+            if (!img->bmhd.masking && planes && chunky <= FUZZ_MAX_PLANAR) {
+                uint8_t* c = (uint8_t*)malloc(chunky);
+                if (c) convert_to_chunky(a, size, c, img->bmhd.width, img->bmhd.height, planes, 0);
+                free(c);
+            }
+        }
+    }
+    free(a);
+    free(b);
+}
+
+// Apply the DLTA chunks of an ANIM to the first frame, as iff2bpl does
+static void fuzz_anim(const uint8_t* data, size_t size) {
+    AnimIter it;
+    AnimFrame frame;
+    if (anim_begin(data, size, &it) != IFFBPL_OK || !anim_next(&it, &frame)) return;
+    fuzz_image(&frame.ilbm);
+    BMHD bmhd = frame.ilbm.bmhd;
+    size_t planar = frame.ilbm.found_bmhd ? ilbm_planar_size(&bmhd) : 0;
+    uint8_t* planes = planar && planar <= FUZZ_MAX_PLANAR ? (uint8_t*)calloc(1, planar) : NULL;
+    for (int n = 0; n < 1000 && anim_next(&it, &frame); n++) {
+        if (planes && frame.found_anhd && frame.dlta) {
+            anim_apply_delta(&bmhd, &frame.anhd, frame.dlta, frame.dlta_size, planes);
+        }
+    }
+    free(planes);
+}
+
+// Index the chunks of the FORM from their headers alone, as --info does without reading the data
+static void fuzz_chunk_index(const uint8_t* data, size_t size) {
+    ChunkIndex idx;
+    if (size < 12 || chunk_index_begin(&idx, data, 0) != IFFBPL_OK) return;
+    while (!chunk_index_done(&idx) && idx.next + 8 <= size) {
+        IffChunk c;
+        chunk_index_add(&idx, data + idx.next, &c);
+    }
+    chunk_find(&idx, "BODY");
+}
+
+static void fuzz_pack(const uint8_t* data, size_t size) {
+    uint32_t num_entries, toc_offset;
+    if (size < PACK_HEADER_SIZE || pack_parse_header(data, size, &num_entries, &toc_offset) != IFFBPL_OK) return;
+    for (uint32_t i = 0; i < num_entries && i < 10000; i++) {
+        PackEntry e;
+        if (pack_get_entry(data, size, i, &e) != IFFBPL_OK) break;
+    }
+}
+
+// One fuzz input: an ILBM, an ANIM or a pack file
+static void fuzz_one(const uint8_t* data, size_t size) {
+    IlbmImage img;
+    if (ilbm_parse(data, size, &img) == IFFBPL_OK) {
+        if (img.body_index) body_index_check(img.body_index, img.body_index_size, &img.bmhd, img.body_size);
+        fuzz_image(&img);
+    }
+    fuzz_anim(data, size);
+    fuzz_chunk_index(data, size);
+    fuzz_pack(data, size);
+}
+
+#ifdef CHECK_LIBFUZZER
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size);
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    fuzz_one(data, size);
+    return 0;
+}
+#else
+
+// Append an item of 'size' bytes, big-endian
+static void put_item(uint8_t* p, size_t* len, uint32_t v, size_t size) {
+    for (size_t i = 0; i < size; i++) p[(*len)++] = (uint8_t)(v >> (8 * (size - 1 - i)));
+}
+
+// A random DLTA of an operation 5, 7 or 8 frame that is valid for the geometry: every column of a changed
+// plane gets up to 3 skip, repeat and unique ops, some of them reaching below the image. NULL if out of memory.
+static uint8_t* random_dlta(const BMHD* bmhd, uint8_t operation, int long_data, size_t* dlta_size) {
+    size_t row_bytes = ilbm_row_bytes(bmhd->width);
+    size_t item = operation == 5 ? 1 : long_data ? 4 : 2;
+    size_t list_cap = row_bytes * 128; // a column takes at most 4 + 3 * (8 + 8 * 4) bytes
+    uint8_t* dlta = (uint8_t*)calloc(1, 64 + 8 * 2 * list_cap);
+    uint8_t* ops = (uint8_t*)malloc(list_cap);
+    uint8_t* data = (uint8_t*)malloc(list_cap);
+    if (!dlta || !ops || !data) {
+        free(dlta);
+        free(ops);
+        free(data);
+        return NULL;
+    }
+    size_t len = 64;
+    for (int p = 0; p < bmhd->numPlanes && p < 8; p++) {
+        if (rnd(4) == 0) continue; // unchanged
+        size_t ops_len = 0, data_len = 0;
+        for (size_t col = 0; col < row_bytes; col += item) {
+            size_t size = row_bytes - col < item ? row_bytes - col : item;
+            // Operation 7 has its op bytes in a list of their own, the others take them from the data list
+            size_t op_size = operation == 8 ? size : 1;
+            uint8_t* op_list = operation == 7 ? ops : data;
+            size_t* op_len = operation == 7 ? &ops_len : &data_len;
+            uint32_t uniq_flag = op_size == 1 ? 0x80u : op_size == 2 ? 0x8000u : 0x80000000u;
+            unsigned num_ops = rnd(4);
+            put_item(op_list, op_len, num_ops, op_size);
+            while (num_ops--) {
+                unsigned kind = rnd(3);
+                if (kind == 0) {
+                    put_item(op_list, op_len, 1 + rnd(bmhd->height < 100 ? bmhd->height + 2 : 100), op_size);
+                } else if (kind == 1) {
+                    put_item(op_list, op_len, 0, op_size);
+                    put_item(op_list, op_len, rnd(bmhd->height < 250 ? bmhd->height + 3 : 250), op_size);
+                    put_item(data, &data_len, rng(), size);
+                } else {
+                    unsigned count = rnd(9);
+                    put_item(op_list, op_len, uniq_flag | count, op_size);
+                    for (; count > 0; count--) put_item(data, &data_len, rng(), size);
+                }
+            }
+        }
+        put_be32(dlta + p * 4, (uint32_t)len);
+        if (operation == 7) {
+            memcpy(dlta + len, ops, ops_len);
+            len += ops_len;
+            put_be32(dlta + 32 + p * 4, (uint32_t)len);
+        }
+        memcpy(dlta + len, data, data_len);
+        len += data_len;
+    }
+    free(ops);
+    free(data);
+    *dlta_size = len;
+    return dlta;
+}
+
+// A FORM ANIM of two frames: the FORM ILBM 'form', then a FORM ILBM of an ANHD and the DLTA
+static uint8_t* build_anim(const uint8_t* form, size_t form_size, const uint8_t* anhd, const uint8_t* dlta,
+                           size_t dlta_size, size_t* anim_size) {
+    size_t frame_size = 4 + 8 + 40 + 8 + dlta_size + (dlta_size & 1);
+    size_t size = 12 + form_size + (form_size & 1) + 8 + frame_size;
+    uint8_t* anim = (uint8_t*)calloc(1, size);
+    if (!anim) return NULL;
+    memcpy(anim, "FORM", 4);
+    put_be32(anim + 4, (uint32_t)(size - 8));
+    memcpy(anim + 8, "ANIM", 4);
+    memcpy(anim + 12, form, form_size);
+    uint8_t* p = anim + 12 + form_size + (form_size & 1);
+    memcpy(p, "FORM", 4);
+    put_be32(p + 4, (uint32_t)frame_size);
+    memcpy(p + 8, "ILBMANHD", 8);
+    put_be32(p + 16, 40);
+    memcpy(p + 20, anhd, 40);
+    memcpy(p + 60, "DLTA", 4);
+    put_be32(p + 64, (uint32_t)dlta_size);
+    memcpy(p + 68, dlta, dlta_size);
+    *anim_size = size;
+    return anim;
+}
+
+// Damaged copies of valid files: flipped bytes, chunk sizes made too large and cut off data. Every file is
+// also the first frame of a two frame ANIM with a random DLTA, which must apply cleanly before it is damaged.
+static void check_fuzz(int rounds) {
+    for (int r = 0; r < rounds; r++) {
+        case_seed = rng_state;
+        uint16_t width, height;
+        uint8_t planes;
+        random_geometry(&width, &height, &planes, 0);
+        PlanarInput in;
+        memset(&in, 0, sizeof(in));
+        in.layout = LAYOUT_INTERLEAVED;
+        in.height = height;
+        in.planes = planes;
+        in.row_bytes = in.in_row_bytes = ilbm_row_bytes(width);
+        size_t raw = in.row_bytes * planes * height;
+        uint8_t* data = (uint8_t*)malloc(raw + 1);
+        if (!data) return;
+        fill_data(data, raw);
+        in.data = data;
+        BMHD bmhd;
+        memset(&bmhd, 0, sizeof(bmhd));
+        bmhd.width = width;
+        bmhd.height = height;
+        bmhd.numPlanes = planes;
+        bmhd.compression = (uint8_t)rnd(2);
+        size_t form_size;
+        uint8_t* form = ilbm_build(&bmhd, NULL, 0, &in, 1, 0, &form_size, NULL);
+        uint8_t anhd[40] = { 0 };
+        anhd[0] = (uint8_t)(rnd(3) == 0 ? 5 : 7 + rnd(2));
+        anhd[18] = (uint8_t)rnd(3); // interleave
+        put_be32(anhd + 20, rng() & (ANHD_BITS_LONG | ANHD_BITS_XOR));
+        size_t dlta_size = 0, anim_size = 0;
+        uint8_t* dlta = random_dlta(&bmhd, anhd[0], (anhd[23] & ANHD_BITS_LONG) != 0, &dlta_size);
+        uint8_t* anim = form && dlta ? build_anim(form, form_size, anhd, dlta, dlta_size, &anim_size) : NULL;
+        if (anim) {
+            AnimHeader h;
+            parse_anhd(anhd, &h);
+            int rc = anim_apply_delta(&bmhd, &h, dlta, dlta_size, data);
+            if (rc != IFFBPL_OK) {
+                fail("ANIM", "%ux%u %u planes, operation %u%s: valid DLTA of %zu bytes gives %d", width, height, planes,
+                     h.operation, h.bits & ANHD_BITS_LONG ? " long" : "", dlta_size, rc);
+            }
+            fuzz_one(anim, anim_size);
+            for (unsigned k = 1 + rnd(8); k > 0; k--) {
+                size_t at = rnd((unsigned)anim_size);
+                anim[at] = rnd(3) ? (uint8_t)rng() : (uint8_t)(anim[at] ^ 0x80);
+            }
+            fuzz_one(anim, rnd(4) ? anim_size : rnd((unsigned)anim_size + 1));
+        }
+        free(anim);
+        free(dlta);
+        if (form) {
+            for (unsigned k = 1 + rnd(8); k > 0; k--) {
+                size_t at = rnd((unsigned)form_size);
+                form[at] = rnd(3) ? (uint8_t)rng() : (uint8_t)(form[at] ^ 0x80);
+            }
+            fuzz_one(form, rnd(4) ? form_size : rnd((unsigned)form_size + 1));
+            // The same bytes as an ANIM and as a pack
+            if (form_size >= 12) {
+                memcpy(form + 8, "ANIM", 4);
+                fuzz_one(form, form_size);
+                memcpy(form, "BPAK", 4);
+                fuzz_one(form, form_size);
+            }
+        }
+        free(form);
+        free(data);
+    }
+}
+
+// Length of the folder part of a path ("" -> 0), for both / and \ separators
+static size_t dir_length(const char* path) {
+    size_t n = strlen(path);
+    while (n > 0 && path[n - 1] != '/' && path[n - 1] != '\\') n--;
+    return n;
+}
+
+// Folder of the sample files when -d is not given: the folder this file was compiled from, tests/ next to
+// the executable (built in the repository root) or the folder of the executable, whichever holds
+// dead.rawb. Independent of the current directory; the source folder is kept if none of them has it,
+// so the sample file check fails with that path.
+static void default_tests_dir(const char* argv0, char dir[512]) {
+    char candidates[3][512], probe[1024];
+    size_t n = dir_length(__FILE__);
+    snprintf(candidates[0], sizeof(candidates[0]), "%.*s", (int)(n ? n - 1 : 0), __FILE__);
+    if (!n) snprintf(candidates[0], sizeof(candidates[0]), ".");
+    n = dir_length(argv0);
+    snprintf(candidates[1], sizeof(candidates[1]), "%.*stests", (int)n, argv0);
+    snprintf(candidates[2], sizeof(candidates[2]), "%.*s", (int)(n ? n - 1 : 1), n ? argv0 : ".");
+    for (int i = 0; i < 3; i++) {
+        int len = snprintf(probe, sizeof(probe), "%s/dead.rawb", candidates[i]);
+        FILE* f = len > 0 && (size_t)len < sizeof(probe) ? fopen(probe, "rb") : NULL;
+        if (f) {
+            fclose(f);
+            memcpy(dir, candidates[i], sizeof(candidates[i]));
+            return;
+        }
+    }
+    memcpy(dir, candidates[0], sizeof(candidates[0]));
+}
+
+int main(int argc, char* argv[]) {
+    int rounds = 200;
+    uint32_t seed = 1;
+    const char* dir = NULL;
+    char default_dir[512];
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            rounds = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-seed") == 0 && i + 1 < argc) {
+            seed = (uint32_t)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+            dir = argv[++i];
+        } else if (strcmp(argv[i], "-fuzz") == 0) {
+            // Every further argument is an input file for the fuzz target
+            for (i++; i < argc; i++) {
+                size_t size = 0;
+                uint8_t* data = load_file(argv[i], &size);
+                if (!data) {
+                    fprintf(stderr, "Cannot read %s\n", argv[i]);
+                    return 1;
+                }
+                fuzz_one(data, size);
+                free(data);
+            }
+            return 0;
+        } else {
+            fprintf(stderr, "Usage: %s [-n rounds] [-seed n] [-d tests_dir] [-fuzz file ...]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    static const struct {
+        const char* name;
+        void (*run)(int rounds);
+    } checks[] = {
+        { "PackBits decoding", check_packbits_decode },
+        { "PackBits encoding", check_packbits_encode },
+        { "chunky/planar", check_chunky },
+        { "bitplane layouts", check_layouts },
+        { "bpl2iff scanlines", check_scanlines },
+        { "BODY round trip", check_body_round_trip },
+        { "palette", check_palette },
+        { "ANIM deltas", check_anim_deltas },
+        { "parser fuzz", check_fuzz },
+    };
+    for (size_t c = 0; c < sizeof(checks) / sizeof(checks[0]); c++) {
+        int before = failures;
+        rng_state = seed ? seed : 1;
+        checks[c].run(rounds);
+        printf("%-20s %s\n", checks[c].name, failures == before ? "ok" : "FAILED");
+        fflush(stdout);
+    }
+    if (!dir) {
+        default_tests_dir(argv[0], default_dir);
+        dir = default_dir;
+    }
+    int before = failures;
+    check_files(dir);
+    printf("%-20s %s\n", "sample files", failures == before ? "ok" : "FAILED");
+    printf("%d failure%s\n", failures, failures == 1 ? "" : "s");
+    return failures;
+}
+#endif